@@ -0,0 +1,412 @@
+/*
+ * Copyright 2018 Oticon A/S
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+/**
+ * Back channel throughput and latency benchmark
+ *
+ * For each combination of transport, message size, number of channels and
+ * polling pattern, a pair of "devices" (processes) is spawned, which open
+ * that many back channels in between them (as any device would, with
+ * bs_open_back_channel() / bs_open_back_channel_shm()), and:
+ *  * Throughput: device 0 sends <n> messages round robin thru all channels as
+ *    fast as it can, and device 1 receives them all and then acknowledges.
+ *  * Latency: device 0 sends <rtt_n> messages, one at a time, round robin
+ *    thru all channels, and device 1 echoes each back thru the same channel.
+ *    The round trip time of each one is measured.
+ * The waiting side either checks each channel in turn with
+ * bs_bc_is_msg_received() ("check" pattern) or blocks in bs_bc_poll()
+ * ("poll" pattern).
+ *
+ * One result line per combination is printed in stdout, as CSV or JSON.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "bs_types.h"
+#include "bs_tracing.h"
+#include "bs_oswrap.h"
+#include "bs_utils.h"
+#include "bs_cmd_line.h"
+#include "bs_pc_base.h"
+#include "bs_pc_base_fifo_user.h"
+#include "bs_pc_backchannel.h"
+
+#define BENCH_MAX_LIST 32
+
+typedef enum {T_FIFO = 0, T_SHM} transport_t;
+typedef enum {P_CHECK = 0, P_POLL} pattern_t;
+
+static const char *transport_names[] = {"fifo", "shm"};
+static const char *pattern_names[] = {"check", "poll"};
+
+typedef struct {
+  char *sizes;
+  char *channels;
+  char *patterns;
+  char *transports;
+  uint n;
+  uint rtt_n;
+  uint max_mb;
+  bool json;
+  char *s_id;
+} bench_args_t;
+
+typedef struct {
+  transport_t transport;
+  uint size;
+  uint n_channels;
+  pattern_t pattern;
+  uint n; //Messages in the throughput test
+  uint rtt_n; //Messages in the latency test
+} bench_cfg_t;
+
+typedef struct {
+  double seconds;
+  double rtt_p50_us;
+  double rtt_p90_us;
+  double rtt_p99_us;
+  double rtt_max_us;
+} bench_result_t;
+
+char executable_name[] = "bs_bc_bench";
+void component_print_post_help(){
+  fprintf(stdout,
+"\nBack channel throughput and latency benchmark.\n"
+"For each combination of transport, message size, number of channels and\n"
+"polling pattern, a pair of processes exchange messages thru back channels.\n"
+"One line of results is printed for each combination (CSV by default)\n"
+"Lists are given comma separated, e.g. -sizes=16,4096\n\n");
+}
+
+static uint64_t now_ns(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Wait until there is a message in any of the <n_ch> channels, and return
+ * the id of that channel
+ * <rr> keeps where the round robin check should continue
+ */
+static uint wait_msg(uint *ids, uint n_ch, pattern_t pattern, uint *rr){
+  while ( true ) {
+    if ( pattern == P_POLL ) {
+      uint ready;
+      if ( bs_bc_poll(&ready, 1, -1) == 1 ) {
+        int n = bs_bc_is_msg_received(ready);
+        if ( n > 0 ) {
+          return ready;
+        } else if ( n < 0 ) {
+          bs_trace_error_line("Back channel %u closed unexpectedly\n", ready);
+        }
+      }
+    } else {
+      for ( uint i = 0; i < n_ch; i++ ) {
+        uint c = ids[*rr];
+        *rr = ( *rr + 1 ) % n_ch;
+        int n = bs_bc_is_msg_received(c);
+        if ( n > 0 ) {
+          return c;
+        } else if ( n < 0 ) {
+          bs_trace_error_line("Back channel %u closed unexpectedly\n", c);
+        }
+      }
+    }
+  }
+}
+
+/*
+ * Wait until there is a message in channel <id>, and receive it in <buf>
+ */
+static void receive_from(uint id, uint8_t *buf, pattern_t pattern){
+  int n;
+  while ( ( n = bs_bc_is_msg_received(id) ) == 0 ) {
+    if ( pattern == P_POLL ) {
+      uint ready;
+      (void)bs_bc_poll(&ready, 1, -1);
+    }
+  }
+  if ( n < 0 ) {
+    bs_trace_error_line("Back channel %u closed unexpectedly\n", id);
+  }
+  bs_bc_receive_msg(id, buf, n);
+}
+
+static int cmp_u64(const void *a, const void *b){
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return ( x > y ) - ( x < y );
+}
+
+static double percentile_us(uint64_t *sorted, uint n, double p){
+  uint i = BS_MIN((uint)(p*n), n - 1);
+  return sorted[i]/1e3;
+}
+
+/*
+ * Body of each of the 2 devices for one benchmark run
+ * Device 0 writes the results into <result_fd>
+ */
+static void run_device(uint dev, const bench_cfg_t *cfg, const char *s_id, int result_fd){
+  char prefix[10];
+  sprintf(prefix, "d_%u", dev);
+  bs_trace_set_prefix(prefix);
+
+  //We are not connected to any phy, but pretend so to use the back channels
+  extern bool is_base_com_initialized;
+  pb_com_path_length = pb_create_com_folder(s_id);
+  is_base_com_initialized = true;
+
+  uint dev_nbrs[cfg->n_channels], channel_nbrs[cfg->n_channels];
+  for ( uint i = 0; i < cfg->n_channels; i++ ) {
+    dev_nbrs[i] = 1 - dev;
+    channel_nbrs[i] = i;
+  }
+  uint *ids;
+  if ( cfg->transport == T_SHM ) {
+    ids = bs_open_back_channel_shm(dev, dev_nbrs, channel_nbrs, cfg->n_channels);
+  } else {
+    ids = bs_open_back_channel(dev, dev_nbrs, channel_nbrs, cfg->n_channels);
+  }
+  if ( ids == NULL ) {
+    bs_trace_error_line("Could not open the back channels\n");
+  }
+
+  uint8_t *buf = bs_calloc(BS_MAX(cfg->size, 1), 1);
+  uint rr = 0;
+
+  if ( dev == 0 ) {
+    bench_result_t result;
+    uint64_t *rtt = bs_malloc(cfg->rtt_n*sizeof(uint64_t));
+
+    uint64_t start = now_ns();
+    for ( uint i = 0; i < cfg->n; i++ ) {
+      bs_bc_send_msg(ids[i % cfg->n_channels], buf, cfg->size);
+    }
+    receive_from(ids[0], buf, cfg->pattern); //Acknowledge
+    result.seconds = (now_ns() - start)/1e9;
+
+    for ( uint i = 0; i < cfg->rtt_n; i++ ) {
+      uint id = ids[i % cfg->n_channels];
+      uint64_t t0 = now_ns();
+      bs_bc_send_msg(id, buf, cfg->size);
+      receive_from(id, buf, cfg->pattern);
+      rtt[i] = now_ns() - t0;
+    }
+
+    if ( cfg->rtt_n > 0 ) {
+      qsort(rtt, cfg->rtt_n, sizeof(uint64_t), cmp_u64);
+      result.rtt_p50_us = percentile_us(rtt, cfg->rtt_n, 0.50);
+      result.rtt_p90_us = percentile_us(rtt, cfg->rtt_n, 0.90);
+      result.rtt_p99_us = percentile_us(rtt, cfg->rtt_n, 0.99);
+      result.rtt_max_us = rtt[cfg->rtt_n - 1]/1e3;
+    } else {
+      result.rtt_p50_us = result.rtt_p90_us = result.rtt_p99_us = result.rtt_max_us = 0;
+    }
+    if ( write(result_fd, &result, sizeof(result)) != sizeof(result) ) {
+      bs_trace_error_line("Could not pass the results to the main process\n");
+    }
+    free(rtt);
+  } else {
+    for ( uint i = 0; i < cfg->n; i++ ) {
+      uint id = wait_msg(ids, cfg->n_channels, cfg->pattern, &rr);
+      bs_bc_receive_msg(id, buf, bs_bc_is_msg_received(id));
+    }
+    uint8_t ack = 0;
+    bs_bc_send_msg(ids[0], &ack, 1);
+
+    for ( uint i = 0; i < cfg->rtt_n; i++ ) {
+      uint id = ids[i % cfg->n_channels];
+      receive_from(id, buf, cfg->pattern);
+      bs_bc_send_msg(id, buf, cfg->size);
+    }
+  }
+
+  free(buf);
+  bs_clean_back_channels();
+  exit(0);
+}
+
+/*
+ * Run one benchmark configuration in a fresh pair of processes
+ * Returns 0 on success
+ */
+static int run_cfg(const bench_cfg_t *cfg, const char *s_id, bench_result_t *result){
+  int fds[2];
+  if ( pipe(fds) != 0 ) {
+    bs_trace_error_line("Could not create a pipe\n");
+  }
+  fflush(stdout);
+
+  pid_t pids[2];
+  for ( uint dev = 0; dev < 2; dev++ ) {
+    pids[dev] = fork();
+    if ( pids[dev] == 0 ) {
+      close(fds[0]);
+      run_device(dev, cfg, s_id, fds[1]);
+    } else if ( pids[dev] == -1 ) {
+      bs_trace_error_line("Could not fork\n");
+    }
+  }
+  close(fds[1]);
+
+  int ok = ( read(fds[0], result, sizeof(*result)) == sizeof(*result) );
+  close(fds[0]);
+  for ( uint dev = 0; dev < 2; dev++ ) {
+    int status;
+    waitpid(pids[dev], &status, 0);
+    ok &= WIFEXITED(status) && ( WEXITSTATUS(status) == 0 );
+  }
+  return ok ? 0 : -1;
+}
+
+/*
+ * Parse the comma separated list <str> of numbers into <list>
+ * Returns the number of elements
+ */
+static uint parse_uint_list(const char *str, uint *list, const char *what){
+  uint n = 0;
+  char *copy = bs_calloc(strlen(str) + 1, 1);
+  strcpy(copy, str);
+  for ( char *tok = strtok(copy, ","); tok != NULL; tok = strtok(NULL, ",") ) {
+    char *end;
+    long v = strtol(tok, &end, 0);
+    if ( ( *end != 0 ) || ( v < 0 ) || ( n >= BENCH_MAX_LIST ) ) {
+      bs_trace_error_line("Invalid %s list \"%s\"\n", what, str);
+    }
+    list[n++] = v;
+  }
+  free(copy);
+  return n;
+}
+
+/*
+ * Parse the comma separated list <str> of names (out of <names>) into <list>
+ */
+static uint parse_name_list(const char *str, uint *list, const char **names, uint n_names,
+                            const char *what){
+  uint n = 0;
+  char *copy = bs_calloc(strlen(str) + 1, 1);
+  strcpy(copy, str);
+  for ( char *tok = strtok(copy, ","); tok != NULL; tok = strtok(NULL, ",") ) {
+    uint i;
+    for ( i = 0; i < n_names; i++ ) {
+      if ( strcmp(tok, names[i]) == 0 ) {
+        break;
+      }
+    }
+    if ( ( i == n_names ) || ( n >= BENCH_MAX_LIST ) ) {
+      bs_trace_error_line("Invalid %s list \"%s\"\n", what, str);
+    }
+    list[n++] = i;
+  }
+  free(copy);
+  return n;
+}
+
+static void print_header(bool json){
+  if ( !json ) {
+    printf("transport,size,channels,pattern,msgs,seconds,msgs_per_s,MB_per_s,"
+           "rtt_msgs,rtt_p50_us,rtt_p90_us,rtt_p99_us,rtt_max_us\n");
+  }
+}
+
+static void print_result(bool json, const bench_cfg_t *cfg, const bench_result_t *r){
+  double msgs_per_s = cfg->n/r->seconds;
+  double mb_per_s = (double)cfg->n*cfg->size/r->seconds/1e6;
+  if ( json ) {
+    printf("{\"transport\":\"%s\",\"size\":%u,\"channels\":%u,\"pattern\":\"%s\","
+           "\"msgs\":%u,\"seconds\":%.6f,\"msgs_per_s\":%.1f,\"MB_per_s\":%.3f,"
+           "\"rtt_msgs\":%u,\"rtt_p50_us\":%.2f,\"rtt_p90_us\":%.2f,\"rtt_p99_us\":%.2f,"
+           "\"rtt_max_us\":%.2f}\n",
+           transport_names[cfg->transport], cfg->size, cfg->n_channels,
+           pattern_names[cfg->pattern], cfg->n, r->seconds, msgs_per_s, mb_per_s,
+           cfg->rtt_n, r->rtt_p50_us, r->rtt_p90_us, r->rtt_p99_us, r->rtt_max_us);
+  } else {
+    printf("%s,%u,%u,%s,%u,%.6f,%.1f,%.3f,%u,%.2f,%.2f,%.2f,%.2f\n",
+           transport_names[cfg->transport], cfg->size, cfg->n_channels,
+           pattern_names[cfg->pattern], cfg->n, r->seconds, msgs_per_s, mb_per_s,
+           cfg->rtt_n, r->rtt_p50_us, r->rtt_p90_us, r->rtt_p99_us, r->rtt_max_us);
+  }
+  fflush(stdout);
+}
+
+int main(int argc, char *argv[]){
+  bench_args_t args;
+  static char default_sizes[] = "16,256,4096,65536";
+  static char default_channels[] = "1,8";
+  static char default_patterns[] = "check,poll";
+  static char default_transports[] = "fifo,shm";
+  static char default_s_id[] = "bs_bc_bench";
+
+  bs_args_struct_t args_struct[] = {
+      { false, false, false, "sizes", "sizes", 's', (void*)&args.sizes, NULL, "Message sizes in bytes (16,256,4096,65536)"},
+      { false, false, false, "channels", "channels", 's', (void*)&args.channels, NULL, "Number of channels in between the 2 devices (1,8)"},
+      { false, false, false, "patterns", "patterns", 's', (void*)&args.patterns, NULL, "Polling patterns: check and/or poll (check,poll)"},
+      { false, false, false, "transports", "transports", 's', (void*)&args.transports, NULL, "Transports: fifo and/or shm (fifo,shm)"},
+      { false, false, false, "n", "nbr_msgs", 'u', (void*)&args.n, NULL, "Messages sent in each throughput measurement (20000)"},
+      { false, false, false, "rtt_n", "nbr_msgs", 'u', (void*)&args.rtt_n, NULL, "Messages sent in each latency measurement (2000)"},
+      { false, false, false, "max_mb", "MB", 'u', (void*)&args.max_mb, NULL, "Limit the number of throughput messages so no more than this is sent (256)"},
+      { false, false, true, "json", "json", 'b', (void*)&args.json, NULL, "Print results as JSON lines instead of CSV"},
+      { false, false, false, "s", "s_id", 's', (void*)&args.s_id, NULL, "Simulation id used for the back channels com folder (bs_bc_bench)"},
+      ARG_TABLE_ENDMARKER
+  };
+
+  bs_args_set_defaults(args_struct);
+  args.sizes = default_sizes;
+  args.channels = default_channels;
+  args.patterns = default_patterns;
+  args.transports = default_transports;
+  args.n = 20000;
+  args.rtt_n = 2000;
+  args.max_mb = 256;
+  args.s_id = default_s_id;
+  bs_args_parse_cmd_line(argc, argv, args_struct);
+
+  uint sizes[BENCH_MAX_LIST], channels[BENCH_MAX_LIST];
+  uint patterns[BENCH_MAX_LIST], transports[BENCH_MAX_LIST];
+  uint n_sizes = parse_uint_list(args.sizes, sizes, "sizes");
+  uint n_channels = parse_uint_list(args.channels, channels, "channels");
+  uint n_patterns = parse_name_list(args.patterns, patterns, pattern_names, 2, "patterns");
+  uint n_transports = parse_name_list(args.transports, transports, transport_names, 2, "transports");
+
+  print_header(args.json);
+
+  int failures = 0;
+  for ( uint t = 0; t < n_transports; t++ ) {
+    for ( uint c = 0; c < n_channels; c++ ) {
+      for ( uint s = 0; s < n_sizes; s++ ) {
+        for ( uint p = 0; p < n_patterns; p++ ) {
+          bench_cfg_t cfg;
+          bench_result_t result;
+          cfg.transport = transports[t];
+          cfg.n_channels = BS_MAX(channels[c], 1);
+          cfg.size = BS_MAX(sizes[s], 1); //Empty messages are not sent
+          cfg.pattern = patterns[p];
+          cfg.n = args.n;
+          cfg.n = BS_MIN(cfg.n, BS_MAX((uint64_t)args.max_mb*1024*1024/cfg.size, 1));
+          cfg.rtt_n = args.rtt_n;
+
+          if ( run_cfg(&cfg, args.s_id, &result) != 0 ) {
+            bs_trace_warning_line("Run %s, %u bytes, %u channels, %s failed\n",
+                                  transport_names[cfg.transport], cfg.size,
+                                  cfg.n_channels, pattern_names[cfg.pattern]);
+            failures++;
+            continue;
+          }
+          print_result(args.json, &cfg, &result);
+        }
+      }
+    }
+  }
+
+  return failures ? 1 : 0;
+}
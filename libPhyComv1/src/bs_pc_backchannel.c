@@ -24,12 +24,61 @@
  *  * The channel is *non* *blocking*
  *  * Before any read you shall check if there is anything to be read (you will
  *    get an error if you try to read from an empty back channel).
- *  * Writes are also non blocking, if there is no space in the channel the
- *    write will fail:
- *    * You cannot have more pending data in any given channel than 64KB in
- *      Linux
- *    * To avoid problems you should not send messages bigger than PIPE_BUF
- *      ( 4K in Linux, to be POSIX portable 512B ) - 4 bytes
+ *  * Writes are also non blocking. If there is no space in the channel, the
+ *    data which did not fit is kept in a per channel overflow queue (in this
+ *    process memory), and moved into the channel as soon as the other side
+ *    makes space: on the next send, check or poll in this device, or when
+ *    calling bs_bc_flush().
+ *    Messages are received only once they have fully arrived, so they can
+ *    be of any size.
+ *    FIFOs are read ahead: all that is available is read at once into a
+ *    per channel buffer, from which the following messages are then taken,
+ *    so many small messages do not cost one system call each.
+ *  * The channel capacity (by default 64KB in Linux) can be changed with
+ *    bs_bc_set_default_capacity() before opening the channels, or (for FIFOs)
+ *    with bs_bc_set_capacity() afterwards.
+ *    bs_bc_get_stats() tells how much the channel and its queue have filled up
+ *
+ * Channels can be carried either over a pair of named FIFOs
+ * (bs_open_back_channel()) or over a pair of shared memory rings
+ * (bs_open_back_channel_shm()).
+ * Both sides of a channel must use the same transport.
+ * With shared memory, checking for a message is just a memory read, and
+ * sending one a copy into the ring, so no system calls are needed.
+ * A shared memory message (+4 bytes) cannot be bigger than the ring capacity,
+ * unless it is sent as a large message:
+ *
+ * Messages bigger than a threshold (bs_bc_set_large_msg_threshold(), by
+ * default 64KB) are not copied thru the channel: they are written into their
+ * own shared memory segment file in the com folder, and only a small
+ * descriptor of it is sent thru the channel. The receiver reads the message
+ * directly from that segment, which is deleted once all its readers are done.
+ * Readers which close their side release the ones they did not read, and the
+ * sender releases them for readers which died or never attached.
+ *
+ * Channels can also be added one or several at a time, without blocking,
+ * with bs_add_back_channel()/bs_add_back_channel_shm(). The sending side of
+ * those is opened when the other device has opened its receiving side.
+ *
+ * To send the same messages to several devices, a broadcast channel can be
+ * opened with bs_bc_open_broadcast_tx() (and bs_bc_open_broadcast_rx() by
+ * each receiver). Each message is then written only once into a shared memory
+ * log, from which each receiver reads at its own pace.
+ *
+ * Besides bs_bc_send_msg(), bs_bc_send_msgv() can be used to send a message
+ * scattered in several buffers, and bs_bc_send_msgs() to send a batch of
+ * messages (to one or several channels) with as few system calls as possible.
+ * To find which channels have something pending, instead of checking each
+ * with bs_bc_is_msg_received(), bs_bc_poll() can be used, which can also
+ * block until something arrives.
+ *
+ * Messages can be stamped with the sender simulated time
+ * (bs_bc_set_time_stamped()). The receiver holds each stamped message until
+ * its own simulated time reaches the stamp, so the delivery does not depend on
+ * when the host scheduled each process. bs_bc_next_delivery_time() tells when
+ * the next held message will be delivered.
+ * Both devices must have registered their time function with
+ * bs_bc_register_time_function().
  */
 
 #include <stdbool.h>
@@ -39,26 +88,183 @@
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "bs_pc_base_fifo_user.h"
+#include "bs_pc_backchannel_shm.h"
+#include "bs_pc_backchannel_bcast.h"
 #include "bs_tracing.h"
 #include "bs_oswrap.h"
+#include "bs_utils.h"
+#include "bs_pc_backchannel.h"
 
 static bool channel_opened;
+static bool blocking_opened; //Channels were opened with a blocking bs_open_back_channel[_shm]()
 
 typedef enum {In=0, Out} direction_t;
+typedef enum {BC_FIFO=0, BC_SHM, BC_BCAST_TX, BC_BCAST_RX} transport_t;
+
+#if defined(__linux__) && !defined(F_SETPIPE_SZ)
+#define F_SETPIPE_SZ 1031
+#define F_GETPIPE_SZ 1032
+#endif
+
+/*
+ * Large message segment sent thru a channel, kept mapped until all its readers
+ * released it, so it can be released on behalf of those which never will
+ */
+typedef struct {
+  struct bc_large_seg_s *seg;
+  size_t map_size;
+  char *path;
+  uint64_t end; //Channel bytes sent up to the end of its descriptor
+} bc_large_out_t;
+
+/* Bytes which did not fit yet in the channel (already framed) */
+typedef struct {
+  uint8_t *buf;
+  size_t start;
+  size_t end;
+  size_t alloc;
+} overflow_queue_t;
 
 typedef struct {
   char *ff_path[2];
   int ff[2];
+  bc_shm_ring_t ring[2];
+  bc_bcast_t bcast; //Broadcast channels (only one direction)
+  transport_t transport;
   int pending_read_bytes; //-1 == channel is closed
   int dev_nbr;
   int channel_nbr;
+  bool out_open; //The sending side is already open (attached)
+  overflow_queue_t oq;
+  /* FIFO read-ahead buffer (raw framed bytes): */
+  uint8_t *rx_buf;
+  size_t rx_buf_size;
+  size_t rx_start; //Start of what has not been parsed yet
+  size_t rx_end; //End of what has been received
+  size_t rx_pos; //Next byte of the pending message to hand to the user
+  /* Large message being received (mapped from its segment file): */
+  struct bc_large_seg_s *large_seg;
+  size_t large_map_size;
+  size_t large_pos;
+  char *large_path;
+  /* Large messages sent, which some reader may not have released yet: */
+  bc_large_out_t *large_out;
+  uint n_large_out;
+  uint64_t tx_bytes; //Bytes ever handed to channel_writev() (written or queued)
+  bool *bcast_reaped; //Broadcast readers for which we released what they did not read
+  uint n_bcast_reaped;
+  /* Time stamping: */
+  bool time_stamped; //Stamp the messages we send thru this channel with our time
+  bool held; //A time stamped message has arrived, but it is not its time yet
+  uint32_t held_size32; //Size word of the held message (without the stamp)
+  bs_time_t held_time; //Time at which the held message is to be delivered
+  bs_time_t msg_time; //Time stamp of the pending message (0 if it had none)
+  bs_bc_stats_t stats;
 } channels_status_t;
 
+/*
+ * Header of the shared memory segment file carrying one large message
+ */
+typedef struct bc_large_seg_s {
+  uint32_t magic;
+  uint32_t refcount; //Readers which still have to read it
+  uint64_t size;
+  uint8_t data[];
+} bc_large_seg_t;
+
+#define BC_LARGE_SEG_MAGIC 0x4C434253 /* "SBCL" */
+#define BC_LARGE_MSG_FLAG 0x80000000 /* In the message size: the message is a large message descriptor */
+#define BC_TIME_STAMP_FLAG 0x40000000 /* In the message size: the message starts with its time stamp (bs_time_t) */
+#define BC_MSG_SIZE_MASK 0x3FFFFFFF
+#define BC_LARGE_DESC_MAX 256
+#define BC_LARGE_MSG_DEFAULT_THRESHOLD (64*1024)
+
+/*
+ * Descriptor sent thru the channel instead of a large message
+ */
+typedef struct {
+  uint64_t size;
+  char name[BC_LARGE_DESC_MAX - sizeof(uint64_t)]; //Segment file name in the com folder
+} bc_large_desc_t;
+
 static channels_status_t *channels_status;
 static int number_back_channels = -1;
 
-static uint *channel_id_table = NULL;
+/* Each call to open/add channels returns its own table of channel ids */
+static uint **channel_id_tables;
+static int n_channel_id_tables;
+
+static size_t default_capacity; //0 = OS/library default
+static size_t large_msg_threshold = BC_LARGE_MSG_DEFAULT_THRESHOLD;
+static int n_queued_channels; //Number of channels with something in their overflow queue
+static bool cleaning_up;
+static bs_time_t (*bc_time_f)(void); //Function to get this device simulated time
+
+static size_t drain_queue(uint channel_id);
+
+#define BC_CLEANUP_FLUSH_TIMEOUT_MS 1000
+
+/*
+ * Try to move what is left in the overflow queues into the channels before
+ * closing them, while the other side keeps reading (giving up if it does not
+ * read anything for BC_CLEANUP_FLUSH_TIMEOUT_MS)
+ */
+static void flush_on_cleanup(void){
+  const struct timespec wait = {0, 1000000};
+  size_t queued = bs_bc_flush();
+  for ( int i = 0; ( queued > 0 ) && ( i < BC_CLEANUP_FLUSH_TIMEOUT_MS ); i++ ) {
+    nanosleep(&wait, NULL);
+    size_t left = bs_bc_flush();
+    if ( left < queued ) {
+      i = 0;
+    }
+    queued = left;
+  }
+  if ( queued > 0 ) {
+    bs_trace_warning_line("%zu bytes queued in the back channels could not be sent before closing them\n",
+                          queued);
+  }
+}
+
+static void rx_drain_on_close(uint channel_id);
+static void large_out_close(uint channel_id);
+
+/*
+ * Close both sides of a channel and free its resources
+ */
+static void close_channel(uint channel_id){
+  channels_status_t *ch = &channels_status[channel_id];
+
+  rx_drain_on_close(channel_id);
+  large_out_close(channel_id);
+  free(ch->oq.buf);
+  free(ch->rx_buf);
+  free(ch->bcast_reaped);
+  for (direction_t dir = In ; dir <= Out; dir++) {
+    if ( ch->ff_path[dir] ) {
+      if ( ch->transport == BC_SHM ) {
+        bc_shm_ring_close(&ch->ring[dir], dir == In);
+      } else if ( ( ch->transport == BC_BCAST_TX ) || ( ch->transport == BC_BCAST_RX ) ) {
+        bc_bcast_close(&ch->bcast);
+      } else if ( ch->ff[dir] != -1 ) {
+        close(ch->ff[dir]); //Close FIFO
+      }
+      if ( ch->transport != BC_BCAST_RX ) { //(the broadcast log belongs to its writer)
+        remove(ch->ff_path[dir]); //Attempt to delete FIFO/ring file
+      }
+      free(ch->ff_path[dir]);
+    }
+  }
+}
 
 /**
  * Close and cleanup the back channel communication
@@ -66,14 +272,13 @@ static uint *channel_id_table = NULL;
 void bs_clean_back_channels(){
   if (channel_opened) {
     if ( channels_status != NULL ) {
+      cleaning_up = true;
+      if ( n_queued_channels > 0 ) {
+        flush_on_cleanup();
+      }
+      n_queued_channels = 0;
       for (int i = 0; i < number_back_channels ; i ++) {
-        for (direction_t dir = In ; dir <= Out; dir++) {
-          if ( channels_status[i].ff_path[dir] ) {
-            close(channels_status[i].ff[dir]); //Close FIFO
-            remove(channels_status[i].ff_path[dir]); //Attempt to delete FIFO
-            free(channels_status[i].ff_path[dir]);
-          }
-        }
+        close_channel(i);
       }
 
       free(channels_status);
@@ -83,12 +288,249 @@ void bs_clean_back_channels(){
   if ( pb_com_path != NULL ) {
     rmdir(pb_com_path);
   }
-  if ( channel_id_table != NULL ) {
-    free(channel_id_table);
-    channel_id_table = NULL;
+  for ( int i = 0; i < n_channel_id_tables; i++ ) {
+    free(channel_id_tables[i]);
   }
+  free(channel_id_tables);
+  channel_id_tables = NULL;
+  n_channel_id_tables = 0;
   number_back_channels = 0;
   channel_opened = false;
+  blocking_opened = false;
+  cleaning_up = false;
+}
+
+/*
+ * Set the size of the FIFO underlying one side of a channel
+ * Returns 0 on success, -1 if it could not be changed (a warning is printed)
+ */
+static int set_pipe_size(uint channel_id, direction_t dir, size_t capacity){
+#if defined(F_SETPIPE_SZ)
+  if ( fcntl(channels_status[channel_id].ff[dir], F_SETPIPE_SZ, (int)BS_MIN(capacity, INT_MAX)) == -1 ) {
+    bs_trace_warning_line("Could not set back channel %u capacity to %zu bytes (errno=%i: %s)\n",
+                          channel_id, capacity, errno, strerror(errno));
+    return -1;
+  }
+  return 0;
+#else
+  bs_trace_warning_line("Setting the back channel FIFOs capacity is not supported in this OS\n");
+  return -1;
+#endif
+}
+
+/*
+ * Capacity of the FIFO we write to, as reported by the OS
+ */
+static size_t get_pipe_size(uint channel_id){
+#if defined(F_GETPIPE_SZ)
+  int size = fcntl(channels_status[channel_id].ff[Out], F_GETPIPE_SZ);
+  if ( size > 0 ) {
+    return size;
+  }
+#endif
+  return 0; //Unknown
+}
+
+/*
+ * Try to open (without blocking) the sending side of a channel
+ * Returns true if it is open
+ */
+static bool try_open_out(uint channel_id){
+  channels_status_t *ch = &channels_status[channel_id];
+
+  if ( ch->out_open ) {
+    return true;
+  }
+  if ( ch->transport == BC_SHM ) {
+    int ret = bc_shm_ring_try_attach(&ch->ring[Out], ch->ff_path[Out]);
+    if ( ret == 1 ) {
+      return false;
+    } else if ( ret != 0 ) {
+      bs_trace_error_line("Could not attach to back channel %u ring %s (errno=%i)\n",
+                          channel_id, ch->ff_path[Out], errno);
+    }
+    ch->stats.capacity = ch->ring[Out].hdr->capacity;
+  } else {
+    ch->ff[Out] = open(ch->ff_path[Out], O_WRONLY | O_NONBLOCK);
+    if ( ch->ff[Out] == -1 ) {
+      if ( errno == ENXIO ) { //The other side has not opened it for reading yet
+        return false;
+      }
+      bs_trace_error_line("Could not open back channel %u FIFO %s (errno=%i: %s)\n",
+                          channel_id, ch->ff_path[Out], errno, strerror(errno));
+    }
+    if ( default_capacity ){
+      set_pipe_size(channel_id, Out, default_capacity);
+    }
+    ch->stats.capacity = get_pipe_size(channel_id);
+  }
+  ch->out_open = true;
+  return true;
+}
+
+/*
+ * Is the channel written thru shared memory (whole messages at a time)
+ */
+static inline bool is_shm_out(const channels_status_t *ch){
+  return ( ch->transport == BC_SHM ) || ( ch->transport == BC_BCAST_TX );
+}
+
+static uint32_t shm_out_capacity(const channels_status_t *ch){
+  return ( ch->transport == BC_SHM ) ? ch->ring[Out].hdr->capacity : ch->bcast.hdr->capacity;
+}
+
+/*
+ * Free space in the ring/log we write to
+ * (if <full>, we already found it full and should check if the readers
+ * are still there)
+ */
+static size_t shm_out_free_space(channels_status_t *ch, bool full){
+  return ( ch->transport == BC_SHM ) ? bc_shm_ring_free_space(&ch->ring[Out])
+                                     : bc_bcast_free_space(&ch->bcast, full);
+}
+
+/*
+ * Open both sides of a channel
+ * If <lazy>, the sending side is only opened if the other device
+ * already opened its receiving side, otherwise it will be retried later.
+ * Otherwise, it blocks until the other side has done so.
+ * Returns 0 on success, -1 on failure
+ */
+static int open_channel(uint channel_id, uint global_dev_nbr, uint dev_nbr, uint channel_nbr,
+                        transport_t transport, direction_t dir, bool lazy){
+  channels_status_t *ch = &channels_status[channel_id];
+  const char *extension = ( transport == BC_SHM ) ? "bcs" : "bc";
+
+  ch->transport = transport;
+  ch->ff_path[dir] = (char*)bs_calloc( pb_com_path_length + 50 , sizeof(char));
+  if ( dir == In ){
+    sprintf(ch->ff_path[dir], "%s/Device%u_from%u_%u.%s",
+            pb_com_path, global_dev_nbr, dev_nbr, channel_nbr, extension);
+  } else {
+    sprintf(ch->ff_path[dir], "%s/Device%u_from%u_%u.%s",
+            pb_com_path, dev_nbr, global_dev_nbr, channel_nbr, extension);
+  }
+
+  if ( transport == BC_SHM ){
+    if ( dir == In ){
+      //We own the ring we read from
+      return bc_shm_ring_create(&ch->ring[dir], ch->ff_path[dir],
+                                default_capacity ? default_capacity : BC_SHM_DEFAULT_CAPACITY);
+    } else if ( lazy ) {
+      (void)try_open_out(channel_id);
+      return 0;
+    }
+    //Blocking until the other device has created its ring
+    if ( bc_shm_ring_attach(&ch->ring[dir], ch->ff_path[dir]) != 0 ) {
+      return -1;
+    }
+    ch->stats.capacity = ch->ring[dir].hdr->capacity;
+    ch->out_open = true;
+    return 0;
+  }
+
+  if ( pb_create_fifo_if_not_there(ch->ff_path[dir]) != 0 ){
+    return -1;
+  }
+
+  if ( dir == In ){
+    //Open FIFO not locking for In side
+    if ( ( ch->ff[dir] = open(ch->ff_path[dir],O_RDONLY | O_NONBLOCK) ) == -1 ) {
+      return -1;
+    }
+    if ( default_capacity ){
+      set_pipe_size(channel_id, dir, default_capacity);
+    }
+    return 0;
+  } else if ( lazy ) {
+    (void)try_open_out(channel_id);
+    return 0;
+  }
+  //Open FIFO locking for out side (this will block until the other device opens for reading)
+  if ( ( ch->ff[dir] = open(ch->ff_path[dir],O_WRONLY ) ) == -1 ) {
+    return -1;
+  }
+  //Change write side permissions to non locking
+  int flags = fcntl(ch->ff[dir], F_GETFL);
+  flags |= O_NONBLOCK;
+  fcntl(ch->ff[dir], F_SETFL, flags);
+  if ( default_capacity ){
+    set_pipe_size(channel_id, dir, default_capacity);
+  }
+  ch->stats.capacity = get_pipe_size(channel_id);
+  ch->out_open = true;
+  return 0;
+}
+
+/*
+ * Allocate <n> new channels, and return the id of the first one
+ */
+static uint new_channels(uint n){
+  uint first = ( number_back_channels > 0 ) ? number_back_channels : 0;
+
+  channels_status = bs_realloc(channels_status, (first + n)*sizeof(channels_status_t));
+  memset(&channels_status[first], 0, n*sizeof(channels_status_t));
+  channel_opened = true;
+  number_back_channels = first + n;
+
+  for (int i = 0 ; i < n; i ++){
+    channels_status[first + i].ff[In] = -1;
+    channels_status[first + i].ff[Out] = -1;
+  }
+  return first;
+}
+
+static void check_com_initialized(const char *func){
+  extern bool is_base_com_initialized;
+  if ( ! is_base_com_initialized ){
+    bs_trace_error_line("You canNOT call %s before this device has connected to its phy(s)\n", func);
+  }
+}
+
+static uint *open_back_channels(uint global_dev_nbr, uint* dev_nbrs, uint* channel_nbrs,
+                                uint nbr_of_channels, transport_t transport, bool lazy,
+                                const char *func){
+  if ( !lazy && blocking_opened ) {
+    bs_trace_error_line("To prevent deadlocks you have to open all channels in one call to %s\n", func);
+  }
+
+  check_com_initialized(func);
+  blocking_opened |= !lazy;
+
+  uint first = new_channels(nbr_of_channels);
+
+  uint *channel_id_table = bs_malloc(nbr_of_channels*sizeof(uint));
+  channel_id_tables = bs_realloc(channel_id_tables, (n_channel_id_tables + 1)*sizeof(uint *));
+  channel_id_tables[n_channel_id_tables++] = channel_id_table;
+
+  for (direction_t dir = In ; dir <= Out; dir++){
+    for (int i = 0 ; i < nbr_of_channels; i ++){
+      uint channel_id = first + i;
+
+      if ( open_channel(channel_id, global_dev_nbr, dev_nbrs[i], channel_nbrs[i],
+                        transport, dir, lazy) != 0 ) {
+        if ( !lazy ) {
+          bs_clean_back_channels();
+        } else { //We just undo this call
+          for ( int j = 0 ; j < nbr_of_channels; j ++){
+            close_channel(first + j);
+          }
+          number_back_channels = first;
+          free(channel_id_tables[--n_channel_id_tables]);
+        }
+        return NULL;
+      }
+
+      if ( dir == In ){
+        channels_status[channel_id].pending_read_bytes = 0;
+        channel_id_table[i] = channel_id;
+        channels_status[channel_id].dev_nbr = dev_nbrs[i];
+        channels_status[channel_id].channel_nbr = channel_nbrs[i];
+      }
+    } //for i
+  } //for dir
+
+  return channel_id_table;
 }
 
 /**
@@ -103,6 +545,7 @@ void bs_clean_back_channels(){
  *
  * Note that this function should normally only be called once per device to open all channels to all other
  * devices in a given simulation.
+ * (Channels added with bs_add_back_channel() and broadcast channels can be opened before or after it)
  *
  * This function is blocking until the other side devices open the corresponding back channels
  * This function returns NULL on failure or
@@ -111,147 +554,1422 @@ void bs_clean_back_channels(){
  *
  */
 uint *bs_open_back_channel(uint global_dev_nbr, uint* dev_nbrs, uint* channel_nbrs, uint nbr_of_channels){
-  if (channel_opened) {
-    bs_trace_error_line("To prevent deadlocks you have to open all channels in one call to %s\n", __func__);
-  }
-
-  extern bool is_base_com_initialized;
-  if ( ! is_base_com_initialized ){
-    bs_trace_error_line("You canNOT call %s before this device has connected to its phy(s)\n", __func__);
-  }
+  return open_back_channels(global_dev_nbr, dev_nbrs, channel_nbrs, nbr_of_channels, BC_FIFO, false, __func__);
+}
 
-  channels_status = bs_calloc(nbr_of_channels, sizeof(channels_status_t));
-  channel_opened = true;
-  number_back_channels = nbr_of_channels;
-  channel_id_table = bs_malloc(nbr_of_channels*sizeof(uint));
+/**
+ * Like bs_open_back_channel(), but the channels are carried over shared memory
+ * rings instead of FIFOs.
+ * The devices on the other side must also open them with this function.
+ */
+uint *bs_open_back_channel_shm(uint global_dev_nbr, uint* dev_nbrs, uint* channel_nbrs, uint nbr_of_channels){
+  return open_back_channels(global_dev_nbr, dev_nbrs, channel_nbrs, nbr_of_channels, BC_SHM, false, __func__);
+}
 
-  for (direction_t dir = In ; dir <= Out; dir++){
-    for (int i = 0 ; i < nbr_of_channels; i ++){
+/**
+ * Add <nbr_of_channels> back channels to other devices, like
+ * bs_open_back_channel(), but without blocking.
+ *
+ * This function can be called as many times as desired (also before or after
+ * bs_open_back_channel(), or the broadcast channels functions), and in any order with respect to the other
+ * devices (they must open their side with bs_add_back_channel() or
+ * bs_open_back_channel()).
+ * If the other side has not yet opened its side of a channel, messages sent
+ * thru it are queued until it does (which is checked again on each send,
+ * check or poll).
+ *
+ * This function returns NULL on failure or an array of channel identifiers
+ * of the new channels (DO NOT free that pointer)
+ */
+uint *bs_add_back_channel(uint global_dev_nbr, uint* dev_nbrs, uint* channel_nbrs, uint nbr_of_channels){
+  return open_back_channels(global_dev_nbr, dev_nbrs, channel_nbrs, nbr_of_channels, BC_FIFO, true, __func__);
+}
 
-      channels_status[i].ff_path[dir] = (char*)bs_calloc( pb_com_path_length + 50 , sizeof(char));
-      if ( dir == In ){
-        sprintf(channels_status[i].ff_path[dir], "%s/Device%u_from%u_%u.bc",
-                pb_com_path, global_dev_nbr, dev_nbrs[i], channel_nbrs[i]);
-      } else {
-        sprintf(channels_status[i].ff_path[dir], "%s/Device%u_from%u_%u.bc",
-                pb_com_path, dev_nbrs[i], global_dev_nbr, channel_nbrs[i]);
-      }
+/**
+ * Like bs_add_back_channel(), but the channels are carried over shared memory
+ * rings (the other side must use bs_add_back_channel_shm() or
+ * bs_open_back_channel_shm())
+ */
+uint *bs_add_back_channel_shm(uint global_dev_nbr, uint* dev_nbrs, uint* channel_nbrs, uint nbr_of_channels){
+  return open_back_channels(global_dev_nbr, dev_nbrs, channel_nbrs, nbr_of_channels, BC_SHM, true, __func__);
+}
 
-      if ( pb_create_fifo_if_not_there(channels_status[i].ff_path[dir]) != 0 ){
-        bs_clean_back_channels();
-        free(channel_id_table);
-        return NULL;
-      }
+/**
+ * Open a broadcast back channel, thru which this device (<global_dev_nbr>)
+ * can send messages to <nbr_of_readers> other devices at once.
+ * Each of those devices must open it with bs_bc_open_broadcast_rx().
+ * Several broadcast channels can be opened, each with a different
+ * <channel_nbr>.
+ *
+ * Sending a message is just one copy into a shared memory log, independently
+ * of the number of readers. Space in the log is only reused once all readers
+ * have read it (including those which have not yet opened the channel).
+ *
+ * This function does not block.
+ * It returns the channel_id to use with bs_bc_send_msg*() or -1 on failure
+ */
+int bs_bc_open_broadcast_tx(uint global_dev_nbr, uint channel_nbr, uint nbr_of_readers){
+  check_com_initialized(__func__);
 
-      if ( dir == In ){
-        //Open FIFO not locking for In side
-        if ( ( channels_status[i].ff[dir] = open(channels_status[i].ff_path[dir],O_RDONLY | O_NONBLOCK) ) == -1 ) {
-          bs_clean_back_channels();
-          free(channel_id_table);
-          return NULL;
-        }
-        channels_status[i].pending_read_bytes = 0;
-        channel_id_table[i] = i;
-        channels_status[i].dev_nbr = dev_nbrs[i];
-        channels_status[i].channel_nbr = channel_nbrs[i];
-      } else {
-        //Open FIFO locking for out side (this will block until the other device opens for reading)
-        if ( ( channels_status[i].ff[dir] = open(channels_status[i].ff_path[dir],O_WRONLY ) ) == -1 ) {
-          bs_clean_back_channels();
-          free(channel_id_table);
-          return NULL;
-        }
-        //Change write side permissions to non locking
-        int flags = fcntl(channels_status[i].ff[dir], F_GETFL);
-        flags |= O_NONBLOCK;
-        fcntl(channels_status[i].ff[dir], F_SETFL, flags);
-      }
+  uint channel_id = new_channels(1);
+  channels_status_t *ch = &channels_status[channel_id];
 
-    } //for i
-  } //for dir
+  ch->transport = BC_BCAST_TX;
+  ch->dev_nbr = global_dev_nbr;
+  ch->channel_nbr = channel_nbr;
+  ch->ff_path[Out] = (char*)bs_calloc( pb_com_path_length + 50 , sizeof(char));
+  sprintf(ch->ff_path[Out], "%s/Device%u_bcast_%u.bcb", pb_com_path, global_dev_nbr, channel_nbr);
 
-  return channel_id_table;
+  if ( bc_bcast_create(&ch->bcast, ch->ff_path[Out],
+                       default_capacity ? default_capacity : BC_SHM_DEFAULT_CAPACITY,
+                       nbr_of_readers) != 0 ) {
+    close_channel(channel_id);
+    number_back_channels--;
+    return -1;
+  }
+  ch->out_open = true;
+  ch->stats.capacity = ch->bcast.hdr->capacity;
+  ch->bcast_reaped = bs_calloc(nbr_of_readers, sizeof(bool));
+  return channel_id;
 }
 
 /**
- * Send a message to the other device thru the channel
- * Note that if the other device has closed the channel (pipe) == disconnected
- * we will get a SIGPIPE here and will terminate abruptly
+ * Open the receiving side of the broadcast back channel <channel_nbr> of
+ * device <writer_dev_nbr> (see bs_bc_open_broadcast_tx())
+ *
+ * This function does not block. Until the writer has opened the channel,
+ * bs_bc_is_msg_received() will just return 0
+ * It returns the channel_id to use with bs_bc_is_msg_received() and
+ * bs_bc_receive_msg() or -1 on failure
  */
-void bs_bc_send_msg(uint channel_id, uint8_t *ptr, size_t size){
-  if ( channel_id >= number_back_channels )
-    bs_trace_error_line("you are trying to send a message thru a non existent back channel (%u)\n", channel_id);
+int bs_bc_open_broadcast_rx(uint writer_dev_nbr, uint channel_nbr){
+  check_com_initialized(__func__);
 
-  char message[size+4];
-  *(uint32_t*)message = size;
-  memcpy(&message[4], ptr, size);
-  //To avoid problems we move all data in one write() call.
-  //(otherwise the context maybe switched out between writes and the read may fail on the other side)
+  uint channel_id = new_channels(1);
+  channels_status_t *ch = &channels_status[channel_id];
 
-  int bytes_written = write(channels_status[channel_id].ff[Out], message, size+4);
-  if ( bytes_written != size+4 ) {
-    bs_trace_error_line("back channel %u filled up (%i != %zu+4, errno=%i)\n",
-                        channel_id, bytes_written, size, errno);
+  ch->transport = BC_BCAST_RX;
+  ch->dev_nbr = writer_dev_nbr;
+  ch->channel_nbr = channel_nbr;
+  ch->ff_path[In] = (char*)bs_calloc( pb_com_path_length + 50 , sizeof(char));
+  sprintf(ch->ff_path[In], "%s/Device%u_bcast_%u.bcb", pb_com_path, writer_dev_nbr, channel_nbr);
+
+  if ( bc_bcast_try_attach(&ch->bcast, ch->ff_path[In]) == -1 ) {
+    close_channel(channel_id);
+    number_back_channels--;
+    return -1;
   }
+  return channel_id;
 }
 
-/**
- * check if there is any pending message in the queue
- * Returns -1 if the channel is closed
- * Returns 0 if nothing is available yet
- * the size of the next message if there is something
+#if defined(IOV_MAX)
+#define BC_MAX_IOV IOV_MAX
+#else
+#define BC_MAX_IOV _XOPEN_IOV_MAX
+#endif
+
+/*
+ * The other side closed a channel we still have something to write to
  */
-int bs_bc_is_msg_received(uint channel_id){
-  if ( channel_id >= number_back_channels )
-    bs_trace_error_line("you are trying to check for a message in a non existent back channel (%u)\n", channel_id);
+static void peer_closed(uint channel_id){
+  channels_status_t *ch = &channels_status[channel_id];
+  if ( !cleaning_up ) {
+    bs_trace_error_line("back channel %u was closed by the other side\n", channel_id);
+  }
+  //While closing we just drop whatever is left
+  if ( ch->oq.end > ch->oq.start ) {
+    n_queued_channels--;
+  }
+  ch->stats.queued_bytes = 0;
+  ch->oq.start = ch->oq.end = 0;
+}
+
+/*
+ * Try to write <total> bytes described by <iov> into the channel without
+ * blocking. Returns how many were written.
+ * For shared memory channels, either all or nothing is written.
+ */
+static size_t channel_try_writev(uint channel_id, const struct iovec *iov, int iovcnt, size_t total){
+  channels_status_t *ch = &channels_status[channel_id];
+
+  if ( is_shm_out(ch) ) {
+    int ret;
+    if ( ch->transport == BC_SHM ) {
+      ret = bc_shm_ring_writev(&ch->ring[Out], iov, iovcnt, total);
+    } else {
+      ret = bc_bcast_writev(&ch->bcast, iov, iovcnt, total);
+    }
+    if ( ret == -2 ) {
+      peer_closed(channel_id);
+      return total;
+    } else if ( ret != 0 ) {
+      return 0;
+    }
+    size_t used = shm_out_capacity(ch) - shm_out_free_space(ch, false);
+    ch->stats.fill_high_water = BS_MAX(ch->stats.fill_high_water, used);
+    return total;
+  }
+
+  while ( true ) {
+    //Whatever fits is moved in one write() call. If the message does not
+    //fully fit, the reader will wait until the rest arrives
+    ssize_t bytes_written = writev(ch->ff[Out], iov, iovcnt);
+    if ( bytes_written >= 0 ) {
+      return bytes_written;
+    } else if ( errno == EAGAIN ) {
+      return 0;
+    } else if ( errno == EPIPE ) {
+      peer_closed(channel_id);
+      return total;
+    } else if ( errno != EINTR ) {
+      bs_trace_error_line("Unexpected error writing to back channel %u (errno=%i: %s)\n",
+                          channel_id, errno, strerror(errno));
+    }
+  }
+}
+
+/*
+ * Append to the channel overflow queue what is left (from <skip> bytes on)
+ * of the <total> bytes described by <iov>
+ */
+static void queue_append(uint channel_id, const struct iovec *iov, int iovcnt,
+                         size_t total, size_t skip){
+  overflow_queue_t *oq = &channels_status[channel_id].oq;
+  size_t n = total - skip;
+
+  if ( oq->end == oq->start ) {
+    oq->start = oq->end = 0;
+    n_queued_channels++;
+  } else if ( ( oq->start > 0 ) && ( oq->end + n > oq->alloc ) ) {
+    memmove(oq->buf, &oq->buf[oq->start], oq->end - oq->start);
+    oq->end -= oq->start;
+    oq->start = 0;
+  }
+  if ( oq->end + n > oq->alloc ) {
+    oq->alloc = BS_MAX(2*oq->alloc, oq->end + n);
+    oq->buf = bs_realloc(oq->buf, oq->alloc);
+  }
 
-  while ( channels_status[channel_id].pending_read_bytes == 0 ){ //otherwise the user is calling this function twice (and we'd break the protocol)
+  for ( int i = 0; i < iovcnt; i++ ) {
+    size_t len = iov[i].iov_len;
+    const uint8_t *src = iov[i].iov_base;
+    if ( skip >= len ) {
+      skip -= len;
+      continue;
+    }
+    memcpy(&oq->buf[oq->end], src + skip, len - skip);
+    oq->end += len - skip;
+    skip = 0;
+  }
+
+  bs_bc_stats_t *stats = &channels_status[channel_id].stats;
+  stats->full_events++;
+  stats->queued_bytes = oq->end - oq->start;
+  stats->queue_high_water = BS_MAX(stats->queue_high_water, stats->queued_bytes);
+}
+
+/*
+ * How many bytes of whole messages from the start of the overflow queue
+ * fit in <space>
+ */
+static size_t queued_msgs_fitting(const overflow_queue_t *oq, size_t space){
+  size_t n = oq->end - oq->start;
+  size_t fits = 0;
+  while ( fits + sizeof(uint32_t) <= n ) {
     uint32_t size32;
-    int read_size = read(channels_status[channel_id].ff[In],&size32,sizeof(uint32_t)); //non blocking read
-    if ( read_size == sizeof(uint32_t) ) {
-      channels_status[channel_id].pending_read_bytes = size32;
-    } else if ( ( ( read_size == -1 ) && (errno == EAGAIN) ) || (read_size == 0) ) { //Nothing yet there
-      break;
-    } else if ( ( read_size == -1 ) && (errno == EINTR) ) {
-      //A signal interrupted the read before anything was read => retry needed
-      bs_trace_warning_line("Read to back channel %u interrupted by signal => Retrying\n",
-                            channel_id);
-    } else if ( read_size == EOF ) { //The FIFO was closed by the other side
-      channels_status[channel_id].pending_read_bytes = -1;
-      bs_trace_raw_time(3,"The back channel %u was closed by the other side\n",channel_id);
+    memcpy(&size32, &oq->buf[oq->start + fits], sizeof(uint32_t));
+    size32 &= BC_MSG_SIZE_MASK;
+    if ( fits + sizeof(uint32_t) + size32 > space ) {
       break;
-    } else {
-      bs_trace_error_line("Unexpected error in channel %u (%i read, errno=%i: %s)\n",
-                          channel_id, read_size, errno, strerror(errno));
     }
+    fits += sizeof(uint32_t) + size32;
   }
-  return channels_status[channel_id].pending_read_bytes;
+  return fits;
 }
 
-/**
- * Receive a message into <ptr> of <size> bytes from the other side
- *
- * Always call bs_bc_is_msg_received() before to check that there is
- * indeed a message,
- * and always ask for a message of not more than the number of bytes
- * bs_bc_is_msg_received() returned
+/*
+ * Move as much as possible of the channel overflow queue into the channel
+ * Returns the number of bytes still left in the queue
  */
-void bs_bc_receive_msg(int channel_id , uint8_t *ptr, size_t size){
-  if ( channel_id >= number_back_channels )
-    bs_trace_error_line("You are trying to receive a message in a non existent back channel (%u)\n", channel_id);
+static size_t drain_queue(uint channel_id){
+  channels_status_t *ch = &channels_status[channel_id];
+  overflow_queue_t *oq = &ch->oq;
+  size_t n = oq->end - oq->start;
 
-  if ( size > channels_status[channel_id].pending_read_bytes )
-    bs_trace_error_line("Last time you checked bs_bc_is_msg_received() told there was %u bytes in channel %u, but now you try to read %u??\n",
-                         channels_status[channel_id].pending_read_bytes, channel_id, size);
+  if ( n == 0 ) {
+    return 0;
+  }
+  if ( !try_open_out(channel_id) ) {
+    return n;
+  }
 
-  if ( size == 0 )
-    return;
+  if ( is_shm_out(ch) ) {
+    //Only whole messages can be published into the ring
+    n = queued_msgs_fitting(oq, shm_out_free_space(ch, false));
+    if ( n == 0 ) {
+      uint32_t size32;
+      memcpy(&size32, &oq->buf[oq->start], sizeof(uint32_t));
+      size32 &= BC_MSG_SIZE_MASK;
+      if ( size32 + sizeof(uint32_t) > shm_out_capacity(ch) ) {
+        bs_trace_error_line("Message of %u bytes does not fit in back channel %u ring (capacity %u)\n",
+                            size32, channel_id, shm_out_capacity(ch));
+      }
+      if ( ch->transport == BC_SHM ) {
+        if ( bc_shm_ring_reader_gone(&ch->ring[Out]) ) {
+          peer_closed(channel_id);
+        }
+      } else { //Some broadcast reader may have died
+        n = queued_msgs_fitting(oq, shm_out_free_space(ch, true));
+      }
+      if ( n == 0 ) {
+        return oq->end - oq->start;
+      }
+    }
+  }
+
+  struct iovec iov = { .iov_base = &oq->buf[oq->start], .iov_len = n };
+  oq->start += channel_try_writev(channel_id, &iov, 1, n);
 
-  int read_size = read(channels_status[channel_id].ff[In],ptr,size); //Non-blocking read
-  if ( read_size != size ) {
-    bs_trace_error_line("Back channel %u broken (%i != %z bytes, errno=%i, pending=%i) "
-                        "(probably the other side crashed in the middle of a message == nasty)\n",
-                        channel_id, read_size, size, errno, channels_status[channel_id].pending_read_bytes);
+  if ( oq->start >= oq->end ) {
+    if ( oq->end != 0 ) { //(if 0, peer_closed() already emptied it)
+      n_queued_channels--;
+    }
+    oq->start = oq->end = 0;
+  }
+  ch->stats.queued_bytes = oq->end - oq->start;
+  return ch->stats.queued_bytes;
+}
+
+/*
+ * Length of the header (size word and, if the channel is time stamped, time
+ * stamp) which precedes each message sent thru the channel
+ */
+static inline size_t msg_hdr_len(const channels_status_t *ch){
+  return sizeof(uint32_t) + ( ch->time_stamped ? sizeof(bs_time_t) : 0 );
+}
+
+/*
+ * Prepare in <hdr_iov> the header for a message of <size> bytes sent thru
+ * <ch>, with the size word (in <size32>) and, if the channel is time stamped,
+ * our current time (in <stamp>).
+ * Returns the number of <hdr_iov> entries used (1 or 2)
+ */
+static int msg_header(const channels_status_t *ch, size_t size, uint32_t flags,
+                      uint32_t *size32, bs_time_t *stamp, struct iovec *hdr_iov){
+  if ( size > BC_MSG_SIZE_MASK - sizeof(bs_time_t) ) {
+    bs_trace_error_line("Back channel messages can not be bigger than %zu bytes (%zu) unless sent as large messages\n",
+                        BC_MSG_SIZE_MASK - sizeof(bs_time_t), size);
+  }
+  *size32 = size | flags;
+  hdr_iov[0].iov_base = size32;
+  hdr_iov[0].iov_len = sizeof(uint32_t);
+  if ( !ch->time_stamped ) {
+    return 1;
+  }
+  *stamp = bc_time_f();
+  *size32 = ( size + sizeof(bs_time_t) ) | flags | BC_TIME_STAMP_FLAG;
+  hdr_iov[1].iov_base = stamp;
+  hdr_iov[1].iov_len = sizeof(bs_time_t);
+  return 2;
+}
+
+/*
+ * Send <total> bytes (one or several already framed messages),
+ * described by <iov>, thru the channel.
+ * Whatever does not fit in the channel is queued, to be sent later.
+ */
+static void channel_writev(uint channel_id, const struct iovec *iov, int iovcnt,
+                           size_t total, uint n_msgs){
+  channels_status_t *ch = &channels_status[channel_id];
+  size_t written = 0;
+  bool out_open = try_open_out(channel_id);
+
+  if ( out_open && is_shm_out(ch) && ( total > shm_out_capacity(ch) ) ) {
+    bs_trace_error_line("Message(s) of %zu bytes do not fit in back channel %u ring (capacity %u)\n",
+                        total, channel_id, shm_out_capacity(ch));
+  }
+
+  ch->stats.msgs_sent += n_msgs;
+  ch->stats.bytes_sent += total - n_msgs*msg_hdr_len(ch);
+  ch->tx_bytes += total;
+
+  //To keep the order, if there is already something queued, that goes first
+  //(if the other side did not open the channel yet, everything is queued)
+  if ( out_open && ( drain_queue(channel_id) == 0 ) ) {
+    written = channel_try_writev(channel_id, iov, iovcnt, total);
+  }
+  if ( written < total ) {
+    queue_append(channel_id, iov, iovcnt, total, written);
+  }
+}
+
+/**
+ * Try to move whatever is waiting in the back channels overflow queues into
+ * the channels (this is otherwise done opportunistically on each send, check
+ * or poll)
+ *
+ * Returns the number of bytes still queued (0 if everything was sent)
+ */
+size_t bs_bc_flush(void){
+  size_t queued = 0;
+  for ( uint c = 0; ( c < number_back_channels ) && ( n_queued_channels > 0 ); c++ ) {
+    queued += drain_queue(c);
+  }
+  return queued;
+}
+
+static inline void opportunistic_flush(void){
+  if ( n_queued_channels > 0 ) {
+    (void)bs_bc_flush();
+  }
+}
+
+/**
+ * Set the capacity (in bytes) of the back channels opened after this call.
+ * For FIFOs the OS may round it up, and will limit it (in Linux to
+ * /proc/sys/fs/pipe-max-size for normal users).
+ * Shared memory rings are rounded up to a power of 2.
+ * 0 means the default (64KB)
+ */
+void bs_bc_set_default_capacity(size_t capacity){
+  if ( capacity > UINT32_MAX/2 ) {
+    bs_trace_error_line("Back channel capacity %zu too big\n", capacity);
+  }
+  default_capacity = capacity;
+}
+
+/**
+ * Change the capacity (in bytes) of an already opened FIFO back channel
+ * (both directions)
+ *
+ * Returns the new capacity in the sending direction (0 if unknown, e.g. if
+ * the other side did not open it yet), or -1 if it could not be changed
+ * (shared memory rings can only be sized before opening them with
+ * bs_bc_set_default_capacity())
+ */
+ssize_t bs_bc_set_capacity(uint channel_id, size_t capacity){
+  if ( channel_id >= number_back_channels )
+    bs_trace_error_line("you are trying to set the capacity of a non existent back channel (%u)\n", channel_id);
+
+  if ( channels_status[channel_id].transport != BC_FIFO ) {
+    bs_trace_warning_line("The capacity of shared memory back channel %u can not be changed after opening it\n",
+                          channel_id);
+    return -1;
+  }
+  if ( ( set_pipe_size(channel_id, In, capacity) != 0 )
+      || ( channels_status[channel_id].out_open
+           && ( set_pipe_size(channel_id, Out, capacity) != 0 ) ) ) {
+    return -1;
+  }
+  channels_status[channel_id].stats.capacity = get_pipe_size(channel_id);
+  return channels_status[channel_id].stats.capacity;
+}
+
+/**
+ * Get the sending statistics of a back channel into <stats>
+ */
+void bs_bc_get_stats(uint channel_id, bs_bc_stats_t *stats){
+  if ( channel_id >= number_back_channels )
+    bs_trace_error_line("you are trying to get the statistics of a non existent back channel (%u)\n", channel_id);
+
+  *stats = channels_status[channel_id].stats;
+}
+
+static void check_send_channel_id(uint channel_id){
+  if ( channel_id >= number_back_channels )
+    bs_trace_error_line("you are trying to send a message thru a non existent back channel (%u)\n", channel_id);
+  if ( channels_status[channel_id].transport == BC_BCAST_RX )
+    bs_trace_error_line("you are trying to send a message thru a receive only broadcast back channel (%u)\n", channel_id);
+}
+
+/**
+ * Messages with a payload bigger than <threshold> bytes will be sent
+ * thru a shared memory segment, and only a small descriptor of it
+ * thru the channel itself. (SIZE_MAX disables this)
+ * By default BC_LARGE_MSG_DEFAULT_THRESHOLD
+ */
+void bs_bc_set_large_msg_threshold(size_t threshold){
+  large_msg_threshold = threshold;
+}
+
+/**
+ * Register the function which returns this device current simulated time
+ * (needed to send or receive time stamped messages)
+ */
+void bs_bc_register_time_function(bs_time_t (*time_f)(void)){
+  bc_time_f = time_f;
+}
+
+/**
+ * Stamp (or not) with this device current simulated time the messages sent
+ * from now on thru this channel.
+ * The receiver will only get each of them once its own simulated time has
+ * reached the stamp.
+ * A time function must have been registered first with
+ * bs_bc_register_time_function()
+ */
+void bs_bc_set_time_stamped(uint channel_id, bool time_stamped){
+  check_send_channel_id(channel_id);
+  if ( time_stamped && ( bc_time_f == NULL ) ) {
+    bs_trace_error_line("Register a time function with bs_bc_register_time_function() before time stamping back channel %u\n",
+                        channel_id);
+  }
+  channels_status[channel_id].time_stamped = time_stamped;
+}
+
+/*
+ * Drop one reference to the large message segment <o> on behalf of a reader
+ * which will never read it (deleting it if it was the last)
+ */
+static void large_out_unref(bc_large_out_t *o){
+  if ( __atomic_sub_fetch(&o->seg->refcount, 1, __ATOMIC_ACQ_REL) == 0 ) {
+    remove(o->path);
+  }
+}
+
+/*
+ * Forget the large messages sent thru <channel_id> which all their readers
+ * have released (or, if <all>, all of them)
+ */
+static void large_out_prune(uint channel_id, bool all){
+  channels_status_t *ch = &channels_status[channel_id];
+  uint kept = 0;
+
+  for ( uint i = 0; i < ch->n_large_out; i++ ) {
+    bc_large_out_t *o = &ch->large_out[i];
+    if ( all || ( __atomic_load_n(&o->seg->refcount, __ATOMIC_ACQUIRE) == 0 ) ) {
+      munmap(o->seg, o->map_size);
+      free(o->path);
+    } else {
+      ch->large_out[kept++] = *o;
+    }
+  }
+  ch->n_large_out = kept;
+  if ( all ) {
+    free(ch->large_out);
+    ch->large_out = NULL;
+  }
+}
+
+/*
+ * Release the large messages sent thru the broadcast channel <channel_id>
+ * which were not read by readers which closed or died (or, if <closing>,
+ * which never attached), as they will never release them themselves.
+ * Returns how many readers may still read new messages
+ */
+static uint bcast_reap_readers(uint channel_id, bool closing){
+  channels_status_t *ch = &channels_status[channel_id];
+  bc_bcast_hdr_t *hdr = ch->bcast.hdr;
+
+  for ( uint r = 0; r < hdr->n_readers; r++ ) {
+    bc_bcast_slot_t *slot = &hdr->slot[r];
+    if ( ch->bcast_reaped[r] ) {
+      continue;
+    }
+    uint32_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+    if ( closing && ( state == BC_BCAST_SLOT_ACTIVE ) && ( slot->pid != 0 )
+        && ( kill(slot->pid, 0) != 0 ) && ( errno == ESRCH ) ) {
+      state = BC_BCAST_SLOT_CLOSED;
+    }
+    if ( ( state == BC_BCAST_SLOT_CLOSED ) || ( closing && ( state == BC_BCAST_SLOT_FREE ) ) ) {
+      uint64_t cursor = __atomic_load_n(&slot->cursor, __ATOMIC_ACQUIRE);
+      for ( uint i = 0; i < ch->n_large_out; i++ ) {
+        if ( ch->large_out[i].end > cursor ) {
+          large_out_unref(&ch->large_out[i]);
+        }
+      }
+      ch->bcast_reaped[r] = true;
+      ch->n_bcast_reaped++;
+    }
+  }
+  return hdr->n_readers - ch->n_bcast_reaped;
+}
+
+/*
+ * Is the reader of the (single reader) channel <channel_id> gone
+ */
+static bool tx_reader_gone(uint channel_id){
+  channels_status_t *ch = &channels_status[channel_id];
+
+  if ( ch->transport == BC_SHM ) {
+    return bc_shm_ring_reader_gone(&ch->ring[Out]);
+  }
+  struct pollfd pfd = { .fd = ch->ff[Out], .events = POLLOUT };
+  return ( poll(&pfd, 1, 0) == 1 ) && ( pfd.revents & POLLERR );
+}
+
+/*
+ * Closing the sending side of <channel_id>: release the large messages sent
+ * thru it which will never be read, because their reader is gone or because
+ * their descriptor was still queued. (Readers which are still there release
+ * the ones they did not read when they close their side)
+ */
+static void large_out_close(uint channel_id){
+  channels_status_t *ch = &channels_status[channel_id];
+
+  if ( ch->large_out == NULL ) {
+    return;
+  }
+  large_out_prune(channel_id, false);
+  if ( ch->transport == BC_BCAST_TX ) {
+    if ( bcast_reap_readers(channel_id, true) == 0 ) {
+      //Nobody is left to read them (a reader may have died in the middle of one)
+      for ( uint i = 0; i < ch->n_large_out; i++ ) {
+        if ( __atomic_load_n(&ch->large_out[i].seg->refcount, __ATOMIC_ACQUIRE) != 0 ) {
+          remove(ch->large_out[i].path);
+        }
+      }
+    }
+  } else {
+    uint64_t written = ch->tx_bytes - ( ch->oq.end - ch->oq.start );
+    bool reader_gone = ch->out_open && tx_reader_gone(channel_id);
+    for ( uint i = 0; i < ch->n_large_out; i++ ) {
+      if ( reader_gone || ( ch->large_out[i].end > written ) ) {
+        large_out_unref(&ch->large_out[i]);
+      }
+    }
+  }
+  large_out_prune(channel_id, true);
+}
+
+/*
+ * Send a message of <size> bytes, scattered in <iovcnt> buffers described by
+ * <iov>, thru a new shared memory segment file, sending thru the channel only
+ * its descriptor.
+ * The segment is deleted by the last reader after reading it (or by us, for
+ * the readers which will never read it, see large_out_close())
+ */
+static void send_large_msg(uint channel_id, const struct iovec *iov, int iovcnt, size_t size){
+  static uint seq;
+  channels_status_t *ch = &channels_status[channel_id];
+  bc_large_desc_t desc;
+
+  if ( size > INT_MAX ) {
+    bs_trace_error_line("Back channel messages can not be bigger than %i bytes (%zu)\n",
+                        INT_MAX, size);
+  }
+
+  large_out_prune(channel_id, false);
+  uint32_t n_readers = ( ch->transport == BC_BCAST_TX ) ? bcast_reap_readers(channel_id, false) : 1;
+
+  snprintf(desc.name, sizeof(desc.name), "bcl_%li_%u.bcl", (long)getpid(), seq++);
+  char path[pb_com_path_length + strlen(desc.name) + 2];
+  sprintf(path, "%s/%s", pb_com_path, desc.name);
+
+  size_t map_size = sizeof(bc_large_seg_t) + size;
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+  if ( ( fd == -1 ) || ( ftruncate(fd, map_size) != 0 ) ) {
+    bs_trace_error_line("Could not create back channel large message segment %s (errno=%i: %s)\n",
+                        path, errno, strerror(errno));
+  }
+  bc_large_seg_t *seg = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if ( seg == MAP_FAILED ) {
+    bs_trace_error_line("Could not map back channel large message segment %s (errno=%i: %s)\n",
+                        path, errno, strerror(errno));
+  }
+
+  size_t pos = 0;
+  for ( int i = 0; i < iovcnt; i++ ) {
+    memcpy(&seg->data[pos], iov[i].iov_base, iov[i].iov_len);
+    pos += iov[i].iov_len;
+  }
+  seg->size = size;
+  seg->refcount = n_readers;
+  __atomic_store_n(&seg->magic, BC_LARGE_SEG_MAGIC, __ATOMIC_RELEASE);
+
+  desc.size = size;
+  size_t desc_len = sizeof(uint64_t) + strlen(desc.name) + 1;
+  uint32_t size32;
+  bs_time_t stamp;
+  struct iovec desc_iov[3];
+  int desc_iovcnt = msg_header(ch, desc_len, BC_LARGE_MSG_FLAG, &size32, &stamp, desc_iov);
+  desc_iov[desc_iovcnt].iov_base = &desc;
+  desc_iov[desc_iovcnt++].iov_len = desc_len;
+  channel_writev(channel_id, desc_iov, desc_iovcnt, desc_len + msg_hdr_len(ch), 1);
+  ch->stats.bytes_sent += size - desc_len;
+  ch->stats.large_msgs_sent++;
+
+  if ( n_readers == 0 ) { //No broadcast reader left
+    munmap(seg, map_size);
+    remove(path);
+    return;
+  }
+  ch->large_out = bs_realloc(ch->large_out, ( ch->n_large_out + 1 )*sizeof(bc_large_out_t));
+  bc_large_out_t *o = &ch->large_out[ch->n_large_out++];
+  o->seg = seg;
+  o->map_size = map_size;
+  o->path = bs_malloc(strlen(path) + 1);
+  strcpy(o->path, path);
+  o->end = ch->tx_bytes;
+}
+
+/*
+ * Start receiving the large message described by the <len> bytes in <desc>
+ */
+static void large_msg_open(uint channel_id, const void *desc_ptr, size_t len){
+  channels_status_t *ch = &channels_status[channel_id];
+  bc_large_desc_t desc;
+
+  if ( ( len <= sizeof(uint64_t) ) || ( len > sizeof(desc) ) ) {
+    bs_trace_error_line("Corrupted large message descriptor in back channel %u (%zu bytes)\n",
+                        channel_id, len);
+  }
+  memcpy(&desc, desc_ptr, len);
+  desc.name[len - sizeof(uint64_t) - 1] = 0;
+
+  ch->large_path = bs_malloc(pb_com_path_length + strlen(desc.name) + 2);
+  sprintf(ch->large_path, "%s/%s", pb_com_path, desc.name);
+
+  int fd = open(ch->large_path, O_RDWR);
+  struct stat st;
+  if ( ( fd == -1 ) || ( fstat(fd, &st) != 0 )
+      || ( st.st_size != sizeof(bc_large_seg_t) + desc.size ) ) {
+    bs_trace_error_line("Could not open back channel %u large message segment %s (errno=%i)\n",
+                        channel_id, ch->large_path, errno);
+  }
+  ch->large_map_size = st.st_size;
+  ch->large_seg = mmap(NULL, ch->large_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if ( ( ch->large_seg == MAP_FAILED )
+      || ( __atomic_load_n(&ch->large_seg->magic, __ATOMIC_ACQUIRE) != BC_LARGE_SEG_MAGIC ) ) {
+    bs_trace_error_line("Could not map back channel %u large message segment %s (errno=%i)\n",
+                        channel_id, ch->large_path, errno);
+  }
+  ch->large_pos = 0;
+  ch->pending_read_bytes = desc.size;
+}
+
+/*
+ * Done with the large message being received: the last reader deletes it
+ */
+static void large_msg_release(uint channel_id){
+  channels_status_t *ch = &channels_status[channel_id];
+
+  if ( ch->large_seg == NULL ) {
+    return;
+  }
+  if ( __atomic_sub_fetch(&ch->large_seg->refcount, 1, __ATOMIC_ACQ_REL) == 0 ) {
+    remove(ch->large_path);
+  }
+  munmap(ch->large_seg, ch->large_map_size);
+  ch->large_seg = NULL;
+  free(ch->large_path);
+  ch->large_path = NULL;
+}
+
+/**
+ * Send a message to the other device thru the channel
+ * Note that if the other device has closed the channel (pipe) == disconnected
+ * we will get a SIGPIPE here and will terminate abruptly
+ */
+void bs_bc_send_msg(uint channel_id, uint8_t *ptr, size_t size){
+  check_send_channel_id(channel_id);
+
+  if ( size > large_msg_threshold ) {
+    struct iovec large_iov = { .iov_base = ptr, .iov_len = size };
+    send_large_msg(channel_id, &large_iov, 1, size);
+    return;
+  }
+  channels_status_t *ch = &channels_status[channel_id];
+  uint32_t size32;
+  bs_time_t stamp;
+  struct iovec iov[3];
+  int iovcnt = msg_header(ch, size, 0, &size32, &stamp, iov);
+  if ( size ) {
+    iov[iovcnt].iov_base = ptr;
+    iov[iovcnt++].iov_len = size;
+  }
+  channel_writev(channel_id, iov, iovcnt, size + msg_hdr_len(ch), 1);
+}
+
+/**
+ * Send one message, whose content is scattered in <iovcnt> buffers described
+ * by <iov>, to the other device thru the channel.
+ * The other side receives it as a single message with the concatenated
+ * content.
+ * The data is written directly from the user buffers (no intermediate copy)
+ */
+void bs_bc_send_msgv(uint channel_id, const struct iovec *iov, int iovcnt){
+  check_send_channel_id(channel_id);
+
+  if ( iovcnt + 2 > BC_MAX_IOV ) {
+    bs_trace_error_line("Too many buffers (%i) for one back channel message (max %i)\n",
+                        iovcnt, BC_MAX_IOV - 2);
+  }
+
+  size_t size = 0;
+  for ( int i = 0; i < iovcnt; i++ ) {
+    size += iov[i].iov_len;
+  }
+  if ( size > large_msg_threshold ) {
+    send_large_msg(channel_id, iov, iovcnt, size);
+    return;
+  }
+
+  struct iovec local_iov[16];
+  struct iovec *all_iov = local_iov;
+  if ( iovcnt + 2 > 16 ) {
+    all_iov = bs_malloc((iovcnt + 2)*sizeof(struct iovec));
+  }
+
+  channels_status_t *ch = &channels_status[channel_id];
+  uint32_t size32;
+  bs_time_t stamp;
+  int hdr_cnt = msg_header(ch, size, 0, &size32, &stamp, all_iov);
+  memcpy(&all_iov[hdr_cnt], iov, iovcnt*sizeof(struct iovec));
+  channel_writev(channel_id, all_iov, iovcnt + hdr_cnt, size + msg_hdr_len(ch), 1);
+
+  if ( all_iov != local_iov ) {
+    free(all_iov);
+  }
+}
+
+/**
+ * Send <n_msgs> messages, each described by an element of <msgs>, possibly
+ * thru different channels.
+ *
+ * The messages sent to the same channel are received in the same order as
+ * they are in <msgs>.
+ * All messages for the same channel are written together, with as few
+ * system calls as possible (for FIFOs, in groups of up to PIPE_BUF bytes, so
+ * each write is still atomic).
+ */
+void bs_bc_send_msgs(const bs_bc_msg_t *msgs, uint n_msgs){
+  if ( n_msgs == 0 ) {
+    return;
+  }
+
+  /* Stable bucketing of the messages per channel */
+  uint *order = bs_malloc(n_msgs*sizeof(uint));
+  uint *ch_start = bs_calloc(number_back_channels + 1, sizeof(uint));
+  for ( uint i = 0; i < n_msgs; i++ ) {
+    check_send_channel_id(msgs[i].channel_id);
+    ch_start[msgs[i].channel_id + 1]++;
+  }
+  for ( int c = 0; c < number_back_channels; c++ ) {
+    ch_start[c + 1] += ch_start[c];
+  }
+  for ( uint i = 0; i < n_msgs; i++ ) {
+    order[ch_start[msgs[i].channel_id]++] = i;
+  }
+  /* Now ch_start[c] is the end of channel c bucket */
+
+  int max_iov = BS_MIN(3*n_msgs, BC_MAX_IOV);
+  struct iovec *iov = bs_malloc(max_iov*sizeof(struct iovec));
+  uint32_t *sizes = bs_malloc(n_msgs*sizeof(uint32_t));
+  bs_time_t *stamps = bs_malloc(n_msgs*sizeof(bs_time_t));
+
+  uint i = 0;
+  while ( i < n_msgs ) {
+    uint channel_id = msgs[order[i]].channel_id;
+    channels_status_t *ch = &channels_status[channel_id];
+    uint end = ch_start[channel_id];
+    size_t max_total = PIPE_BUF;
+    if ( is_shm_out(ch) ) {
+      max_total = try_open_out(channel_id) ? shm_out_capacity(ch) : SIZE_MAX;
+    }
+    int iovcnt = 0;
+    size_t total = 0;
+    uint n_group = 0;
+
+    /* Gather as many messages as possible in one write */
+    do {
+      const bs_bc_msg_t *m = &msgs[order[i]];
+      size_t msg_total = m->size + msg_hdr_len(ch);
+      if ( m->size > large_msg_threshold ) { //Large messages go on their own
+        if ( iovcnt == 0 ) {
+          struct iovec large_iov = { .iov_base = m->ptr, .iov_len = m->size };
+          send_large_msg(channel_id, &large_iov, 1, m->size);
+          i++;
+        }
+        break;
+      }
+      if ( ( iovcnt > 0 ) &&
+           ( ( total + msg_total > max_total ) || ( iovcnt + 3 > max_iov ) ) ) {
+        break;
+      }
+      iovcnt += msg_header(ch, m->size, 0, &sizes[i], &stamps[i], &iov[iovcnt]);
+      if ( m->size ) {
+        iov[iovcnt].iov_base = m->ptr;
+        iov[iovcnt++].iov_len = m->size;
+      }
+      total += msg_total;
+      n_group++;
+      i++;
+    } while ( i < end );
+
+    if ( iovcnt > 0 ) {
+      channel_writev(channel_id, iov, iovcnt, total, n_group);
+    }
+  }
+
+  free(stamps);
+  free(sizes);
+  free(iov);
+  free(ch_start);
+  free(order);
+}
+
+/*
+ * Read the next <n> bytes of the message being received
+ * (for FIFOs, the message has already fully arrived into the read-ahead buffer)
+ */
+static void msg_read(channels_status_t *ch, void *dst, size_t n){
+  if ( ch->transport == BC_SHM ) {
+    bc_shm_ring_read(&ch->ring[In], dst, n);
+  } else if ( ch->transport == BC_BCAST_RX ) {
+    bc_bcast_read(&ch->bcast, dst, n);
+  } else {
+    memcpy(dst, &ch->rx_buf[ch->rx_pos], n);
+    ch->rx_pos += n;
+  }
+}
+
+/*
+ * Make the message with size word <size32> (already without time stamp)
+ * pending to be read by the user
+ */
+static void msg_deliver(uint channel_id, uint32_t size32){
+  channels_status_t *ch = &channels_status[channel_id];
+
+  if ( size32 & BC_LARGE_MSG_FLAG ) {
+    uint8_t desc[BC_LARGE_DESC_MAX];
+    size32 &= BC_MSG_SIZE_MASK;
+    msg_read(ch, desc, BS_MIN(size32, BC_LARGE_DESC_MAX));
+    large_msg_open(channel_id, desc, size32);
+  } else {
+    ch->pending_read_bytes = size32; //(empty messages are just skipped)
+  }
+}
+
+/*
+ * Deliver the held time stamped message if this device has reached its time
+ */
+static void msg_release_held(uint channel_id){
+  channels_status_t *ch = &channels_status[channel_id];
+
+  if ( bc_time_f == NULL ) {
+    bs_trace_error_line("Received a time stamped message in back channel %u, but no time function was registered (bs_bc_register_time_function())\n",
+                        channel_id);
+  }
+  if ( bc_time_f() >= ch->held_time ) {
+    ch->held = false;
+    ch->msg_time = ch->held_time;
+    msg_deliver(channel_id, ch->held_size32);
+  }
+}
+
+/*
+ * Start receiving the message whose size word <size32> has just been read
+ * Time stamped messages are held until this device reaches their time
+ */
+static void msg_start(uint channel_id, uint32_t size32){
+  channels_status_t *ch = &channels_status[channel_id];
+
+  if ( size32 & BC_TIME_STAMP_FLAG ) {
+    if ( ( size32 & BC_MSG_SIZE_MASK ) < sizeof(bs_time_t) ) {
+      bs_trace_error_line("Corrupted time stamped message in back channel %u\n", channel_id);
+    }
+    msg_read(ch, &ch->held_time, sizeof(bs_time_t));
+    ch->held_size32 = ( size32 & ~BC_TIME_STAMP_FLAG ) - sizeof(bs_time_t);
+    ch->held = true;
+    msg_release_held(channel_id);
+  } else {
+    ch->msg_time = 0;
+    msg_deliver(channel_id, size32);
+  }
+}
+
+/*
+ * Non blocking read of up to <size> bytes from the channel FIFO
+ * Returns the number of bytes read, 0 if nothing was available,
+ * or -1 if the other side closed the channel
+ */
+static int fifo_read(uint channel_id, void *ptr, size_t size){
+  while ( true ) {
+    ssize_t read_size = read(channels_status[channel_id].ff[In], ptr, size);
+    if ( read_size > 0 ) {
+      return read_size;
+    } else if ( ( read_size == -1 ) && (errno == EAGAIN) ) { //Nothing yet there
+      return 0;
+    } else if ( ( read_size == -1 ) && (errno == EINTR) ) {
+      //A signal interrupted the read before anything was read => retry needed
+      bs_trace_warning_line("Read to back channel %u interrupted by signal => Retrying\n",
+                            channel_id);
+    } else if ( read_size == 0 ) {
+      //No writer connected: either the other side did not open its end yet
+      //(nothing there yet), or it closed it (POLLHUP)
+      struct pollfd pfd = { .fd = channels_status[channel_id].ff[In], .events = POLLIN };
+      if ( ( poll(&pfd, 1, 0) == 1 ) && ( pfd.revents & POLLHUP ) ) {
+        return -1;
+      }
+      return 0;
+    } else {
+      bs_trace_error_line("Unexpected error in channel %u (%zi read, errno=%i: %s)\n",
+                          channel_id, read_size, errno, strerror(errno));
+    }
+  }
+}
+
+#define BC_RX_BUF_SIZE (64*1024)
+
+/*
+ * Is there a complete message in the channel read-ahead buffer
+ */
+static bool fifo_msg_buffered(channels_status_t *ch){
+  size_t avail = ch->rx_end - ch->rx_start;
+  uint32_t size32;
+  if ( avail < sizeof(uint32_t) ) {
+    return false;
+  }
+  memcpy(&size32, &ch->rx_buf[ch->rx_start], sizeof(uint32_t));
+  return avail - sizeof(uint32_t) >= ( size32 & BC_MSG_SIZE_MASK );
+}
+
+/*
+ * Parse the next complete message out of the channel read-ahead buffer
+ * or, if there is none, read into it all that is available in the FIFO
+ * (in one read() call).
+ * Once a message has fully arrived, it is made pending to be read by the user.
+ *
+ * Returns > 0 if some progress was made, 0 if nothing was available,
+ * -1 if the channel was closed
+ */
+static int fifo_receive_some(uint channel_id){
+  channels_status_t *ch = &channels_status[channel_id];
+  size_t avail = ch->rx_end - ch->rx_start;
+  uint32_t size32 = 0;
+
+  if ( avail >= sizeof(uint32_t) ) {
+    memcpy(&size32, &ch->rx_buf[ch->rx_start], sizeof(uint32_t));
+    uint32_t len = size32 & BC_MSG_SIZE_MASK;
+    if ( avail - sizeof(uint32_t) >= len ) {
+      ch->rx_pos = ch->rx_start + sizeof(uint32_t);
+      ch->rx_start = ch->rx_pos + len;
+      msg_start(channel_id, size32);
+      return 1;
+    }
+    size32 = len;
+  }
+
+  //Not a complete message in the buffer => make space and read some more
+  size_t needed = BS_MAX((size_t)size32 + sizeof(uint32_t), BC_RX_BUF_SIZE);
+  if ( ch->rx_start > 0 ) {
+    memmove(ch->rx_buf, &ch->rx_buf[ch->rx_start], avail);
+    ch->rx_start = 0;
+    ch->rx_end = avail;
+  }
+  if ( ch->rx_buf_size < needed ) {
+    ch->rx_buf_size = needed;
+    ch->rx_buf = bs_realloc(ch->rx_buf, ch->rx_buf_size);
+  }
+
+  int ret = fifo_read(channel_id, &ch->rx_buf[ch->rx_end], ch->rx_buf_size - ch->rx_end);
+  if ( ret > 0 ) {
+    ch->rx_end += ret;
+  } else if ( ret < 0 ) {
+    if ( avail > 0 ) {
+      bs_trace_warning_line("Back channel %u closed by the other side in the middle of a message\n",
+                            channel_id);
+    }
+    ch->pending_read_bytes = -1;
+    bs_trace_raw_time(3,"The back channel %u was closed by the other side\n",channel_id);
+  }
+  return ret;
+}
+
+/*
+ * bs_bc_is_msg_received() for broadcast receive channels
+ */
+static int bcast_is_msg_received(uint channel_id){
+  channels_status_t *ch = &channels_status[channel_id];
+  bc_bcast_t *bcast = &ch->bcast;
+
+  if ( bcast->hdr == NULL ) { //The writer did not open it yet
+    int ret = bc_bcast_try_attach(bcast, ch->ff_path[In]);
+    if ( ret == 1 ) {
+      return 0;
+    } else if ( ret != 0 ) {
+      bs_trace_error_line("Could not attach to broadcast back channel %u (%s)\n",
+                          channel_id, ch->ff_path[In]);
+    }
+  }
+  if ( ( ch->pending_read_bytes == 0 ) && !ch->held ) {
+    if ( bc_bcast_used(bcast) >= sizeof(uint32_t) ) {
+      uint32_t size32;
+      bc_bcast_read(bcast, &size32, sizeof(uint32_t));
+      msg_start(channel_id, size32);
+    } else if ( bc_bcast_writer_closed(bcast)
+                && ( bc_bcast_used(bcast) < sizeof(uint32_t) ) ) { //Recheck: a last message may have just been written
+      ch->pending_read_bytes = -1;
+      bs_trace_raw_time(3,"The broadcast back channel %u was closed by the other side\n",channel_id);
+    }
+  }
+  return ch->pending_read_bytes;
+}
+
+/*
+ * Drop our reference to the large message segment named in the <len> bytes
+ * descriptor <desc_ptr>, without reading it (deleting it if it was the last)
+ */
+static void large_desc_release(const void *desc_ptr, size_t len){
+  bc_large_desc_t desc;
+
+  if ( ( len <= sizeof(uint64_t) ) || ( len > sizeof(desc) ) ) {
+    return;
+  }
+  memcpy(&desc, desc_ptr, len);
+  desc.name[len - sizeof(uint64_t) - 1] = 0;
+  char path[pb_com_path_length + strlen(desc.name) + 2];
+  sprintf(path, "%s/%s", pb_com_path, desc.name);
+
+  int fd = open(path, O_RDWR);
+  if ( fd == -1 ) {
+    return;
+  }
+  bc_large_seg_t *seg = mmap(NULL, sizeof(bc_large_seg_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if ( seg == MAP_FAILED ) {
+    return;
+  }
+  if ( __atomic_sub_fetch(&seg->refcount, 1, __ATOMIC_ACQ_REL) == 0 ) {
+    remove(path);
+  }
+  munmap(seg, sizeof(bc_large_seg_t));
+}
+
+/*
+ * Skip the next <n> bytes of the message being received
+ */
+static void msg_skip(channels_status_t *ch, size_t n){
+  uint8_t scratch[256];
+  while ( n > 0 ) {
+    size_t chunk = BS_MIN(n, sizeof(scratch));
+    msg_read(ch, scratch, chunk);
+    n -= chunk;
+  }
+}
+
+/*
+ * Drop the next message (whose size word <size32> has just been read)
+ * without delivering it, releasing it if it is a large message
+ * Returns the number of bytes it took after its size word
+ */
+static size_t msg_drop(channels_status_t *ch, uint32_t size32){
+  size_t len = size32 & BC_MSG_SIZE_MASK;
+  size_t stamp_len = 0;
+
+  if ( ( size32 & BC_TIME_STAMP_FLAG ) && ( len >= sizeof(bs_time_t) ) ) {
+    stamp_len = sizeof(bs_time_t);
+    msg_skip(ch, stamp_len);
+    len -= stamp_len;
+  }
+  if ( ( size32 & BC_LARGE_MSG_FLAG ) && ( len <= BC_LARGE_DESC_MAX ) ) {
+    uint8_t desc[BC_LARGE_DESC_MAX];
+    msg_read(ch, desc, len);
+    large_desc_release(desc, len);
+  } else {
+    msg_skip(ch, len);
+  }
+  return stamp_len + len;
+}
+
+/*
+ * The receiving side of <channel_id> is being closed: release the large
+ * messages which were not read (also those still in the channel), as nobody
+ * else would delete their segments
+ */
+static void rx_drain_on_close(uint channel_id){
+  channels_status_t *ch = &channels_status[channel_id];
+  bool rx_open = ( ( ch->transport == BC_FIFO ) && ( ch->ff[In] != -1 ) )
+                 || ( ( ch->transport == BC_SHM ) && ( ch->ring[In].hdr != NULL ) )
+                 || ( ( ch->transport == BC_BCAST_RX ) && ( ch->bcast.hdr != NULL ) );
+
+  if ( ch->large_seg != NULL ) {
+    large_msg_release(channel_id);
+  } else if ( rx_open && ( ch->pending_read_bytes > 0 ) ) {
+    msg_skip(ch, ch->pending_read_bytes);
+  }
+  ch->pending_read_bytes = 0;
+  if ( !rx_open ) {
+    return;
+  }
+  if ( ch->held ) {
+    ch->held = false;
+    msg_drop(ch, ch->held_size32 & ~BC_TIME_STAMP_FLAG);
+  }
+
+  if ( ch->transport == BC_FIFO ) {
+    //Take in what is left in the FIFO, and go thru the complete messages
+    int avail = 0;
+    if ( ( ioctl(ch->ff[In], FIONREAD, &avail) == 0 ) && ( avail > 0 ) ) {
+      size_t left = ch->rx_end - ch->rx_start;
+      if ( ch->rx_buf_size < left + avail ) {
+        ch->rx_buf_size = left + avail;
+        ch->rx_buf = bs_realloc(ch->rx_buf, ch->rx_buf_size);
+      }
+      int ret;
+      while ( ( avail > 0 )
+              && ( ( ret = fifo_read(channel_id, &ch->rx_buf[ch->rx_end], avail) ) > 0 ) ) {
+        ch->rx_end += ret;
+        avail -= ret;
+      }
+    }
+    while ( fifo_msg_buffered(ch) ) {
+      uint32_t size32;
+      memcpy(&size32, &ch->rx_buf[ch->rx_start], sizeof(uint32_t));
+      ch->rx_pos = ch->rx_start + sizeof(uint32_t);
+      ch->rx_start = ch->rx_pos + ( size32 & BC_MSG_SIZE_MASK );
+      msg_drop(ch, size32);
+    }
+    return;
+  }
+
+  //Shared memory senders publish whole messages. We only go thru what is
+  //there now, in case the sender keeps on sending
+  size_t left = ( ch->transport == BC_SHM ) ? bc_shm_ring_used(&ch->ring[In]) : bc_bcast_used(&ch->bcast);
+  while ( left >= sizeof(uint32_t) ) {
+    uint32_t size32;
+    msg_read(ch, &size32, sizeof(uint32_t));
+    size_t len = msg_drop(ch, size32);
+    left -= BS_MIN(left, sizeof(uint32_t) + len);
+  }
+}
+
+/**
+ * check if there is any pending message in the queue
+ * Returns -1 if the channel is closed
+ * Returns 0 if nothing is available yet
+ * the size of the next message if there is something
+ */
+int bs_bc_is_msg_received(uint channel_id){
+  if ( channel_id >= number_back_channels )
+    bs_trace_error_line("you are trying to check for a message in a non existent back channel (%u)\n", channel_id);
+
+  opportunistic_flush();
+
+  if ( channels_status[channel_id].transport == BC_BCAST_TX ) {
+    bs_trace_error_line("you are trying to check for a message in a send only broadcast back channel (%u)\n", channel_id);
+  }
+
+  if ( channels_status[channel_id].held ) {
+    msg_release_held(channel_id);
+    if ( channels_status[channel_id].held ) {
+      return 0;
+    }
+  }
+
+  if ( channels_status[channel_id].transport == BC_BCAST_RX ) {
+    return bcast_is_msg_received(channel_id);
+  }
+
+  if ( channels_status[channel_id].transport == BC_SHM ) {
+    bc_shm_ring_t *ring = &channels_status[channel_id].ring[In];
+    if ( ( channels_status[channel_id].pending_read_bytes == 0 ) && !channels_status[channel_id].held ) {
+      if ( bc_shm_ring_used(ring) >= sizeof(uint32_t) ) {
+        uint32_t size32;
+        bc_shm_ring_read(ring, &size32, sizeof(uint32_t));
+        msg_start(channel_id, size32);
+      } else if ( bc_shm_ring_writer_closed(ring)
+                  && ( bc_shm_ring_used(ring) < sizeof(uint32_t) ) ) { //Recheck: a last message may have just been written
+        channels_status[channel_id].pending_read_bytes = -1;
+        bs_trace_raw_time(3,"The back channel %u was closed by the other side\n",channel_id);
+      }
+    }
+    return channels_status[channel_id].pending_read_bytes;
+  }
+
+  while ( ( channels_status[channel_id].pending_read_bytes == 0 ) //otherwise the user is calling this function twice (and we'd break the protocol)
+          && !channels_status[channel_id].held ) {
+    if ( fifo_receive_some(channel_id) <= 0 ) {
+      break;
+    }
+  }
+  return channels_status[channel_id].pending_read_bytes;
+}
+
+/**
+ * Receive a message into <ptr> of <size> bytes from the other side
+ *
+ * Always call bs_bc_is_msg_received() before to check that there is
+ * indeed a message,
+ * and always ask for a message of not more than the number of bytes
+ * bs_bc_is_msg_received() returned
+ */
+void bs_bc_receive_msg(int channel_id , uint8_t *ptr, size_t size){
+  if ( channel_id >= number_back_channels )
+    bs_trace_error_line("You are trying to receive a message in a non existent back channel (%u)\n", channel_id);
+
+  if ( size > channels_status[channel_id].pending_read_bytes )
+    bs_trace_error_line("Last time you checked bs_bc_is_msg_received() told there was %u bytes in channel %u, but now you try to read %u??\n",
+                         channels_status[channel_id].pending_read_bytes, channel_id, size);
+
+  if ( size == 0 )
+    return;
+
+  if ( channels_status[channel_id].large_seg != NULL ) {
+    channels_status_t *ch = &channels_status[channel_id];
+    memcpy(ptr, &ch->large_seg->data[ch->large_pos], size);
+    ch->large_pos += size;
+    ch->pending_read_bytes -= size;
+    if ( ch->pending_read_bytes == 0 ) {
+      large_msg_release(channel_id);
+    }
+    return;
+  }
+
+  //The message has already fully arrived (shared memory senders publish whole messages)
+  msg_read(&channels_status[channel_id], ptr, size);
+  channels_status[channel_id].pending_read_bytes -= size;
+}
+
+/**
+ * Earliest time at which a message can be received thru any of the back
+ * channels, that is, the time stamp of the earliest held time stamped message,
+ * or, if a message is already pending to be received, its time stamp
+ * (0 if it was not time stamped).
+ * TIME_NEVER if nothing has arrived.
+ *
+ * Devices can use it to wait exactly until the next message delivery instead
+ * of checking their back channels periodically.
+ * Note that messages which have not yet arrived are not accounted for.
+ */
+bs_time_t bs_bc_next_delivery_time(void){
+  bs_time_t next = TIME_NEVER;
+
+  for ( uint c = 0; c < number_back_channels; c++ ) {
+    channels_status_t *ch = &channels_status[c];
+    if ( ch->transport == BC_BCAST_TX ) {
+      continue;
+    }
+    if ( bs_bc_is_msg_received(c) > 0 ) {
+      next = BS_MIN(next, ch->msg_time);
+    } else if ( ch->held ) {
+      next = BS_MIN(next, ch->held_time);
+    }
+  }
+  return next;
+}
+
+static bool is_channel_ready(uint channel_id){
+  return ( channels_status[channel_id].pending_read_bytes != 0 )
+         || ( ( ( channels_status[channel_id].transport == BC_SHM )
+                || ( channels_status[channel_id].transport == BC_BCAST_RX )
+                || channels_status[channel_id].held
+                || fifo_msg_buffered(&channels_status[channel_id]) )
+              && ( bs_bc_is_msg_received(channel_id) != 0 ) );
+}
+
+static int64_t monotonic_ms(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+#define BC_POLL_SHM_SLICE_MS 1
+
+/**
+ * Check which back channels have a pending message
+ *
+ * Up to <max> channel ids are stored in <ready_ids>, and their number is
+ * returned.
+ * A channel is reported as ready if bs_bc_is_msg_received() would return
+ * a non zero value for it, that is, if it has a pending message, or if it has
+ * been closed by the other side (-1).
+ * Channels holding a time stamped message which is not due yet are not
+ * ready (and are not waited on), as that only changes when this device
+ * time advances.
+ *
+ * If no channel is ready, this function will block for up to <timeout_ms>
+ * (wall clock) milliseconds waiting for one to become ready
+ * (0 = do not block, -1 = block until one is ready).
+ * If no channel could become ready while waiting (for ex. if they all hold
+ * a message which is not due yet), it returns 0 right away.
+ *
+ * All FIFO channels are checked with only one poll() system call, and shared
+ * memory channels with just a memory read each. While blocking, shared
+ * memory channels (and the overflow queues) are rechecked every
+ * BC_POLL_SHM_SLICE_MS ms.
+ */
+int bs_bc_poll(uint *ready_ids, uint max, int timeout_ms){
+  static struct pollfd *fds;
+  static uint *fds_channel;
+  static int fds_size;
+
+  if ( number_back_channels <= 0 ) {
+    return 0;
+  }
+  if ( fds_size < number_back_channels ) {
+    fds_size = number_back_channels;
+    fds = bs_realloc(fds, fds_size*sizeof(struct pollfd));
+    fds_channel = bs_realloc(fds_channel, fds_size*sizeof(uint));
+  }
+
+  int64_t deadline = ( timeout_ms > 0 ) ? monotonic_ms() + timeout_ms : 0;
+
+  while ( true ) {
+    uint n_ready = 0;
+    int n_fds = 0;
+    bool any_shm = false;
+
+    opportunistic_flush();
+
+    for ( uint c = 0; ( c < number_back_channels ) && ( n_ready < max ); c++ ) {
+      if ( channels_status[c].transport == BC_BCAST_TX ) {
+        continue; //Nothing to receive thru these
+      } else if ( is_channel_ready(c) ) {
+        ready_ids[n_ready++] = c;
+      } else if ( channels_status[c].held ) {
+        continue; //Its message is not due until this device time advances, nothing to wait for
+      } else if ( channels_status[c].transport == BC_FIFO ) {
+        fds[n_fds].fd = channels_status[c].ff[In];
+        fds[n_fds].events = POLLIN;
+        fds[n_fds].revents = 0;
+        fds_channel[n_fds++] = c;
+      } else {
+        any_shm = true;
+      }
+    }
+
+    //While data is waiting to be sent, we also need to wake up periodically
+    any_shm |= ( n_queued_channels > 0 );
+
+    if ( ( n_ready == 0 ) && ( n_fds == 0 ) && !any_shm ) {
+      return 0; //There is nothing which could become ready while we wait
+    }
+
+    int wait_ms = 0;
+    if ( n_ready == 0 ) {
+      if ( timeout_ms < 0 ) {
+        wait_ms = any_shm ? BC_POLL_SHM_SLICE_MS : -1;
+      } else if ( timeout_ms > 0 ) {
+        wait_ms = BS_MAX(deadline - monotonic_ms(), 0);
+        if ( any_shm ) {
+          wait_ms = BS_MIN(wait_ms, BC_POLL_SHM_SLICE_MS);
+        }
+      }
+    }
+
+    if ( n_fds > 0 ) {
+      int ret = poll(fds, n_fds, wait_ms);
+      if ( ( ret == -1 ) && ( errno != EINTR ) ) {
+        bs_trace_error_line("Unexpected error polling the back channels (errno=%i: %s)\n",
+                            errno, strerror(errno));
+      }
+      for ( int i = 0; ( i < n_fds ) && ( ret > 0 ) && ( n_ready < max ); i++ ) {
+        if ( fds[i].revents && ( bs_bc_is_msg_received(fds_channel[i]) != 0 ) ) {
+          ready_ids[n_ready++] = fds_channel[i];
+        }
+      }
+    } else if ( wait_ms != 0 ) {
+      const struct timespec slice = {0, BC_POLL_SHM_SLICE_MS*1000000};
+      nanosleep(&slice, NULL);
+    }
+
+    if ( ( n_ready > 0 ) || ( timeout_ms == 0 )
+        || ( ( timeout_ms > 0 ) && ( monotonic_ms() >= deadline ) ) ) {
+      return n_ready;
+    }
   }
-  channels_status[channel_id].pending_read_bytes -= size;
 }
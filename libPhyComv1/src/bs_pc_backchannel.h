@@ -7,17 +7,55 @@
 #define BS_PC_BASECHANNEL_H
 
 #include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "bs_types.h"
 
 #ifdef __cplusplus
 extern "C"{
 #endif
 
 uint *bs_open_back_channel(uint global_dev_nbr, uint* dev_nbrs, uint* channel_nbrs, uint number_of_channels);
+uint *bs_open_back_channel_shm(uint global_dev_nbr, uint* dev_nbrs, uint* channel_nbrs, uint number_of_channels);
+uint *bs_add_back_channel(uint global_dev_nbr, uint* dev_nbrs, uint* channel_nbrs, uint number_of_channels);
+uint *bs_add_back_channel_shm(uint global_dev_nbr, uint* dev_nbrs, uint* channel_nbrs, uint number_of_channels);
+int bs_bc_open_broadcast_tx(uint global_dev_nbr, uint channel_nbr, uint nbr_of_readers);
+int bs_bc_open_broadcast_rx(uint writer_dev_nbr, uint channel_nbr);
 void bs_clean_back_channels(void);
 
+typedef struct {
+  uint channel_id;
+  uint8_t *ptr;
+  size_t size;
+} bs_bc_msg_t;
+
+typedef struct {
+  uint64_t msgs_sent; /* Messages sent (including those still queued) */
+  uint64_t bytes_sent; /* Payload bytes sent (including those still queued) */
+  uint64_t full_events; /* Sends which could not (fully) go into the channel and were queued */
+  size_t queued_bytes; /* Bytes currently waiting in the overflow queue */
+  size_t queue_high_water; /* Maximum number of bytes which have waited in the overflow queue */
+  size_t fill_high_water; /* Maximum fill of the channel seen after a send (shared memory only) */
+  size_t capacity; /* Capacity of the channel in the sending direction (0 if unknown) */
+  uint64_t large_msgs_sent; /* Messages sent thru a shared memory segment */
+} bs_bc_stats_t;
+
+void bs_bc_set_default_capacity(size_t capacity);
+ssize_t bs_bc_set_capacity(uint channel_id, size_t capacity);
+void bs_bc_get_stats(uint channel_id, bs_bc_stats_t *stats);
+size_t bs_bc_flush(void);
+void bs_bc_set_large_msg_threshold(size_t threshold);
+void bs_bc_register_time_function(bs_time_t (*time_f)(void));
+void bs_bc_set_time_stamped(uint channel_id, bool time_stamped);
+bs_time_t bs_bc_next_delivery_time(void);
+
 void bs_bc_send_msg(uint channel_id, uint8_t *ptr, size_t size);
+void bs_bc_send_msgv(uint channel_id, const struct iovec *iov, int iovcnt);
+void bs_bc_send_msgs(const bs_bc_msg_t *msgs, uint n_msgs);
 int bs_bc_is_msg_received(uint channel_id);
 void bs_bc_receive_msg(int channel_id , uint8_t *ptr, size_t size);
+int bs_bc_poll(uint *ready_ids, uint max, int timeout_ms);
 
 #ifdef __cplusplus
 }
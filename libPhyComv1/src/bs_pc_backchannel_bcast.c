@@ -0,0 +1,274 @@
+/*
+ * Copyright 2018 Oticon A/S
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+/**
+ * Single producer, multiple consumer byte log in a shared memory (mmap'ed)
+ * file, used as transport by the broadcast back channels.
+ *
+ * The producer (the device which writes into the log) creates the file,
+ * and declares how many consumers will read it. Each consumer attaches to it
+ * and claims one of the reader slots, in which it keeps its own read cursor.
+ * The producer copies complete messages into the log and only then publishes
+ * them by advancing <head>.
+ * Space is only reused once every reader has consumed it. Slots which have
+ * not been claimed yet count as readers which have not read anything, so
+ * readers which attach late do not miss any message.
+ * Readers which close their side (or die) stop holding the producer back.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "bs_pc_backchannel_bcast.h"
+#include "bs_tracing.h"
+
+static uint32_t round_up_pow2(uint32_t v) {
+  uint32_t p = 1;
+  while ( p < v ) {
+    p <<= 1;
+  }
+  return p;
+}
+
+static size_t data_offset(uint32_t n_readers) {
+  return sizeof(bc_bcast_hdr_t) + n_readers*sizeof(bc_bcast_slot_t);
+}
+
+static int map_file(bc_bcast_t *b, int fd, size_t size) {
+  void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if ( ptr == MAP_FAILED ) {
+    return -1;
+  }
+  b->hdr = (bc_bcast_hdr_t *)ptr;
+  b->map_size = size;
+  return 0;
+}
+
+/**
+ * Create the log file <path> (producer side), with a data area of at least
+ * <capacity> bytes, to be read by <n_readers> consumers
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int bc_bcast_create(bc_bcast_t *b, const char *path, uint32_t capacity, uint32_t n_readers) {
+  capacity = round_up_pow2(capacity);
+  size_t size = data_offset(n_readers) + capacity;
+
+  char tmp_path[strlen(path) + 20];
+  sprintf(tmp_path, "%s.%li", path, (long)getpid());
+
+  (void)remove(path);
+  int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+  if ( fd == -1 ) {
+    bs_trace_warning_line("Can not create %s (errno=%i)\n", tmp_path, errno);
+    return -1;
+  }
+  if ( ( ftruncate(fd, size) != 0 ) || ( map_file(b, fd, size) != 0 ) ) {
+    bs_trace_warning_line("Can not size/map %s (errno=%i)\n", tmp_path, errno);
+    close(fd);
+    remove(tmp_path);
+    return -1;
+  }
+  close(fd); /* The mapping stays valid */
+
+  b->mask = capacity - 1;
+  b->slot = -1;
+  b->data = (uint8_t *)b->hdr + data_offset(n_readers);
+  b->hdr->capacity = capacity;
+  b->hdr->n_readers = n_readers;
+  b->hdr->writer_pid = getpid();
+  __atomic_store_n(&b->hdr->magic, BC_BCAST_MAGIC, __ATOMIC_RELEASE);
+
+  if ( rename(tmp_path, path) != 0 ) {
+    bs_trace_warning_line("Can not rename %s into %s (errno=%i)\n", tmp_path, path, errno);
+    bc_bcast_close(b);
+    remove(tmp_path);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Try to attach to the log file <path> (consumer side) without blocking,
+ * claiming one of its reader slots
+ *
+ * Returns 0 if attached, 1 if the other side has not created it yet,
+ * -1 on error
+ */
+int bc_bcast_try_attach(bc_bcast_t *b, const char *path) {
+  int fd = open(path, O_RDWR);
+  if ( fd == -1 ) {
+    return ( errno == ENOENT ) ? 1 : -1;
+  }
+
+  struct stat st;
+  if ( ( fstat(fd, &st) != 0 ) || ( st.st_size < sizeof(bc_bcast_hdr_t) ) ) {
+    close(fd);
+    return 1;
+  }
+  if ( map_file(b, fd, st.st_size) != 0 ) {
+    close(fd);
+    return -1;
+  }
+  close(fd);
+
+  bc_bcast_hdr_t *hdr = b->hdr;
+  if ( ( __atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != BC_BCAST_MAGIC )
+      || ( data_offset(hdr->n_readers) + hdr->capacity != st.st_size )
+      || ( kill(hdr->writer_pid, 0) != 0 ) ) { /* Left behind by a dead process */
+    munmap(b->hdr, b->map_size);
+    b->hdr = NULL;
+    return 1;
+  }
+
+  for ( int i = 0; i < hdr->n_readers; i++ ) {
+    uint32_t expected = BC_BCAST_SLOT_FREE;
+    if ( __atomic_compare_exchange_n(&hdr->slot[i].state, &expected, BC_BCAST_SLOT_ACTIVE,
+                                     false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ) {
+      hdr->slot[i].pid = getpid();
+      b->slot = i;
+      b->mask = hdr->capacity - 1;
+      b->data = (uint8_t *)hdr + data_offset(hdr->n_readers);
+      return 0;
+    }
+  }
+
+  bs_trace_warning_line("All %u reader slots of %s are already taken\n", hdr->n_readers, path);
+  munmap(b->hdr, b->map_size);
+  b->hdr = NULL;
+  return -1;
+}
+
+/**
+ * Mark our side of the log as closed and unmap it
+ */
+void bc_bcast_close(bc_bcast_t *b) {
+  if ( b->hdr == NULL ) {
+    return;
+  }
+  if ( b->slot >= 0 ) {
+    __atomic_store_n(&b->hdr->slot[b->slot].state, BC_BCAST_SLOT_CLOSED, __ATOMIC_RELEASE);
+  } else {
+    __atomic_store_n(&b->hdr->writer_closed, 1, __ATOMIC_RELEASE);
+  }
+  munmap(b->hdr, b->map_size);
+  b->hdr = NULL;
+}
+
+/**
+ * Producer: how many bytes can be written right now
+ * (that is, not still unread by some reader)
+ * If <check_alive>, readers which died are also found and released
+ * (this costs one system call per reader)
+ */
+size_t bc_bcast_free_space(bc_bcast_t *b, bool check_alive) {
+  bc_bcast_hdr_t *hdr = b->hdr;
+  uint64_t min_cursor = hdr->head;
+
+  for ( int i = 0; i < hdr->n_readers; i++ ) {
+    bc_bcast_slot_t *slot = &hdr->slot[i];
+    uint32_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+    if ( state == BC_BCAST_SLOT_CLOSED ) {
+      continue;
+    }
+    if ( check_alive && ( state == BC_BCAST_SLOT_ACTIVE ) && ( slot->pid != 0 )
+        && ( kill(slot->pid, 0) != 0 ) && ( errno == ESRCH ) ) {
+      __atomic_store_n(&slot->state, BC_BCAST_SLOT_CLOSED, __ATOMIC_RELEASE);
+      continue;
+    }
+    uint64_t cursor = __atomic_load_n(&slot->cursor, __ATOMIC_ACQUIRE);
+    if ( cursor < min_cursor ) {
+      min_cursor = cursor;
+    }
+  }
+  return hdr->capacity - (size_t)(hdr->head - min_cursor);
+}
+
+static void copy_in(bc_bcast_t *b, uint64_t pos, const uint8_t *src, size_t n) {
+  size_t off = pos & b->mask;
+  size_t first = b->hdr->capacity - off;
+  if ( n <= first ) {
+    memcpy(&b->data[off], src, n);
+  } else {
+    memcpy(&b->data[off], src, first);
+    memcpy(b->data, src + first, n - first);
+  }
+}
+
+static void copy_out(bc_bcast_t *b, uint64_t pos, uint8_t *dst, size_t n) {
+  size_t off = pos & b->mask;
+  size_t first = b->hdr->capacity - off;
+  if ( n <= first ) {
+    memcpy(dst, &b->data[off], n);
+  } else {
+    memcpy(dst, &b->data[off], first);
+    memcpy(dst + first, b->data, n - first);
+  }
+}
+
+/**
+ * Producer: copy the <total> bytes described by <iov> into the log and
+ * publish them to all readers in one go
+ *
+ * Returns 0 on success
+ *        -1 if there is not enough space (nothing is written)
+ */
+int bc_bcast_writev(bc_bcast_t *b, const struct iovec *iov, int iovcnt, size_t total) {
+  if ( ( bc_bcast_free_space(b, false) < total ) && ( bc_bcast_free_space(b, true) < total ) ) {
+    return -1;
+  }
+  uint64_t head = b->hdr->head;
+  for ( int i = 0; i < iovcnt; i++ ) {
+    copy_in(b, head, iov[i].iov_base, iov[i].iov_len);
+    head += iov[i].iov_len;
+  }
+  __atomic_store_n(&b->hdr->head, head, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/**
+ * Consumer: how many bytes are available for us to read
+ */
+size_t bc_bcast_used(bc_bcast_t *b) {
+  return (size_t)(__atomic_load_n(&b->hdr->head, __ATOMIC_ACQUIRE)
+                   - b->hdr->slot[b->slot].cursor);
+}
+
+/**
+ * Consumer: copy <n> bytes out of the log and release them
+ * (the caller must have checked there is at least <n> bytes available)
+ */
+void bc_bcast_read(bc_bcast_t *b, void *dst, size_t n) {
+  bc_bcast_slot_t *slot = &b->hdr->slot[b->slot];
+  copy_out(b, slot->cursor, dst, n);
+  __atomic_store_n(&slot->cursor, slot->cursor + n, __ATOMIC_RELEASE);
+}
+
+#define BC_BCAST_LIVENESS_CHECK_PERIOD 1024
+
+/**
+ * Consumer: has the producer closed its side
+ * (as for the rings, every BC_BCAST_LIVENESS_CHECK_PERIOD calls we also check
+ * if it is still alive)
+ */
+bool bc_bcast_writer_closed(bc_bcast_t *b) {
+  if ( __atomic_load_n(&b->hdr->writer_closed, __ATOMIC_ACQUIRE) ) {
+    return true;
+  }
+  if ( ++b->idle_polls >= BC_BCAST_LIVENESS_CHECK_PERIOD ) {
+    b->idle_polls = 0;
+    if ( ( kill(b->hdr->writer_pid, 0) != 0 ) && ( errno == ESRCH ) ) {
+      return true;
+    }
+  }
+  return false;
+}
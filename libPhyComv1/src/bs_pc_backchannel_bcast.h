@@ -0,0 +1,82 @@
+/*
+ * Copyright 2018 Oticon A/S
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef BS_PC_BACKCHANNEL_BCAST_H
+#define BS_PC_BACKCHANNEL_BCAST_H
+
+/**
+ * Internal definitions of the shared memory broadcast log used by the
+ * broadcast back channels.
+ * Users should not include this header, but use bs_pc_backchannel.h
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+#include "bs_pc_backchannel_shm.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+#define BC_BCAST_MAGIC 0x42434253 /* "SBCB" */
+
+#define BC_BCAST_SLOT_FREE   0 /* Not yet claimed by a reader */
+#define BC_BCAST_SLOT_ACTIVE 1
+#define BC_BCAST_SLOT_CLOSED 2 /* The reader closed it or died */
+
+/*
+ * Per reader state. Only its reader writes <cursor>
+ */
+typedef struct {
+  uint64_t cursor; /* Total number of bytes this reader has consumed */
+  uint32_t state;
+  int32_t pid;
+  uint8_t pad[BC_SHM_CACHE_LINE - sizeof(uint64_t) - 2*sizeof(uint32_t)];
+} bc_bcast_slot_t;
+
+/*
+ * Header placed at the start of each broadcast shared memory file,
+ * followed by <n_readers> reader slots, and then the data area
+ */
+typedef struct {
+  uint32_t magic; /* Set (last) by the writer once the log is initialized */
+  uint32_t capacity; /* Size of the data area, a power of 2 */
+  uint32_t n_readers;
+  int32_t writer_pid; /* Process which created (and writes into) the log */
+  uint8_t pad0[BC_SHM_CACHE_LINE - 4*sizeof(uint32_t)];
+
+  uint64_t head; /* Total number of bytes ever written */
+  uint32_t writer_closed;
+  uint8_t pad1[BC_SHM_CACHE_LINE - sizeof(uint64_t) - sizeof(uint32_t)];
+
+  bc_bcast_slot_t slot[];
+} bc_bcast_hdr_t;
+
+typedef struct {
+  bc_bcast_hdr_t *hdr;
+  uint8_t *data;
+  size_t map_size;
+  uint32_t mask;
+  int slot; /* Reader: slot claimed by this process. Writer: -1 */
+  uint32_t idle_polls; /* Reader: polls without news since we last checked the writer is alive */
+} bc_bcast_t;
+
+int bc_bcast_create(bc_bcast_t *b, const char *path, uint32_t capacity, uint32_t n_readers);
+int bc_bcast_try_attach(bc_bcast_t *b, const char *path);
+void bc_bcast_close(bc_bcast_t *b);
+
+size_t bc_bcast_free_space(bc_bcast_t *b, bool check_alive);
+int bc_bcast_writev(bc_bcast_t *b, const struct iovec *iov, int iovcnt, size_t total);
+size_t bc_bcast_used(bc_bcast_t *b);
+void bc_bcast_read(bc_bcast_t *b, void *dst, size_t n);
+bool bc_bcast_writer_closed(bc_bcast_t *b);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,265 @@
+/*
+ * Copyright 2018 Oticon A/S
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+/**
+ * Single producer, single consumer byte ring in a shared memory (mmap'ed)
+ * file, used as transport by the back channels.
+ *
+ * The consumer (the device which reads from the ring) creates the file,
+ * the producer attaches to it.
+ * The producer copies complete messages into the ring and only then publishes
+ * them by advancing <head>, so a consumer never sees half messages.
+ *
+ * To avoid picking up a ring left behind by a crashed simulation with the same
+ * sim_id, the consumer always creates the file anew (under a temporary name
+ * which is then renamed into place), and the producer only accepts a ring
+ * whose creator process is still alive.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "bs_pc_backchannel_shm.h"
+#include "bs_tracing.h"
+#include "bs_oswrap.h"
+
+static uint32_t round_up_pow2(uint32_t v) {
+  uint32_t p = 1;
+  while ( p < v ) {
+    p <<= 1;
+  }
+  return p;
+}
+
+static int map_file(bc_shm_ring_t *r, int fd, size_t size) {
+  void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if ( ptr == MAP_FAILED ) {
+    return -1;
+  }
+  r->hdr = (bc_shm_ring_hdr_t *)ptr;
+  r->map_size = size;
+  return 0;
+}
+
+/**
+ * Create the ring file <path> (consumer side), with a data area of at least
+ * <capacity> bytes
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int bc_shm_ring_create(bc_shm_ring_t *r, const char *path, uint32_t capacity) {
+  capacity = round_up_pow2(capacity);
+  size_t size = sizeof(bc_shm_ring_hdr_t) + capacity;
+
+  char tmp_path[strlen(path) + 20];
+  sprintf(tmp_path, "%s.%li", path, (long)getpid());
+
+  (void)remove(path);
+  int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+  if ( fd == -1 ) {
+    bs_trace_warning_line("Can not create %s (errno=%i)\n", tmp_path, errno);
+    return -1;
+  }
+  if ( ( ftruncate(fd, size) != 0 ) || ( map_file(r, fd, size) != 0 ) ) {
+    bs_trace_warning_line("Can not size/map %s (errno=%i)\n", tmp_path, errno);
+    close(fd);
+    remove(tmp_path);
+    return -1;
+  }
+  close(fd); /* The mapping stays valid */
+
+  r->mask = capacity - 1;
+  r->hdr->capacity = capacity;
+  r->hdr->reader_pid = getpid();
+  __atomic_store_n(&r->hdr->magic, BC_SHM_MAGIC, __ATOMIC_RELEASE);
+
+  if ( rename(tmp_path, path) != 0 ) {
+    bs_trace_warning_line("Can not rename %s into %s (errno=%i)\n", tmp_path, path, errno);
+    bc_shm_ring_close(r, true);
+    remove(tmp_path);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Try to attach to the ring file <path> (producer side) without blocking
+ *
+ * Returns 0 if attached, 1 if the other side has not created it yet,
+ * -1 on error
+ */
+int bc_shm_ring_try_attach(bc_shm_ring_t *r, const char *path) {
+  int fd = open(path, O_RDWR);
+  if ( fd == -1 ) {
+    return ( errno == ENOENT ) ? 1 : -1;
+  }
+
+  struct stat st;
+  if ( ( fstat(fd, &st) != 0 ) || ( st.st_size < sizeof(bc_shm_ring_hdr_t) ) ) {
+    close(fd);
+    return 1;
+  }
+  if ( map_file(r, fd, st.st_size) != 0 ) {
+    close(fd);
+    return -1;
+  }
+  close(fd);
+
+  bc_shm_ring_hdr_t *hdr = r->hdr;
+  if ( ( __atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != BC_SHM_MAGIC )
+      || ( hdr->capacity + sizeof(bc_shm_ring_hdr_t) != st.st_size )
+      || ( kill(hdr->reader_pid, 0) != 0 ) /* Left behind by a dead process */
+      || __atomic_load_n(&hdr->reader_closed, __ATOMIC_ACQUIRE) ) {
+    munmap(r->hdr, r->map_size);
+    r->hdr = NULL;
+    return 1;
+  }
+
+  r->mask = hdr->capacity - 1;
+  hdr->writer_pid = getpid();
+  return 0;
+}
+
+/**
+ * Attach to the ring file <path> (producer side),
+ * blocking until the other side has created it
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int bc_shm_ring_attach(bc_shm_ring_t *r, const char *path) {
+  const struct timespec poll_period = {0, 1000000};
+  int ret;
+  while ( ( ret = bc_shm_ring_try_attach(r, path) ) == 1 ) {
+    nanosleep(&poll_period, NULL);
+  }
+  return ret;
+}
+
+/**
+ * Mark our side of the ring as closed and unmap it
+ */
+void bc_shm_ring_close(bc_shm_ring_t *r, bool reader) {
+  if ( r->hdr == NULL ) {
+    return;
+  }
+  if ( reader ) {
+    __atomic_store_n(&r->hdr->reader_closed, 1, __ATOMIC_RELEASE);
+  } else {
+    __atomic_store_n(&r->hdr->writer_closed, 1, __ATOMIC_RELEASE);
+  }
+  munmap(r->hdr, r->map_size);
+  r->hdr = NULL;
+}
+
+/**
+ * Producer: how many bytes can be written right now
+ */
+size_t bc_shm_ring_free_space(bc_shm_ring_t *r) {
+  uint64_t tail = __atomic_load_n(&r->hdr->tail, __ATOMIC_ACQUIRE);
+  return r->hdr->capacity - (size_t)(r->hdr->head - tail);
+}
+
+static void copy_in(bc_shm_ring_t *r, uint64_t pos, const uint8_t *src, size_t n) {
+  size_t off = pos & r->mask;
+  size_t first = r->hdr->capacity - off;
+  if ( n <= first ) {
+    memcpy(&r->hdr->data[off], src, n);
+  } else {
+    memcpy(&r->hdr->data[off], src, first);
+    memcpy(r->hdr->data, src + first, n - first);
+  }
+}
+
+static void copy_out(bc_shm_ring_t *r, uint64_t pos, uint8_t *dst, size_t n) {
+  size_t off = pos & r->mask;
+  size_t first = r->hdr->capacity - off;
+  if ( n <= first ) {
+    memcpy(dst, &r->hdr->data[off], n);
+  } else {
+    memcpy(dst, &r->hdr->data[off], first);
+    memcpy(dst + first, r->hdr->data, n - first);
+  }
+}
+
+/**
+ * Producer: copy the <total> bytes described by <iov> into the ring and
+ * publish them in one go
+ *
+ * Returns 0 on success
+ *        -1 if there is not enough space (nothing is written)
+ *        -2 if the consumer has closed the ring (or died)
+ */
+int bc_shm_ring_writev(bc_shm_ring_t *r, const struct iovec *iov, int iovcnt, size_t total) {
+  if ( __atomic_load_n(&r->hdr->reader_closed, __ATOMIC_ACQUIRE) ) {
+    return -2;
+  }
+  if ( bc_shm_ring_free_space(r) < total ) {
+    return bc_shm_ring_reader_gone(r) ? -2 : -1;
+  }
+  uint64_t head = r->hdr->head;
+  for ( int i = 0; i < iovcnt; i++ ) {
+    copy_in(r, head, iov[i].iov_base, iov[i].iov_len);
+    head += iov[i].iov_len;
+  }
+  __atomic_store_n(&r->hdr->head, head, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/**
+ * Consumer: how many bytes are available to be read
+ * (one load of the producer's cache line)
+ */
+size_t bc_shm_ring_used(bc_shm_ring_t *r) {
+  return (size_t)(__atomic_load_n(&r->hdr->head, __ATOMIC_ACQUIRE) - r->hdr->tail);
+}
+
+/**
+ * Consumer: copy <n> bytes out of the ring and release their space
+ * (the caller must have checked there is at least <n> bytes available)
+ */
+void bc_shm_ring_read(bc_shm_ring_t *r, void *dst, size_t n) {
+  copy_out(r, r->hdr->tail, dst, n);
+  __atomic_store_n(&r->hdr->tail, r->hdr->tail + n, __ATOMIC_RELEASE);
+}
+
+#define BC_SHM_LIVENESS_CHECK_PERIOD 1024
+
+/**
+ * Consumer: has the producer closed its side
+ *
+ * Unlike with a FIFO, the OS does not tell us if the producer process dies
+ * without closing the ring. So every BC_SHM_LIVENESS_CHECK_PERIOD calls we
+ * also check if it is still alive (this costs a system call)
+ */
+bool bc_shm_ring_writer_closed(bc_shm_ring_t *r) {
+  if ( __atomic_load_n(&r->hdr->writer_closed, __ATOMIC_ACQUIRE) ) {
+    return true;
+  }
+  if ( ++r->idle_polls >= BC_SHM_LIVENESS_CHECK_PERIOD ) {
+    r->idle_polls = 0;
+    int32_t pid = __atomic_load_n(&r->hdr->writer_pid, __ATOMIC_RELAXED);
+    if ( ( pid != 0 ) && ( kill(pid, 0) != 0 ) && ( errno == ESRCH ) ) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Producer: has the consumer closed its side or died
+ * (meant to be called only when the ring is found full, as it costs a system call)
+ */
+bool bc_shm_ring_reader_gone(bc_shm_ring_t *r) {
+  return __atomic_load_n(&r->hdr->reader_closed, __ATOMIC_ACQUIRE)
+      || ( ( kill(r->hdr->reader_pid, 0) != 0 ) && ( errno == ESRCH ) );
+}
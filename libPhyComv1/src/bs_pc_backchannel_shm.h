@@ -0,0 +1,73 @@
+/*
+ * Copyright 2018 Oticon A/S
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef BS_PC_BACKCHANNEL_SHM_H
+#define BS_PC_BACKCHANNEL_SHM_H
+
+/**
+ * Internal definitions of the shared memory ring used by the back channels.
+ * Users should not include this header, but use bs_pc_backchannel.h
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+#define BC_SHM_MAGIC 0x43425342 /* "BSBC" */
+#define BC_SHM_DEFAULT_CAPACITY (64*1024)
+#define BC_SHM_CACHE_LINE 64
+
+/*
+ * Header placed at the start of each shared memory file.
+ * The producer only writes <head> & <writer_closed>, the consumer only
+ * <tail> & <reader_closed>. Each lives in its own cache line.
+ */
+typedef struct {
+  uint32_t magic; /* Set (last) by the consumer once the ring is initialized */
+  uint32_t capacity; /* Size of the data area, a power of 2 */
+  int32_t reader_pid; /* Process which created (and reads from) the ring */
+  uint8_t pad0[BC_SHM_CACHE_LINE - 3*sizeof(uint32_t)];
+
+  uint64_t head; /* Total number of bytes ever written */
+  uint32_t writer_closed;
+  int32_t writer_pid; /* Process which attached to write into the ring */
+  uint8_t pad1[BC_SHM_CACHE_LINE - sizeof(uint64_t) - 2*sizeof(uint32_t)];
+
+  uint64_t tail; /* Total number of bytes ever read */
+  uint32_t reader_closed;
+  uint8_t pad2[BC_SHM_CACHE_LINE - sizeof(uint64_t) - sizeof(uint32_t)];
+
+  uint8_t data[];
+} bc_shm_ring_hdr_t;
+
+typedef struct {
+  bc_shm_ring_hdr_t *hdr;
+  size_t map_size;
+  uint32_t mask;
+  uint32_t idle_polls; /* Consumer: polls without news since we last checked the producer is alive */
+} bc_shm_ring_t;
+
+int bc_shm_ring_create(bc_shm_ring_t *r, const char *path, uint32_t capacity);
+int bc_shm_ring_try_attach(bc_shm_ring_t *r, const char *path);
+int bc_shm_ring_attach(bc_shm_ring_t *r, const char *path);
+void bc_shm_ring_close(bc_shm_ring_t *r, bool reader);
+
+size_t bc_shm_ring_free_space(bc_shm_ring_t *r);
+int bc_shm_ring_writev(bc_shm_ring_t *r, const struct iovec *iov, int iovcnt, size_t total);
+size_t bc_shm_ring_used(bc_shm_ring_t *r);
+void bc_shm_ring_read(bc_shm_ring_t *r, void *dst, size_t n);
+bool bc_shm_ring_writer_closed(bc_shm_ring_t *r);
+bool bc_shm_ring_reader_gone(bc_shm_ring_t *r);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,433 @@
+/*
+ * Copyright 2018 Oticon A/S
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+/**
+ * Tracing throughput benchmark
+ *
+ * For each combination of message kind, output, tracing mode and number of
+ * threads, a process is spawned, whose stdout is connected to that output,
+ * and in which each thread issues <n> traces as fast as it can.
+ * The message kinds are:
+ *  * filtered:       bs_trace_info() over the trace level (not printed)
+ *  * raw:            bs_trace_raw()
+ *  * raw_line:       bs_trace_raw_line()
+ *  * info_time:      bs_trace_info_time() (AUTOTIME)
+ *  * info_time_line: bs_trace_info_time_line() (AUTOTIME)
+ * The outputs are:
+ *  * tty:  a pseudo terminal (as an interactive run)
+ *  * file: a regular file (as when redirecting stdout into a file)
+ *  * pipe: a pipe (as when piping into another program)
+ *  * null: /dev/null (only the formatting cost)
+ * For the tty and pipe outputs, another process reads and discards all output.
+ *
+ * One result line per combination is printed in stdout, as CSV or JSON.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "bs_types.h"
+#include "bs_tracing.h"
+#include "bs_oswrap.h"
+#include "bs_utils.h"
+#include "bs_cmd_line.h"
+
+#define BENCH_MAX_LIST 32
+#define BENCH_FILTERED_FACTOR 100 //Filtered messages are so cheap, we issue this many times more of them
+
+typedef enum {K_FILTERED = 0, K_RAW, K_RAW_LINE, K_INFO_TIME, K_INFO_TIME_LINE} kind_t;
+typedef enum {O_TTY = 0, O_FILE, O_PIPE, O_NULL} output_t;
+typedef enum {M_SYNC = 0, M_ASYNC} trace_mode_t;
+
+static const char *kind_names[] = {"filtered", "raw", "raw_line", "info_time", "info_time_line"};
+static const char *output_names[] = {"tty", "file", "pipe", "null"};
+static const char *mode_names[] = {"sync", "async"};
+
+typedef struct {
+  char *kinds;
+  char *outputs;
+  char *modes;
+  char *threads;
+  uint n;
+  bool json;
+  char *tag;
+  char *file;
+} bench_args_t;
+
+typedef struct {
+  kind_t kind;
+  output_t output;
+  trace_mode_t mode;
+  uint n_threads;
+  uint n; //Messages issued by each thread
+} bench_cfg_t;
+
+typedef struct {
+  double seconds;
+} bench_result_t;
+
+char executable_name[] = "bs_trace_bench";
+void component_print_post_help(){
+  fprintf(stdout,
+"\nTracing throughput benchmark.\n"
+"For each combination of message kind, output, tracing mode and number of\n"
+"threads, a process prints traces as fast as it can into that output.\n"
+"One line of results is printed for each combination (CSV by default)\n"
+"Lists are given comma separated, e.g. -kinds=raw,info_time\n\n");
+}
+
+static uint64_t now_ns(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static __thread bs_time_t fake_time; //Each thread has its own simulated time
+
+static bs_time_t bench_time(void){
+  return fake_time;
+}
+
+typedef struct {
+  const bench_cfg_t *cfg;
+  uint thread;
+} thread_arg_t;
+
+static void *issue_traces(void *ptr){
+  const thread_arg_t *arg = ptr;
+  const bench_cfg_t *cfg = arg->cfg;
+  uint t = arg->thread;
+
+  switch ( cfg->kind ) {
+    case K_FILTERED:
+      for ( uint i = 0; i < cfg->n; i++ ) {
+        bs_trace_info(9, "Thread %u message %u, value %i\n", t, i, (int)(i*7));
+      }
+      break;
+    case K_RAW:
+      for ( uint i = 0; i < cfg->n; i++ ) {
+        bs_trace_raw(1, "Thread %u message %u, value %i\n", t, i, (int)(i*7));
+      }
+      break;
+    case K_RAW_LINE:
+      for ( uint i = 0; i < cfg->n; i++ ) {
+        bs_trace_raw_line(1, "Thread %u message %u, value %i\n", t, i, (int)(i*7));
+      }
+      break;
+    case K_INFO_TIME:
+      for ( uint i = 0; i < cfg->n; i++ ) {
+        fake_time += 10;
+        bs_trace_info_time(1, "Thread %u message %u, value %i\n", t, i, (int)(i*7));
+      }
+      break;
+    case K_INFO_TIME_LINE:
+      for ( uint i = 0; i < cfg->n; i++ ) {
+        fake_time += 10;
+        bs_trace_info_time_line(1, "Thread %u message %u, value %i\n", t, i, (int)(i*7));
+      }
+      break;
+  }
+  return NULL;
+}
+
+/*
+ * Fork a process which reads and discards everything from <fd>
+ * (<write_fd> is the other end, which it closes so it sees the end of its input)
+ */
+static pid_t spawn_drain(int fd, int write_fd){
+  pid_t pid = fork();
+  if ( pid == 0 ) {
+    char buf[65536];
+    close(write_fd);
+    while ( read(fd, buf, sizeof(buf)) > 0 ) {
+      ;
+    }
+    _exit(0);
+  } else if ( pid == -1 ) {
+    bs_trace_error_line("Could not fork\n");
+  }
+  return pid;
+}
+
+/*
+ * Connect this process stdout to the output under test
+ * Returns the pid of the process draining it (or -1 if none)
+ */
+static pid_t connect_stdout(output_t output, const char *file){
+  int fd = -1, other_fd = -1;
+  pid_t drain_pid = -1;
+
+  switch ( output ) {
+    case O_TTY:
+      other_fd = posix_openpt(O_RDWR | O_NOCTTY);
+      if ( ( other_fd == -1 ) || ( grantpt(other_fd) != 0 ) || ( unlockpt(other_fd) != 0 )
+          || ( ( fd = open(ptsname(other_fd), O_WRONLY | O_NOCTTY) ) == -1 ) ) {
+        bs_trace_error_line("Could not open a pseudo terminal\n");
+      }
+      break;
+    case O_FILE:
+      fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+      if ( fd == -1 ) {
+        bs_trace_error_line("Could not open %s\n", file);
+      }
+      break;
+    case O_PIPE: {
+      int fds[2];
+      if ( pipe(fds) != 0 ) {
+        bs_trace_error_line("Could not create a pipe\n");
+      }
+      other_fd = fds[0];
+      fd = fds[1];
+      break;
+    }
+    case O_NULL:
+      fd = open("/dev/null", O_WRONLY);
+      if ( fd == -1 ) {
+        bs_trace_error_line("Could not open /dev/null\n");
+      }
+      break;
+  }
+
+  if ( other_fd != -1 ) {
+    drain_pid = spawn_drain(other_fd, fd);
+    close(other_fd);
+  }
+  dup2(fd, STDOUT_FILENO);
+  close(fd);
+
+  //Buffer stdout as a fresh process would, and let the tracing find out again if it is a tty
+  setvbuf(stdout, NULL, isatty(STDOUT_FILENO) ? _IOLBF : _IOFBF, BUFSIZ);
+  bs_trace_enable_color(NULL, 0);
+  return drain_pid;
+}
+
+/*
+ * Body of the process running one benchmark configuration
+ * The results are written into <result_fd>
+ */
+static void run_bench(const bench_cfg_t *cfg, const char *file, int result_fd){
+  pid_t drain_pid = connect_stdout(cfg->output, file);
+
+  bs_trace_set_prefix_dev(0);
+  bs_trace_register_time_function(bench_time);
+  bs_trace_set_level(( cfg->kind == K_FILTERED ) ? 2 : 3);
+  if ( cfg->mode == M_ASYNC ) {
+    bs_trace_set_async(true);
+  }
+
+  pthread_t threads[cfg->n_threads];
+  thread_arg_t args[cfg->n_threads];
+  bench_result_t result;
+
+  uint64_t start = now_ns();
+  for ( uint t = 0; t < cfg->n_threads; t++ ) {
+    args[t].cfg = cfg;
+    args[t].thread = t;
+    if ( pthread_create(&threads[t], NULL, issue_traces, &args[t]) != 0 ) {
+      bs_trace_error_line("Could not create thread %u\n", t);
+    }
+  }
+  for ( uint t = 0; t < cfg->n_threads; t++ ) {
+    pthread_join(threads[t], NULL);
+  }
+  bs_trace_flush();
+  fflush(stdout);
+  result.seconds = (now_ns() - start)/1e9;
+
+  if ( write(result_fd, &result, sizeof(result)) != sizeof(result) ) {
+    bs_trace_error_line("Could not pass the results to the main process\n");
+  }
+
+  bs_trace_set_async(false);
+  if ( drain_pid != -1 ) {
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO); //So the draining process sees the end of its input
+    close(null_fd);
+    waitpid(drain_pid, NULL, 0);
+  }
+  exit(0);
+}
+
+/*
+ * Run one benchmark configuration in a fresh process
+ * Returns 0 on success
+ */
+static int run_cfg(const bench_cfg_t *cfg, const char *file, bench_result_t *result){
+  int fds[2];
+  if ( pipe(fds) != 0 ) {
+    bs_trace_error_line("Could not create a pipe\n");
+  }
+  fflush(stdout);
+
+  pid_t pid = fork();
+  if ( pid == 0 ) {
+    close(fds[0]);
+    run_bench(cfg, file, fds[1]);
+  } else if ( pid == -1 ) {
+    bs_trace_error_line("Could not fork\n");
+  }
+  close(fds[1]);
+
+  int ok = ( read(fds[0], result, sizeof(*result)) == sizeof(*result) );
+  close(fds[0]);
+  int status;
+  waitpid(pid, &status, 0);
+  ok &= WIFEXITED(status) && ( WEXITSTATUS(status) == 0 );
+  if ( cfg->output == O_FILE ) {
+    remove(file);
+  }
+  return ok ? 0 : -1;
+}
+
+/*
+ * Parse the comma separated list <str> of numbers into <list>
+ * Returns the number of elements
+ */
+static uint parse_uint_list(const char *str, uint *list, const char *what){
+  uint n = 0;
+  char *copy = bs_calloc(strlen(str) + 1, 1);
+  strcpy(copy, str);
+  for ( char *tok = strtok(copy, ","); tok != NULL; tok = strtok(NULL, ",") ) {
+    char *end;
+    long v = strtol(tok, &end, 0);
+    if ( ( *end != 0 ) || ( v < 0 ) || ( n >= BENCH_MAX_LIST ) ) {
+      bs_trace_error_line("Invalid %s list \"%s\"\n", what, str);
+    }
+    list[n++] = v;
+  }
+  free(copy);
+  return n;
+}
+
+/*
+ * Parse the comma separated list <str> of names (out of <names>) into <list>
+ */
+static uint parse_name_list(const char *str, uint *list, const char **names, uint n_names,
+                            const char *what){
+  uint n = 0;
+  char *copy = bs_calloc(strlen(str) + 1, 1);
+  strcpy(copy, str);
+  for ( char *tok = strtok(copy, ","); tok != NULL; tok = strtok(NULL, ",") ) {
+    uint i;
+    for ( i = 0; i < n_names; i++ ) {
+      if ( strcmp(tok, names[i]) == 0 ) {
+        break;
+      }
+    }
+    if ( ( i == n_names ) || ( n >= BENCH_MAX_LIST ) ) {
+      bs_trace_error_line("Invalid %s list \"%s\"\n", what, str);
+    }
+    list[n++] = i;
+  }
+  free(copy);
+  return n;
+}
+
+static void print_header(bool json){
+  if ( !json ) {
+    printf("tag,kind,output,mode,threads,msgs,seconds,msgs_per_s,ns_per_msg\n");
+  }
+}
+
+static void print_result(bool json, const char *tag, const bench_cfg_t *cfg, const bench_result_t *r){
+  uint64_t msgs = (uint64_t)cfg->n*cfg->n_threads;
+  double msgs_per_s = msgs/r->seconds;
+  double ns_per_msg = r->seconds*1e9/msgs;
+  if ( json ) {
+    printf("{\"tag\":\"%s\",\"kind\":\"%s\",\"output\":\"%s\",\"mode\":\"%s\",\"threads\":%u,"
+           "\"msgs\":%llu,\"seconds\":%.6f,\"msgs_per_s\":%.1f,\"ns_per_msg\":%.2f}\n",
+           tag, kind_names[cfg->kind], output_names[cfg->output], mode_names[cfg->mode],
+           cfg->n_threads, (unsigned long long)msgs, r->seconds, msgs_per_s, ns_per_msg);
+  } else {
+    printf("%s,%s,%s,%s,%u,%llu,%.6f,%.1f,%.2f\n",
+           tag, kind_names[cfg->kind], output_names[cfg->output], mode_names[cfg->mode],
+           cfg->n_threads, (unsigned long long)msgs, r->seconds, msgs_per_s, ns_per_msg);
+  }
+  fflush(stdout);
+}
+
+int main(int argc, char *argv[]){
+  bench_args_t args;
+  static char default_kinds[] = "filtered,raw,raw_line,info_time,info_time_line";
+  static char default_outputs[] = "tty,file,pipe";
+  static char default_modes[] = "sync";
+  static char default_threads[] = "1";
+  static char default_tag[] = "";
+
+  bs_args_struct_t args_struct[] = {
+      { false, false, false, "kinds", "kinds", 's', (void*)&args.kinds, NULL, "Message kinds: filtered, raw, raw_line, info_time and/or info_time_line (all)"},
+      { false, false, false, "outputs", "outputs", 's', (void*)&args.outputs, NULL, "Outputs: tty, file, pipe and/or null (tty,file,pipe)"},
+      { false, false, false, "modes", "modes", 's', (void*)&args.modes, NULL, "Tracing modes: sync and/or async (sync)"},
+      { false, false, false, "threads", "threads", 's', (void*)&args.threads, NULL, "Number of threads issuing traces concurrently (1)"},
+      { false, false, false, "n", "nbr_msgs", 'u', (void*)&args.n, NULL, "Messages issued by each thread in each measurement (200000, 100 times more if filtered)"},
+      { false, false, true, "json", "json", 'b', (void*)&args.json, NULL, "Print results as JSON lines instead of CSV"},
+      { false, false, false, "tag", "tag", 's', (void*)&args.tag, NULL, "Label added to each result line, e.g. the version being measured"},
+      { false, false, false, "file", "file_name", 's', (void*)&args.file, NULL, "File used for the file output (bs_trace_bench.<pid>.txt in /tmp)"},
+      ARG_TABLE_ENDMARKER
+  };
+
+  bs_args_set_defaults(args_struct);
+  args.kinds = default_kinds;
+  args.outputs = default_outputs;
+  args.modes = default_modes;
+  args.threads = default_threads;
+  args.n = 200000;
+  args.tag = default_tag;
+  args.file = NULL;
+  bs_args_parse_cmd_line(argc, argv, args_struct);
+
+  char default_file[64];
+  if ( args.file == NULL ) {
+    sprintf(default_file, "/tmp/bs_trace_bench.%li.txt", (long)getpid());
+    args.file = default_file;
+  }
+
+  uint kinds[BENCH_MAX_LIST], outputs[BENCH_MAX_LIST];
+  uint modes[BENCH_MAX_LIST], threads[BENCH_MAX_LIST];
+  uint n_kinds = parse_name_list(args.kinds, kinds, kind_names, 5, "kinds");
+  uint n_outputs = parse_name_list(args.outputs, outputs, output_names, 4, "outputs");
+  uint n_modes = parse_name_list(args.modes, modes, mode_names, 2, "modes");
+  uint n_threads = parse_uint_list(args.threads, threads, "threads");
+
+  print_header(args.json);
+
+  int failures = 0;
+  for ( uint o = 0; o < n_outputs; o++ ) {
+    for ( uint m = 0; m < n_modes; m++ ) {
+      for ( uint t = 0; t < n_threads; t++ ) {
+        for ( uint k = 0; k < n_kinds; k++ ) {
+          bench_cfg_t cfg;
+          bench_result_t result;
+          cfg.kind = kinds[k];
+          cfg.output = outputs[o];
+          cfg.mode = modes[m];
+          cfg.n_threads = BS_MAX(threads[t], 1);
+          cfg.n = BS_MAX(args.n, 1);
+          if ( cfg.kind == K_FILTERED ) {
+            cfg.n *= BENCH_FILTERED_FACTOR;
+          }
+
+          if ( run_cfg(&cfg, args.file, &result) != 0 ) {
+            bs_trace_warning_line("Run %s, %s, %s, %u threads failed\n",
+                                  kind_names[cfg.kind], output_names[cfg.output],
+                                  mode_names[cfg.mode], cfg.n_threads);
+            failures++;
+            continue;
+          }
+          print_result(args.json, args.tag, &cfg, &result);
+        }
+      }
+    }
+  }
+
+  return failures ? 1 : 0;
+}
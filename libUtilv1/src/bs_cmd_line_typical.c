@@ -4,8 +4,13 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 #include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "bs_cmd_line_typical.h"
 #include "bs_tracing.h"
+#include "bs_results.h"
+#include "bs_trace_cost.h"
 
 /**
  * For most devices,
@@ -30,6 +35,33 @@ void bs_args_typical_dev_post_check(bs_basic_dev_args_t *a, bs_args_struct_t arg
   if (!a->p_id) {
     a->p_id = default_phy;
   }
+  if (bs_trace_output_file_requested()) {
+    char *results_path = bs_create_result_folder(a->s_id);
+    char filename[strlen(results_path) + 32];
+    sprintf(filename, "%s/d_%u.trace.log", results_path, a->global_device_nbr);
+    free(results_path);
+    bs_trace_set_output_file(filename);
+  }
+  if (bs_trace_flight_recorder_is_on()) {
+    char *results_path = bs_create_result_folder(a->s_id);
+    char filename[strlen(results_path) + 32];
+    sprintf(filename, "%s/d_%u.flight.log", results_path, a->global_device_nbr);
+    free(results_path);
+    bs_trace_set_flight_recorder_file(filename);
+  }
+  if (bs_trace_cost_is_on()) {
+    char *results_path = bs_create_result_folder(a->s_id);
+    char filename[strlen(results_path) + 32];
+    sprintf(filename, "%s/d_%u.trace_cost.txt", results_path, a->global_device_nbr);
+    free(results_path);
+    bs_trace_cost_set_report_file(filename);
+  }
+  if (bs_trace_collect_requested()) {
+    bs_trace_collect_start(a->s_id, a->global_device_nbr);
+  }
+  if (bs_trace_ctrl_requested()) {
+    bs_trace_ctrl_start(a->s_id, a->global_device_nbr);
+  }
 }
 
 /**
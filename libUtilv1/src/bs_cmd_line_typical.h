@@ -13,6 +13,8 @@
 #include <stdbool.h>
 #include "bs_oswrap.h"
 #include "bs_cmd_line.h"
+#include "bs_trace_collect.h"
+#include "bs_trace_ctrl.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -52,7 +54,12 @@ typedef struct{
     { false, false , false, "gd",      "global_device_number", 'u', (void*)&args->global_device_nbr, cmd_gdev_nbr_found, "(<device_number>) global device number (for tracing and so forth)"}
 #define ARG_TABLE_VERB \
     { false, false , false, "v",       "trace_level",          'u', (void*)&args->verb, cmd_trace_lvl_found, "Set the verbosity/tracing/logging level to <trace_level> [0: almost nothing,..(2)..,9: everything]",}, \
-    { false, false , false, "verbose", "trace_level",          'u', (void*)&args->verb, cmd_trace_lvl_found, "Alias for -v"}
+    { false, false , false, "verbose", "trace_level",          'u', (void*)&args->verb, cmd_trace_lvl_found, "Alias for -v"}, \
+    { false, false , false, "vmod",    "name:level[,..]",      's', NULL,               bs_trace_vmod_found, "Set the verbosity level of individual trace categories (which otherwise follow -v)"}
+#define ARG_TABLE_TRACE_WINDOW \
+    { false, false , false, "trace-from", "time",              's', NULL,               bs_trace_from_found, "Raise the verbosity level to <trace-window-v> only from this simulated time (in us)"}, \
+    { false, false , false, "trace-to",   "time",              's', NULL,               bs_trace_to_found,   "Raise the verbosity level to <trace-window-v> only until this simulated time (in us)"}, \
+    { false, false , false, "trace-window-v", "trace_level",   's', NULL,               bs_trace_window_level_found, "Verbosity level within the -trace-from/-trace-to window (9)"}
 #define ARG_TABLE_STARTO \
     { false, false , false, "start_offset","start_of",         'f', (void*)&args->start_offset,NULL,       "Offset in time (at the start of the simulation) of this device. At time 0 for the device, the phy will be at <start_of>"}
 #define ARG_TABLE_STARTO_FAKE \
@@ -69,6 +76,25 @@ typedef struct{
     { false, false , true, "no-color", "no-color",             'b', NULL,                    bs_trace_disable_color, "Disable color in traces even if printing to console"}
 #define ARG_TABLE_FORCECOLOR \
     { false, false , true, "force-color", "force-color",       'b', NULL,                    bs_trace_force_color,   "Enable color in traces even if printing to files/pipes"}
+#define ARG_TABLE_TRACE_ASYNC \
+    { false, false , true, "trace-async", "trace-async",       'b', NULL,                    bs_trace_enable_async,  "Print traces from a background thread, so slow outputs do not slow down the simulation"}
+#define ARG_TABLE_TRACE_FILE \
+    { false, false , true, "trace-file", "trace-file",         'b', NULL,                    bs_trace_file_found,    "Write the traces to results/<s_id>/d_<global_device_nbr>.trace.log instead of stdout/stderr (errors are still also printed to stderr)"}, \
+    { false, false , false, "trace-file-buf", "size_kB",       's', NULL,                    bs_trace_file_buf_found, "Size of the buffer for -trace-file (1024)"}, \
+    { false, false , true, "trace-file-warn", "trace-file-warn", 'b', NULL,                  bs_trace_file_mirror_found, "With -trace-file, also print warnings to stderr"}
+#define ARG_TABLE_TRACE_COLLECT \
+    { false, false , true, "trace-collect", "trace-collect",   'b', NULL,                    bs_trace_collect_found, "Hand the traces to bs_trace_collector (which merges all devices traces in time order) instead of printing them"}
+#define ARG_TABLE_TRACE_CTRL \
+    { false, false , true, "trace-ctrl", "trace-ctrl",         'b', NULL,                    bs_trace_ctrl_found,    "Allow changing the trace levels while running, with bs_trace_ctrl"}
+#define ARG_TABLE_TRACE_RECORDER \
+    { false, false , false, "trace-recorder", "trace_level",   's', NULL,                    bs_trace_recorder_found, "Keep the most recent traces up to this level in memory (unformatted), and dump them to results/<s_id>/d_<global_device_nbr>.flight.log on errors/crashes"}, \
+    { false, false , false, "trace-recorder-size", "size_kB",  's', NULL,                    bs_trace_recorder_size_found, "Size of the -trace-recorder buffer (1024)"}
+#define ARG_TABLE_TRACE_COST \
+    { false, false , true, "trace-cost", "trace-cost",         'b', NULL,                    bs_trace_cost_found,    "Account the cost of each trace call site, and write a report at exit into results/<s_id>/d_<global_device_nbr>.trace_cost.txt"}
+#define ARG_TABLE_TRACE_JSON \
+    { false, false , true, "trace-json", "trace-json",         'b', NULL,                    bs_trace_enable_json,   "Print traces as JSON lines (one object per trace) for post-processing"}
+#define ARG_TABLE_TRACE_BINARY \
+    { false, false , false, "trace-bin", "file",              's', NULL,                    bs_trace_binary_file_found, "Record the traces in binary form in this file instead of printing them (decode it with bs_trace_decoder)"}
 
 #define BS_BASIC_DEVICE_2G4_TYPICAL_OPTIONS_ARG_STRUCT \
     ARG_TABLE_S_ID,     \
@@ -76,11 +102,20 @@ typedef struct{
     ARG_TABLE_DEV_NBR,  \
     ARG_TABLE_GDEV_NBR, \
     ARG_TABLE_VERB,     \
+    ARG_TABLE_TRACE_WINDOW, \
     ARG_TABLE_STARTO,   \
     ARG_TABLE_SEED,     \
     ARG_TABLE_COLOR,    \
     ARG_TABLE_NOCOLOR,  \
-    ARG_TABLE_FORCECOLOR
+    ARG_TABLE_FORCECOLOR, \
+    ARG_TABLE_TRACE_ASYNC, \
+    ARG_TABLE_TRACE_FILE, \
+    ARG_TABLE_TRACE_COLLECT, \
+    ARG_TABLE_TRACE_CTRL, \
+    ARG_TABLE_TRACE_RECORDER, \
+    ARG_TABLE_TRACE_COST, \
+    ARG_TABLE_TRACE_JSON, \
+    ARG_TABLE_TRACE_BINARY
 
 #define BS_BASIC_DEVICE_2G4_FAKE_OPTIONS_ARG_STRUCT \
     ARG_TABLE_S_ID,        \
@@ -88,11 +123,20 @@ typedef struct{
     ARG_TABLE_DEV_NBR,     \
     ARG_TABLE_GDEV_NBR,    \
     ARG_TABLE_VERB,        \
+    ARG_TABLE_TRACE_WINDOW, \
     ARG_TABLE_STARTO_FAKE, \
     ARG_TABLE_SEED_FAKE,   \
     ARG_TABLE_COLOR,       \
     ARG_TABLE_NOCOLOR,     \
-    ARG_TABLE_FORCECOLOR
+    ARG_TABLE_FORCECOLOR,  \
+    ARG_TABLE_TRACE_ASYNC, \
+    ARG_TABLE_TRACE_FILE, \
+    ARG_TABLE_TRACE_COLLECT, \
+    ARG_TABLE_TRACE_CTRL, \
+    ARG_TABLE_TRACE_RECORDER, \
+    ARG_TABLE_TRACE_COST, \
+    ARG_TABLE_TRACE_JSON, \
+    ARG_TABLE_TRACE_BINARY
 
 void bs_args_typical_dev_post_check(bs_basic_dev_args_t *args, bs_args_struct_t args_struct[], char *default_phy);
 void bs_args_typical_dev_set_defaults(bs_basic_dev_args_t *args, bs_args_struct_t args_struct[]);
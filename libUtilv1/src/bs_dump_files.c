@@ -10,18 +10,48 @@
 #include "bs_results.h"
 #include "bs_tracing.h"
 #include "bs_dump_files.h"
+#include "bs_dump_files_bin.h"
 
 #define BS_ALLOC_CHUNK 10
 static bs_dumpf_ctrl_t *df_ctrl; /* Array of dump file control elements */
 static int bsdc_alloc_size; /* Number of allocated control elements */
 static int number_of_dump_files; /* Number of used control elements/dump files */
+static bs_df_bin_t **df_bin; /* For each dump file, its binary writer (NULL if written as CSV) */
+static bool df_binary; /* Write the files with a column schema in binary */
+
+/*
+ * Check the column schema of a dump file being registered
+ */
+static void check_columns(const bs_dumpf_ctrl_t *f_ctrl) {
+  if ((f_ctrl->n_columns == 0) || (f_ctrl->n_columns > BS_DF_BIN_MAX_COLUMNS)) {
+    bs_trace_error_line("Dump file %s: its schema must have between 1 and %i columns\n",
+                        f_ctrl->postfix, BS_DF_BIN_MAX_COLUMNS);
+  }
+  for (unsigned int i = 0; i < f_ctrl->n_columns; i++) {
+    const bs_df_column_t *col = &f_ctrl->columns[i];
+    if ((col->name == NULL) || (strlen(col->name) >= BS_DF_NAME_LEN)) {
+      bs_trace_error_line("Dump file %s: column %u name must be set and shorter than %i chars\n",
+                          f_ctrl->postfix, i, BS_DF_NAME_LEN);
+    }
+    if ((col->type > BS_DF_F64)
+        || ((col->format != NULL) && !bs_df_format_is_valid(col->format, col->type))) {
+      bs_trace_error_line("Dump file %s: column %s has an invalid type or format\n",
+                          f_ctrl->postfix, col->name);
+    }
+  }
+}
 
 int bs_dump_file_register(bs_dumpf_ctrl_t *f_ctrl) {
+  if (f_ctrl->columns != NULL) {
+    check_columns(f_ctrl);
+  }
   if (number_of_dump_files + 1 >= bsdc_alloc_size) {
     bsdc_alloc_size += BS_ALLOC_CHUNK;
     df_ctrl = bs_realloc(df_ctrl, bsdc_alloc_size * sizeof(bs_dumpf_ctrl_t) );
+    df_bin = bs_realloc(df_bin, bsdc_alloc_size * sizeof(bs_df_bin_t *) );
   }
   memcpy(&df_ctrl[number_of_dump_files], f_ctrl, sizeof(bs_dumpf_ctrl_t));
+  df_bin[number_of_dump_files] = NULL;
   number_of_dump_files++;
 
   return number_of_dump_files - 1;
@@ -95,14 +125,28 @@ void bs_dump_files_open(const char* s, const unsigned int dev_number) {
     }
 
     char filename[strlen(df_ctrl[i].postfix) + strlen(results_path) + 25];
+    bool binary = df_binary && (df_ctrl[i].columns != NULL);
+
+    sprintf(filename, "%s/d_%02i.%s.%s", results_path,
+        dev_number, df_ctrl[i].postfix, binary ? "bin" : "csv");
 
-    sprintf(filename, "%s/d_%02i.%s.csv", results_path,
-        dev_number, df_ctrl[i].postfix);
+    if (binary) {
+      df_ctrl[i].fileptr = bs_fopen(filename, "wb");
+      df_bin[i] = bs_df_bin_open(df_ctrl[i].fileptr,
+                                 df_ctrl[i].columns, df_ctrl[i].n_columns);
+      continue;
+    }
 
     df_ctrl[i].fileptr = bs_fopen(filename, "wt");
 
     if (df_ctrl[i].header_f != NULL) {
       df_ctrl[i].header_f(df_ctrl[i].fileptr);
+    } else if (df_ctrl[i].columns != NULL) {
+      for (unsigned int c = 0; c < df_ctrl[i].n_columns; c++) {
+        fprintf(df_ctrl[i].fileptr, "%s%s", c ? "," : "",
+                df_ctrl[i].columns[c].name);
+      }
+      fputc('\n', df_ctrl[i].fileptr);
     }
   }
 
@@ -117,6 +161,8 @@ void bs_dump_files_close_all(void) {
   }
 
   for (unsigned int i = 0 ; i < number_of_dump_files; i ++) {
+    bs_df_bin_close(df_bin[i]);
+    df_bin[i] = NULL;
     if (df_ctrl[i].fileptr != NULL) {
       fclose(df_ctrl[i].fileptr);
       df_ctrl[i].fileptr = NULL;
@@ -125,6 +171,36 @@ void bs_dump_files_close_all(void) {
 
   free(df_ctrl);
   df_ctrl = NULL;
+  free(df_bin);
+  df_bin = NULL;
+}
+
+void bs_dump_files_set_binary(bool binary) {
+  df_binary = binary;
+}
+
+void bs_dump_file_row(unsigned int file_idx, const bs_df_value_t *values) {
+  FILE *fileptr = bs_dump_file_get_fileptr(file_idx);
+  bs_dumpf_ctrl_t *f = &df_ctrl[file_idx];
+
+  if (fileptr == NULL) {
+    return;
+  }
+  if (f->columns == NULL) {
+    bs_trace_error_line("Dump file %s has no column schema, rows can not be written into it\n",
+                        f->postfix);
+  }
+  if (df_bin[file_idx] != NULL) {
+    bs_df_bin_row(df_bin[file_idx], values);
+    return;
+  }
+  for (unsigned int c = 0; c < f->n_columns; c++) {
+    if (c) {
+      fputc(',', fileptr);
+    }
+    bs_df_print_value(fileptr, f->columns[c].format, f->columns[c].type, values[c]);
+  }
+  fputc('\n', fileptr);
 }
 
 
@@ -140,3 +216,7 @@ unsigned int bsdf_dump_level;
 void bsdf_cmd_dumplevel_found(char * argv, int offset) {
 	bs_dump_files_set_dump_level(bsdf_dump_level);
 }
+
+void bsdf_cmd_dump_binary_found(char * argv, int offset) {
+	bs_dump_files_set_binary(true);
+}
@@ -17,6 +17,27 @@ extern "C" {
 /* Function that will print the heading of the dump file */
 typedef void (*bs_df_header_f_t)(FILE *);
 
+/* Types of the columns of a dump file with a column schema */
+typedef enum {
+  BS_DF_U8 = 0, BS_DF_U16, BS_DF_U32, BS_DF_U64,
+  BS_DF_I8, BS_DF_I16, BS_DF_I32, BS_DF_I64,
+  BS_DF_F32, BS_DF_F64
+} bs_df_type_t;
+
+/* Description of 1 column of a dump file */
+typedef struct {
+  const char *name; /* Column name (heading in the CSV) */
+  bs_df_type_t type; /* Type the values are stored as */
+  const char *format; /* printf format of the values in the CSV (NULL for the default), see bs_df_format_is_valid() */
+} bs_df_column_t;
+
+/* Value of 1 column in a row: u for unsigned, i for signed, and f for floating point columns */
+typedef union {
+  uint64_t u;
+  int64_t i;
+  double f;
+} bs_df_value_t;
+
 /* Control structure defining for 1 dump file */
 typedef struct {
   char *postfix; /* Postfix for the dump file filename */
@@ -24,6 +45,8 @@ typedef struct {
 	bool enabled; /* Is the dump file enabled or not (can be set to 1 to enable it by default) */
 	FILE* fileptr; /* Pointer to the dump file itself */
 	bs_df_header_f_t header_f; /* Function to print the dump file heading */
+	const bs_df_column_t *columns; /* Optional column schema, to write rows with bs_dump_file_row() (NULL if none) */
+	unsigned int n_columns; /* Number of columns in the schema */
 } bs_dumpf_ctrl_t;
 
 /**
@@ -45,6 +68,13 @@ void bs_dump_files_close_all(void);
 void bs_dump_files_print_files(void);
 /* Get the file pointer of a dump file by its index */
 FILE* bs_dump_file_get_fileptr(unsigned int file_idx);
+/* Write dump files which have a column schema in binary instead of CSV */
+void bs_dump_files_set_binary(bool binary);
+/**
+ * Write a row (one value per column of its schema) into a dump file
+ * (as CSV, or in binary if enabled). Nothing is done if the file is not active
+ */
+void bs_dump_file_row(unsigned int file_idx, const bs_df_value_t *values);
 
 #define DUMP_FILE_PTR(FILE_IDX) (bs_dump_file_get_fileptr(FILE_IDX))
 #define IS_DUMP_FILE_ACTIVE(FILE_IDX) (bs_dump_file_get_fileptr(FILE_IDX) != NULL)
@@ -53,6 +83,7 @@ extern unsigned int bsdf_dump_level;
 void bsdf_cmd_dump_found(char * argv, int offset);
 void bsdf_cmd_printdumps_found(char * argv, int offset);
 void bsdf_cmd_dumplevel_found(char * argv, int offset);
+void bsdf_cmd_dump_binary_found(char * argv, int offset);
 
 /* Command line arguments for controlling the dump files */
 #define BS_DUMP_FILES_ARGS \
@@ -73,7 +104,13 @@ void bsdf_cmd_dumplevel_found(char * argv, int offset);
   "dump_level", "level", 'u',                                      \
   (void*)&bsdf_dump_level, bsdf_cmd_dumplevel_found,               \
   "Set file dump level to <level> (default 0; all files with dump" \
-  " level under level will be dumped)"}
+  " level under level will be dumped)"},                           \
+  {false, false, true,                                             \
+  "dump_binary", "", 'b',                                          \
+  NULL, bsdf_cmd_dump_binary_found,                                \
+  "Write the dump files which have a column schema in a binary "   \
+  "columnar format (.bin, convert them to CSV with "               \
+  "bs_dump_converter) instead of CSV"}
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,331 @@
+/*
+ * Copyright 2018 Oticon A/S
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * Binary columnar dump files: writing and conversion to CSV.
+ * See bs_dump_files_bin.h
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "bs_dump_files_bin.h"
+#include "bs_tracing.h"
+#include "bs_oswrap.h"
+
+#define BS_DF_BIN_MAX_BLOCK_ROWS (1024*1024) //Biggest block the converter accepts
+
+struct bs_df_bin_s {
+  FILE *file;
+  unsigned int n_columns;
+  bs_df_type_t *types;
+  uint8_t **cols; //Values of the current block, per column
+  uint32_t n_rows; //Rows in the current block
+};
+
+static const uint8_t zeros[8];
+
+unsigned int bs_df_type_size(bs_df_type_t type){
+  switch ( type ) {
+    case BS_DF_U8: case BS_DF_I8: return 1;
+    case BS_DF_U16: case BS_DF_I16: return 2;
+    case BS_DF_U32: case BS_DF_I32: case BS_DF_F32: return 4;
+    default: return 8;
+  }
+}
+
+static inline bool type_is_float(bs_df_type_t type){
+  return ( type == BS_DF_F32 ) || ( type == BS_DF_F64 );
+}
+
+static inline bool type_is_signed(bs_df_type_t type){
+  return ( type >= BS_DF_I8 ) && ( type <= BS_DF_I64 );
+}
+
+/**
+ * Format used for the values of a column of type <type> if none was given
+ * (floats are printed with enough digits to be read back exactly)
+ */
+const char *bs_df_default_format(bs_df_type_t type){
+  if ( type == BS_DF_F32 ) {
+    return "%.9g";
+  } else if ( type == BS_DF_F64 ) {
+    return "%.17g";
+  } else if ( type_is_signed(type) ) {
+    return "%lli";
+  } else {
+    return "%llu";
+  }
+}
+
+/**
+ * Is <format> a valid CSV format for values of type <type>?
+ * It must contain exactly one conversion: for integer types one of d,i,u,x,X,o
+ * with the ll length modifier (values are printed as (unsigned) long long),
+ * and for floating point types one of f,F,e,E,g,G,a,A (printed as double)
+ */
+bool bs_df_format_is_valid(const char *format, bs_df_type_t type){
+  int n_conv = 0;
+
+  if ( ( type < BS_DF_U8 ) || ( type > BS_DF_F64 ) || ( strlen(format) >= BS_DF_FORMAT_LEN ) ) {
+    return false;
+  }
+  for ( const char *p = format; *p != 0; p++ ) {
+    if ( *p != '%' ) {
+      continue;
+    }
+    p++;
+    if ( *p == '%' ) {
+      continue;
+    }
+    p += strspn(p, "-+ #0");
+    p += strspn(p, "0123456789");
+    if ( *p == '.' ) {
+      p++;
+      p += strspn(p, "0123456789");
+    }
+    const char *conversions = "fFeEgGaA";
+    if ( !type_is_float(type) ) {
+      if ( strncmp(p, "ll", 2) != 0 ) {
+        return false;
+      }
+      p += 2;
+      conversions = "diuxXo";
+    }
+    if ( ( *p == 0 ) || ( strchr(conversions, *p) == NULL ) ) {
+      return false;
+    }
+    n_conv++;
+  }
+  return ( n_conv == 1 );
+}
+
+static void store_value(uint8_t *dst, bs_df_type_t type, bs_df_value_t v){
+  switch ( type ) {
+    case BS_DF_U8:  { uint8_t x = v.u;  memcpy(dst, &x, 1); break; }
+    case BS_DF_U16: { uint16_t x = v.u; memcpy(dst, &x, 2); break; }
+    case BS_DF_U32: { uint32_t x = v.u; memcpy(dst, &x, 4); break; }
+    case BS_DF_U64: { uint64_t x = v.u; memcpy(dst, &x, 8); break; }
+    case BS_DF_I8:  { int8_t x = v.i;   memcpy(dst, &x, 1); break; }
+    case BS_DF_I16: { int16_t x = v.i;  memcpy(dst, &x, 2); break; }
+    case BS_DF_I32: { int32_t x = v.i;  memcpy(dst, &x, 4); break; }
+    case BS_DF_I64: { int64_t x = v.i;  memcpy(dst, &x, 8); break; }
+    case BS_DF_F32: { float x = v.f;    memcpy(dst, &x, 4); break; }
+    case BS_DF_F64: { double x = v.f;   memcpy(dst, &x, 8); break; }
+  }
+}
+
+static bs_df_value_t load_value(const uint8_t *src, bs_df_type_t type){
+  bs_df_value_t v;
+  switch ( type ) {
+    case BS_DF_U8:  { uint8_t x;  memcpy(&x, src, 1); v.u = x; break; }
+    case BS_DF_U16: { uint16_t x; memcpy(&x, src, 2); v.u = x; break; }
+    case BS_DF_U32: { uint32_t x; memcpy(&x, src, 4); v.u = x; break; }
+    case BS_DF_I8:  { int8_t x;   memcpy(&x, src, 1); v.i = x; break; }
+    case BS_DF_I16: { int16_t x;  memcpy(&x, src, 2); v.i = x; break; }
+    case BS_DF_I32: { int32_t x;  memcpy(&x, src, 4); v.i = x; break; }
+    case BS_DF_I64: { int64_t x;  memcpy(&x, src, 8); v.i = x; break; }
+    case BS_DF_F32: { float x;    memcpy(&x, src, 4); v.f = x; break; }
+    case BS_DF_F64: { double x;   memcpy(&x, src, 8); v.f = x; break; }
+    default:        { uint64_t x; memcpy(&x, src, 8); v.u = x; break; }
+  }
+  return v;
+}
+
+static void print_loaded(FILE *out, const char *format, bs_df_type_t type, bs_df_value_t v){
+  if ( type_is_float(type) ) {
+    fprintf(out, format, v.f);
+  } else if ( type_is_signed(type) ) {
+    fprintf(out, format, (long long)v.i);
+  } else {
+    fprintf(out, format, (unsigned long long)v.u);
+  }
+}
+
+/**
+ * Print <value> into <out> as it would be stored in a column of type <type>
+ * (i.e. truncated to its size) with <format> (NULL for the default)
+ * So the CSV dumps are identical to the binary ones once converted
+ */
+void bs_df_print_value(FILE *out, const char *format, bs_df_type_t type, bs_df_value_t value){
+  uint8_t buf[8] = {0};
+  store_value(buf, type, value);
+  print_loaded(out, format ? format : bs_df_default_format(type), type, load_value(buf, type));
+}
+
+/**
+ * Start writing a binary dump file into <file> (already open) with the
+ * given column schema (already validated)
+ */
+bs_df_bin_t *bs_df_bin_open(FILE *file, const bs_df_column_t *columns, unsigned int n_columns){
+  bs_df_bin_t *bin = bs_calloc(1, sizeof(bs_df_bin_t));
+  uint32_t header[4] = {BS_DF_BIN_VERSION, n_columns, BS_DF_BIN_BLOCK_ROWS, 0};
+
+  bin->file = file;
+  bin->n_columns = n_columns;
+  bin->types = bs_calloc(n_columns, sizeof(bs_df_type_t));
+  bin->cols = bs_calloc(n_columns, sizeof(uint8_t *));
+
+  fwrite(BS_DF_BIN_MAGIC, 1, BS_DF_BIN_MAGIC_LEN, file);
+  fwrite(header, sizeof(header), 1, file);
+  for ( unsigned int c = 0; c < n_columns; c++ ) {
+    bs_df_bin_column_t col;
+    const char *format = columns[c].format ? columns[c].format : bs_df_default_format(columns[c].type);
+
+    memset(&col, 0, sizeof(col));
+    col.type = columns[c].type;
+    col.size = bs_df_type_size(columns[c].type);
+    strncpy(col.name, columns[c].name, BS_DF_NAME_LEN - 1);
+    strncpy(col.format, format, BS_DF_FORMAT_LEN - 1);
+    fwrite(&col, sizeof(col), 1, file);
+
+    bin->types[c] = columns[c].type;
+    bin->cols[c] = bs_malloc(BS_DF_BIN_BLOCK_ROWS*col.size);
+  }
+  return bin;
+}
+
+static void block_write(bs_df_bin_t *bin){
+  uint32_t header[2] = {BS_DF_BIN_BLOCK_MAGIC, bin->n_rows};
+
+  if ( bin->n_rows == 0 ) {
+    return;
+  }
+  fwrite(header, sizeof(header), 1, bin->file);
+  for ( unsigned int c = 0; c < bin->n_columns; c++ ) {
+    size_t len = (size_t)bin->n_rows*bs_df_type_size(bin->types[c]);
+    fwrite(bin->cols[c], 1, len, bin->file);
+    if ( len % 8 ) {
+      fwrite(zeros, 1, 8 - len % 8, bin->file);
+    }
+  }
+  bin->n_rows = 0;
+}
+
+/**
+ * Append a row (one value per column) to a binary dump file
+ */
+void bs_df_bin_row(bs_df_bin_t *bin, const bs_df_value_t *values){
+  for ( unsigned int c = 0; c < bin->n_columns; c++ ) {
+    store_value(&bin->cols[c][bin->n_rows*bs_df_type_size(bin->types[c])], bin->types[c], values[c]);
+  }
+  if ( ++bin->n_rows == BS_DF_BIN_BLOCK_ROWS ) {
+    block_write(bin);
+  }
+}
+
+/**
+ * Write the pending rows and free <bin> (the file itself is not closed)
+ */
+void bs_df_bin_close(bs_df_bin_t *bin){
+  if ( bin == NULL ) {
+    return;
+  }
+  block_write(bin);
+  for ( unsigned int c = 0; c < bin->n_columns; c++ ) {
+    free(bin->cols[c]);
+  }
+  free(bin->cols);
+  free(bin->types);
+  free(bin);
+}
+
+static int read_n(FILE *in, void *buf, size_t n){
+  return ( fread(buf, 1, n, in) == n ) ? 0 : -1;
+}
+
+/**
+ * Convert the binary dump file <in> into the equivalent CSV (a line with the
+ * column names followed by one line per row) into <out>
+ *
+ * Returns 0 on success, -1 if the input is not a binary dump file or is
+ * corrupted (a file which ends in the middle of a block, e.g. because the
+ * program crashed, is converted up to that point)
+ */
+int bs_df_bin_to_csv(FILE *in, FILE *out){
+  char magic[BS_DF_BIN_MAGIC_LEN];
+  uint32_t header[4];
+
+  if ( ( read_n(in, magic, sizeof(magic)) != 0 )
+      || ( memcmp(magic, BS_DF_BIN_MAGIC, sizeof(magic)) != 0 )
+      || ( read_n(in, header, sizeof(header)) != 0 )
+      || ( header[0] != BS_DF_BIN_VERSION ) ) {
+    bs_trace_warning_line("Input is not a binary dump file (version %u)\n", BS_DF_BIN_VERSION);
+    return -1;
+  }
+  uint32_t n_columns = header[1];
+  uint32_t block_rows = header[2];
+  if ( ( n_columns == 0 ) || ( n_columns > BS_DF_BIN_MAX_COLUMNS )
+      || ( block_rows == 0 ) || ( block_rows > BS_DF_BIN_MAX_BLOCK_ROWS ) ) {
+    bs_trace_warning_line("Corrupted binary dump file header\n");
+    return -1;
+  }
+
+  bs_df_bin_column_t *cols = bs_calloc(n_columns, sizeof(bs_df_bin_column_t));
+  uint8_t **data = bs_calloc(n_columns, sizeof(uint8_t *));
+  int ret = 0;
+
+  for ( uint32_t c = 0; c < n_columns; c++ ) {
+    if ( read_n(in, &cols[c], sizeof(bs_df_bin_column_t)) != 0 ) {
+      bs_trace_warning_line("Corrupted binary dump file header\n");
+      ret = -1;
+      break;
+    }
+    cols[c].name[BS_DF_NAME_LEN - 1] = 0;
+    cols[c].format[BS_DF_FORMAT_LEN - 1] = 0;
+    if ( !bs_df_format_is_valid(cols[c].format, cols[c].type)
+        || ( cols[c].size != bs_df_type_size(cols[c].type) ) ) {
+      bs_trace_warning_line("Corrupted binary dump file header (column %u)\n", c);
+      ret = -1;
+      break;
+    }
+    data[c] = bs_malloc(((size_t)block_rows*cols[c].size + 7) & ~(size_t)7);
+    fprintf(out, "%s%s", c ? "," : "", cols[c].name);
+  }
+
+  if ( ret == 0 ) {
+    fputc('\n', out);
+  }
+
+  while ( ret == 0 ) {
+    uint32_t block[2];
+    if ( read_n(in, block, sizeof(block)) != 0 ) {
+      break; //End of the file
+    }
+    if ( ( block[0] != BS_DF_BIN_BLOCK_MAGIC ) || ( block[1] > block_rows ) ) {
+      bs_trace_warning_line("Corrupted binary dump file\n");
+      ret = -1;
+      break;
+    }
+    uint32_t n_rows = block[1];
+    uint32_t c;
+    for ( c = 0; c < n_columns; c++ ) {
+      if ( read_n(in, data[c], ((size_t)n_rows*cols[c].size + 7) & ~(size_t)7) != 0 ) {
+        break;
+      }
+    }
+    if ( c < n_columns ) {
+      break; //Truncated block
+    }
+    for ( uint32_t r = 0; r < n_rows; r++ ) {
+      for ( c = 0; c < n_columns; c++ ) {
+        if ( c ) {
+          fputc(',', out);
+        }
+        print_loaded(out, cols[c].format, cols[c].type, load_value(&data[c][r*cols[c].size], cols[c].type));
+      }
+      fputc('\n', out);
+    }
+  }
+
+  for ( uint32_t c = 0; c < n_columns; c++ ) {
+    free(data[c]);
+  }
+  free(data);
+  free(cols);
+  return ret;
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright 2018 Oticon A/S
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * Binary columnar dump files
+ *
+ * Dump files registered with a column schema (see bs_dump_files.h) can be
+ * written in binary instead of CSV (command line option `-dump_binary`).
+ * Rows are kept in memory in blocks of up to BS_DF_BIN_BLOCK_ROWS rows, and
+ * each block is written column by column, each value in its native type.
+ * bs_df_bin_to_csv() (or the bs_dump_converter tool) regenerates the CSV
+ * the dump file would have had.
+ *
+ * File format (in the byte order of the recording host):
+ *  Header: the magic BS_DF_BIN_MAGIC (8 chars), uint32_t version,
+ *          uint32_t number of columns, uint32_t maximum rows per block,
+ *          uint32_t reserved (0)
+ *  For each column a bs_df_bin_column_t: its type (bs_df_type_t) and value
+ *          size in bytes, and its name and CSV printf format (NUL terminated)
+ *  Then a sequence of blocks, each:
+ *    uint32_t BS_DF_BIN_BLOCK_MAGIC, uint32_t number of rows <n>
+ *    For each column: <n> values, padded with 0s to a multiple of 8 bytes
+ * So all values are naturally aligned, and each column of each block can be
+ * mapped directly as an array (e.g. with numpy.frombuffer()).
+ */
+
+#ifndef UTIL_BS_DUMP_FILES_BIN_H
+#define UTIL_BS_DUMP_FILES_BIN_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "bs_dump_files.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+#define BS_DF_BIN_MAGIC "BSDUMPCB"
+#define BS_DF_BIN_MAGIC_LEN 8
+#define BS_DF_BIN_VERSION 1
+#define BS_DF_BIN_BLOCK_MAGIC 0x4B4C4244 /* "DBLK" */
+#define BS_DF_BIN_BLOCK_ROWS 4096
+#define BS_DF_BIN_MAX_COLUMNS 1024
+#define BS_DF_NAME_LEN 32 /* Including the terminating NUL */
+#define BS_DF_FORMAT_LEN 24 /* Including the terminating NUL */
+
+/* Description of 1 column in the file header */
+typedef struct {
+  uint8_t type; /* bs_df_type_t */
+  uint8_t size; /* Bytes per value */
+  uint8_t reserved[6];
+  char name[BS_DF_NAME_LEN];
+  char format[BS_DF_FORMAT_LEN];
+} bs_df_bin_column_t;
+
+typedef struct bs_df_bin_s bs_df_bin_t;
+
+unsigned int bs_df_type_size(bs_df_type_t type);
+const char *bs_df_default_format(bs_df_type_t type);
+bool bs_df_format_is_valid(const char *format, bs_df_type_t type);
+void bs_df_print_value(FILE *out, const char *format, bs_df_type_t type, bs_df_value_t value);
+
+bs_df_bin_t *bs_df_bin_open(FILE *file, const bs_df_column_t *columns, unsigned int n_columns);
+void bs_df_bin_row(bs_df_bin_t *bin, const bs_df_value_t *values);
+void bs_df_bin_close(bs_df_bin_t *bin);
+int bs_df_bin_to_csv(FILE *in, FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* UTIL_BS_DUMP_FILES_BIN_H */
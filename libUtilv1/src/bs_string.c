@@ -27,28 +27,76 @@ int bs_number_strlen(long long int a) {
   return c;
 }
 
+/* "00".."99": the 2 digits of each number below 100 */
+static const char dec_pairs[200] =
+  "00010203040506070809"
+  "10111213141516171819"
+  "20212223242526272829"
+  "30313233343536373839"
+  "40414243444546474849"
+  "50515253545556575859"
+  "60616263646566676869"
+  "70717273747576777879"
+  "80818283848586878889"
+  "90919293949596979899";
+
+/* "00".."FF": the 2 (upper case) hex digits of each byte value */
+static const char hex_pairs[512] =
+  "000102030405060708090A0B0C0D0E0F"
+  "101112131415161718191A1B1C1D1E1F"
+  "202122232425262728292A2B2C2D2E2F"
+  "303132333435363738393A3B3C3D3E3F"
+  "404142434445464748494A4B4C4D4E4F"
+  "505152535455565758595A5B5C5D5E5F"
+  "606162636465666768696A6B6C6D6E6F"
+  "707172737475767778797A7B7C7D7E7F"
+  "808182838485868788898A8B8C8D8E8F"
+  "909192939495969798999A9B9C9D9E9F"
+  "A0A1A2A3A4A5A6A7A8A9AAABACADAEAF"
+  "B0B1B2B3B4B5B6B7B8B9BABBBCBDBEBF"
+  "C0C1C2C3C4C5C6C7C8C9CACBCCCDCECF"
+  "D0D1D2D3D4D5D6D7D8D9DADBDCDDDEDF"
+  "E0E1E2E3E4E5E6E7E8E9EAEBECEDEEEF"
+  "F0F1F2F3F4F5F6F7F8F9FAFBFCFDFEFF";
+
+static inline void put_dec_pair(char *dest, uint value) {
+  memcpy(dest, &dec_pairs[2*value], 2);
+}
+
 /**
  * Convert a bs_time_t into a string.
  * The format will always be: hh:mm:ss.ssssss\0
  *  hour will not wrap at 24 hours, but it will be truncated to 2 digits (so 161hours = 61)
  *
  * Note: the caller has to allocate the destination buffer == 16 chars
+ *
+ * As consecutive calls tend to be for the same second, the "hh:mm:ss." part
+ * of the last call (per thread) is kept and reused
  */
 char * bs_time_to_str(char* dest, bs_time_t time) {
-  if ( time != TIME_NEVER ){
-    uint hour;
-    uint minute;
-    uint second;
-    uint us;
+  static __thread bs_time_t last_second = TIME_NEVER;
+  static __thread char last_second_s[9];
 
-    hour   = ( time/3600/1000000 ) % 100;
-    minute = ( time/60/1000000 ) % 60;
-    second = ( time/1000000 ) % 60;
-    us     = time % 1000000;
+  if ( time != TIME_NEVER ){
+    bs_time_t second = time/1000000;
+    uint us = time - second*1000000;
 
-    sprintf(dest,"%02u:%02u:%02u.%06u",hour, minute, second,us);
+    if ( second != last_second ) {
+      last_second = second;
+      put_dec_pair(&last_second_s[0], ( second/3600 ) % 100);
+      last_second_s[2] = ':';
+      put_dec_pair(&last_second_s[3], ( second/60 ) % 60);
+      last_second_s[5] = ':';
+      put_dec_pair(&last_second_s[6], second % 60);
+      last_second_s[8] = '.';
+    }
+    memcpy(dest, last_second_s, 9);
+    put_dec_pair(&dest[9], us/10000);
+    put_dec_pair(&dest[11], ( us/100 ) % 100);
+    put_dec_pair(&dest[13], us % 100);
+    dest[15] = 0;
   } else {
-    sprintf(dest," NEVER/UNKNOWN ");
+    memcpy(dest, " NEVER/UNKNOWN ", 16);
   }
   return dest;
 }
@@ -58,31 +106,37 @@ char * bs_time_to_str(char* dest, bs_time_t time) {
  * The caller allocates <buffer> with at least nbytes*3 + 1 bytes
  */
 void bs_hex_dump(char* buffer, const uint8_t *bytes, size_t nbytes) {
-  size_t ni,no = 0;
-  buffer[0] = 0; //in case nbytes is 0, we terminate the string
+  char *out = buffer;
+  for ( size_t ni = 0; ni < nbytes; ni++ ) {
+    memcpy(out, &hex_pairs[2*bytes[ni]], 2);
+    out[2] = ' ';
+    out += 3;
+  }
   if ( nbytes >= 1 ) {
-    for ( ni = 0; ni < nbytes -1; ni++){
-      sprintf(&buffer[no], "%02X ", bytes[ni]);
-      no +=3;
-    }
-    sprintf(&buffer[no], "%02X", bytes[nbytes-1]);
+    out--; //No separator after the last byte
   }
+  *out = 0;
 }
 
+/*
+ * Value + 1 of each hexadecimal (ASCII) char (0 for invalid chars)
+ */
+static const uint8_t hex_values[256] = {
+  ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+  ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+  ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+  ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+};
+
 /**
  * Convert a single hexadecimal (ASCII) char to an integer
  */
 static inline uint8_t valuefromhexchar(char a) {
-  if ( ( a >= '0' ) && ( a <= '9') ) {
-    return a - '0';
-  } else if ( ( a >= 'A' ) && ( a <= 'F' ) ) {
-    return a - 'A' + 0xA;
-  } else if ( ( a >= 'a' ) && ( a <= 'f' ) ) {
-    return a - 'a' + 0xA;
-  } else {
+  uint8_t value = hex_values[(uint8_t)a];
+  if ( value == 0 ) {
     bs_trace_error_line("Character '%c' is not valid hexadecimal\n",a);
-    return -1;
   }
+  return value - 1;
 }
 
 /**
@@ -93,13 +147,17 @@ void bs_read_hex_dump(char *s,uint8_t *buffer, uint size) {
   uint ni = 0;
   uint no = 0;
   while ( s[ni] != 0 && no < size ){
-    if (s[ni] != 0 && s[ni+1]!= 0){
-      buffer[no] = valuefromhexchar(s[ni])*16;
-      buffer[no] += valuefromhexchar(s[ni+1]);
-      ni+=2;
-    } else {
+    if ( s[ni+1] == 0 ) {
       break;
     }
+    uint8_t high = hex_values[(uint8_t)s[ni]];
+    uint8_t low = hex_values[(uint8_t)s[ni+1]];
+    if ( ( high == 0 ) || ( low == 0 ) ) { //Invalid char (this will error out)
+      high = valuefromhexchar(s[ni]) + 1;
+      low = valuefromhexchar(s[ni+1]) + 1;
+    }
+    buffer[no] = ( ( high - 1 ) << 4 ) | ( low - 1 );
+    ni+=2;
     if ( s[ni]!= 0 )
       ni++;
     no++;
@@ -0,0 +1,888 @@
+/*
+ * Copyright 2018 Oticon A/S
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * Binary (deferred formatting) traces: recording and decoding.
+ * See bs_trace_binary.h
+ *
+ * The same records can also be kept in memory, in a circular buffer (flight
+ * recorder), to be decoded only if needed
+ *
+ * Stream format (in the byte order of the recording host):
+ *  The magic BS_TRACE_BIN_MAGIC followed by the version (uint32_t), and then
+ *  a sequence of records, each starting with its record type (uint8_t):
+ *  * REC_STRING: uint64_t id, uint32_t length, <length> chars
+ *     Defines a string (a format or a file name), later referred to by its id
+ *  * REC_PREFIX: uint32_t length, <length> chars
+ *     The trace prefix of this program from now on
+ *  * REC_MSG: uint8_t type, uint8_t level, uint8_t has_time, uint32_t line,
+ *             uint64_t time, uint64_t format id, uint64_t file name id (0 if none),
+ *             uint32_t args length, <args length> bytes of arguments
+ *     A trace message. For each conversion in its format, its arguments are
+ *     recorded in order: each '*' width/precision and integer as an int64_t,
+ *     floating point values as a double (long doubles as their in memory
+ *     representation, in BS_TRACE_BIN_LDOUBLE_LEN bytes), pointers as an
+ *     uint64_t, and strings as an uint32_t length followed by their content.
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "bs_trace_binary.h"
+#include "bs_tracing.h"
+#include "bs_string.h"
+#include "bs_oswrap.h"
+#include "bs_utils.h"
+
+#define BS_TRACE_BIN_MAGIC "BSTRACEB"
+#define BS_TRACE_BIN_MAGIC_LEN 8
+#define BS_TRACE_BIN_VERSION 2
+#define BS_TRACE_BIN_LDOUBLE_LEN 16
+#define BS_TRACE_BIN_FILE_BUF_SIZE (1024*1024)
+#define BS_TRACE_BIN_MAX_SPEC 64 //Longest conversion specification the decoder will reproduce
+
+typedef enum { REC_STRING = 1, REC_PREFIX, REC_MSG } rec_type_t;
+
+/* What a conversion specification consumes from the arguments */
+typedef enum {
+  ARG_NONE = 0, //%% (or an unknown conversion)
+  ARG_INT, ARG_LONG, ARG_LLONG, ARG_INTMAX, ARG_SIZE, ARG_PTRDIFF,
+  ARG_DOUBLE, ARG_LDOUBLE,
+  ARG_STR,
+  ARG_PTR,
+  ARG_IGNORED_PTR, //%n and %ls: the pointer is consumed, but its content not recorded
+} arg_kind_t;
+
+typedef struct {
+  const char *start; //The '%' starting the specification
+  size_t len; //Length of the whole specification
+  uint8_t kind; //arg_kind_t
+  bool star_width;
+  bool star_prec;
+  int prec; //Precision (-1 if not given, or given with '*')
+} conv_spec_t;
+
+/*
+ * Find the next conversion specification in <fmt>, and fill <spec> with it
+ * Returns a pointer to the first char after it, or NULL if there is none
+ */
+static const char *next_conv_spec(const char *fmt, conv_spec_t *spec){
+  const char *p = strchr(fmt, '%');
+  if ( p == NULL ) {
+    return NULL;
+  }
+  spec->start = p++;
+  spec->star_width = false;
+  spec->star_prec = false;
+  spec->prec = -1;
+
+  while ( ( *p != 0 ) && ( strchr("-+ #0'", *p) != NULL ) ) { //Flags
+    p++;
+  }
+  if ( *p == '*' ) { //Width
+    spec->star_width = true;
+    p++;
+  } else {
+    while ( isdigit((unsigned char)*p) ) {
+      p++;
+    }
+  }
+  if ( *p == '.' ) { //Precision
+    p++;
+    if ( *p == '*' ) {
+      spec->star_prec = true;
+      p++;
+    } else {
+      spec->prec = 0;
+      while ( isdigit((unsigned char)*p) ) {
+        spec->prec = spec->prec*10 + ( *p++ - '0' );
+      }
+    }
+  }
+  char length = 0; //Length modifier ('H' = hh, 'Q' = ll)
+  if ( ( p[0] == 'h' ) && ( p[1] == 'h' ) ) {
+    length = 'H';
+    p += 2;
+  } else if ( ( p[0] == 'l' ) && ( p[1] == 'l' ) ) {
+    length = 'Q';
+    p += 2;
+  } else if ( ( *p != 0 ) && ( strchr("hlLjztq", *p) != NULL ) ) {
+    length = *p++;
+  }
+
+  char conv = *p;
+  if ( conv != 0 ) {
+    p++;
+  }
+  switch ( conv ) {
+    case 'd': case 'i': case 'o': case 'u': case 'x': case 'X': case 'c':
+      switch ( length ) {
+        case 'l': spec->kind = ( conv == 'c' ) ? ARG_INT : ARG_LONG; break;
+        case 'Q': case 'q': spec->kind = ARG_LLONG; break;
+        case 'j': spec->kind = ARG_INTMAX; break;
+        case 'z': spec->kind = ARG_SIZE; break;
+        case 't': spec->kind = ARG_PTRDIFF; break;
+        default: spec->kind = ARG_INT; break;
+      }
+      break;
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+      spec->kind = ( length == 'L' ) ? ARG_LDOUBLE : ARG_DOUBLE;
+      break;
+    case 's':
+      spec->kind = ( length == 'l' ) ? ARG_IGNORED_PTR : ARG_STR;
+      break;
+    case 'p':
+      spec->kind = ARG_PTR;
+      break;
+    case 'n':
+      spec->kind = ARG_IGNORED_PTR;
+      break;
+    default:
+      spec->kind = ARG_NONE;
+      break;
+  }
+  spec->len = p - spec->start;
+  return p;
+}
+
+/*
+ * Recording side
+ */
+
+/* Strings (formats and file names) already defined in the stream.
+ * They are identified by their content (not their address, as a format may be
+ * built in a buffer which is later reused), and a copy of each is kept.
+ * For formats, their parsed conversion specifications are kept */
+typedef struct {
+  char *str; //Our copy
+  uint64_t hash;
+  uint64_t id; //Id in the stream (from 1)
+  conv_spec_t *specs;
+  int n_specs;
+  bool in_file; //Already defined in the binary file
+} known_str_t;
+
+static FILE *bin_f;
+static char *bin_f_buf;
+static pthread_mutex_t bin_lock = PTHREAD_MUTEX_INITIALIZER;
+static known_str_t *known; //Open addressing hash table, keyed by the string content
+static size_t known_size; //A power of 2
+static size_t known_used;
+static char last_prefix[64]; //For the flight recorder dumps
+static uint8_t *rec_buf; //Record being assembled
+static size_t rec_len;
+static size_t rec_alloc;
+
+static void rec_put(const void *ptr, size_t n){
+  if ( rec_len + n > rec_alloc ) {
+    rec_alloc = BS_MAX(2*rec_alloc, rec_len + n + 256);
+    rec_buf = bs_realloc(rec_buf, rec_alloc);
+  }
+  memcpy(&rec_buf[rec_len], ptr, n);
+  rec_len += n;
+}
+
+static inline void rec_put_u8(uint8_t v){ rec_put(&v, sizeof(v)); }
+static inline void rec_put_u32(uint32_t v){ rec_put(&v, sizeof(v)); }
+static inline void rec_put_u64(uint64_t v){ rec_put(&v, sizeof(v)); }
+static inline void rec_put_i64(int64_t v){ rec_put(&v, sizeof(v)); }
+static inline void rec_put_f64(double v){ rec_put(&v, sizeof(v)); }
+static inline void rec_put_ldouble(long double v){
+  uint8_t bytes[BS_TRACE_BIN_LDOUBLE_LEN] = {0};
+  memcpy(bytes, &v, BS_MIN(sizeof(v), sizeof(bytes)));
+  rec_put(bytes, sizeof(bytes));
+}
+
+static inline uint64_t str_hash(const char *str){ //FNV-1a
+  uint64_t h = 0xcbf29ce484222325ULL;
+  while ( *str != 0 ) {
+    h = ( h ^ (uint8_t)*str++ ) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+static void known_grow(void){
+  size_t new_size = known_size ? 2*known_size : 256;
+  known_str_t *tab = bs_calloc(new_size, sizeof(known_str_t));
+
+  for ( size_t i = 0; i < known_size; i++ ) {
+    if ( known[i].str != NULL ) {
+      size_t j = known[i].hash & ( new_size - 1 );
+      while ( tab[j].str != NULL ) {
+        j = ( j + 1 ) & ( new_size - 1 );
+      }
+      tab[j] = known[i];
+    }
+  }
+  /* The table is replaced before its size grows, and the old one is not freed,
+   * as a crash handler may be reading them (see bs_trace_binary_recorder_write()) */
+  __atomic_store_n(&known, tab, __ATOMIC_RELEASE);
+  __atomic_store_n(&known_size, new_size, __ATOMIC_RELEASE);
+}
+
+static void string_assemble(const known_str_t *k){
+  size_t len = strlen(k->str);
+  rec_len = 0;
+  rec_put_u8(REC_STRING);
+  rec_put_u64(k->id);
+  rec_put_u32(len);
+  rec_put(k->str, len);
+}
+
+/*
+ * Find <str> among the known strings, adding (a copy of) it if it is not
+ * (and if <is_format>, parsing it).
+ * If the binary file is open, and it is not yet defined in it, define it now
+ */
+static known_str_t *known_get(const char *str, bool is_format){
+  if ( 2*( known_used + 1 ) > known_size ) {
+    known_grow();
+  }
+  uint64_t hash = str_hash(str);
+  size_t i = hash & ( known_size - 1 );
+  while ( ( known[i].str != NULL )
+         && ( ( known[i].hash != hash ) || ( strcmp(known[i].str, str) != 0 ) ) ) {
+    i = ( i + 1 ) & ( known_size - 1 );
+  }
+
+  known_str_t *k = &known[i];
+  if ( k->str == NULL ) {
+    char *copy = bs_malloc(strlen(str) + 1);
+    strcpy(copy, str);
+    k->hash = hash;
+    k->id = ++known_used;
+    if ( is_format ) {
+      conv_spec_t spec;
+      const char *p = copy;
+      while ( ( p = next_conv_spec(p, &spec) ) != NULL ) {
+        k->specs = bs_realloc(k->specs, ( k->n_specs + 1 )*sizeof(conv_spec_t));
+        k->specs[k->n_specs++] = spec;
+      }
+    }
+    /* Published last, as a crash handler may be reading the table */
+    __atomic_store_n(&k->str, copy, __ATOMIC_RELEASE);
+  }
+  if ( ( bin_f != NULL ) && !k->in_file ) {
+    string_assemble(k);
+    fwrite(rec_buf, 1, rec_len, bin_f);
+    k->in_file = true;
+  }
+  return k;
+}
+
+static void prefix_assemble(const char *prefix){
+  size_t len = strlen(prefix);
+  rec_len = 0;
+  rec_put_u8(REC_PREFIX);
+  rec_put_u32(len);
+  rec_put(prefix, len);
+}
+
+static void header_write(FILE *f){
+  uint32_t version = BS_TRACE_BIN_VERSION;
+  fwrite(BS_TRACE_BIN_MAGIC, 1, BS_TRACE_BIN_MAGIC_LEN, f);
+  fwrite(&version, sizeof(version), 1, f);
+}
+
+/**
+ * Start recording binary traces into <file_name>
+ * Returns 0 on success, -1 on failure
+ */
+int bs_trace_binary_open(const char *file_name){
+  bs_trace_binary_close();
+
+  FILE *f = fopen(file_name, "w");
+  if ( f == NULL ) {
+    return -1;
+  }
+  pthread_mutex_lock(&bin_lock);
+  bin_f = f;
+  bin_f_buf = bs_malloc(BS_TRACE_BIN_FILE_BUF_SIZE);
+  setvbuf(bin_f, bin_f_buf, _IOFBF, BS_TRACE_BIN_FILE_BUF_SIZE);
+  header_write(bin_f);
+  pthread_mutex_unlock(&bin_lock);
+
+  static bool atexit_set;
+  if ( !atexit_set ) {
+    atexit_set = true;
+    atexit(bs_trace_binary_close);
+  }
+  return 0;
+}
+
+/**
+ * Stop recording binary traces (flushing and closing the file)
+ */
+void bs_trace_binary_close(void){
+  pthread_mutex_lock(&bin_lock);
+  if ( bin_f != NULL ) {
+    fclose(bin_f);
+    bin_f = NULL;
+    free(bin_f_buf);
+    bin_f_buf = NULL;
+    for ( size_t i = 0; i < known_size; i++ ) {
+      known[i].in_file = false;
+    }
+  }
+  pthread_mutex_unlock(&bin_lock);
+}
+
+bool bs_trace_binary_is_open(void){
+  return bin_f != NULL;
+}
+
+/**
+ * The traces prefix changed to <prefix>
+ */
+void bs_trace_binary_set_prefix(const char *prefix){
+  pthread_mutex_lock(&bin_lock);
+  if ( bin_f != NULL ) {
+    prefix_assemble(prefix);
+    fwrite(rec_buf, 1, rec_len, bin_f);
+  }
+  strncpy(last_prefix, prefix, sizeof(last_prefix) - 1);
+  pthread_mutex_unlock(&bin_lock);
+}
+
+/*
+ * Assemble a REC_MSG record for one trace message in rec_buf
+ */
+static void msg_assemble(int type, const char *caller_filename, unsigned int caller_line,
+                         int level, bool has_time, bs_time_t time,
+                         const char *format, va_list variable_args){
+  known_str_t *fmt = known_get(format, true);
+  uint64_t file_id = 0;
+  if ( caller_filename != NULL ) {
+    file_id = known_get(caller_filename, false)->id;
+  }
+
+  rec_len = 0;
+  rec_put_u8(REC_MSG);
+  rec_put_u8(type);
+  rec_put_u8(BS_MIN(level, UINT8_MAX));
+  rec_put_u8(has_time);
+  rec_put_u32(caller_line);
+  rec_put_u64(time);
+  rec_put_u64(fmt->id);
+  rec_put_u64(file_id);
+  size_t args_len_pos = rec_len;
+  rec_put_u32(0); //Filled below
+
+  for ( int i = 0; i < fmt->n_specs; i++ ) {
+    const conv_spec_t *spec = &fmt->specs[i];
+    int prec = spec->prec;
+    if ( spec->star_width ) {
+      rec_put_i64(va_arg(variable_args, int));
+    }
+    if ( spec->star_prec ) {
+      prec = va_arg(variable_args, int);
+      rec_put_i64(prec);
+    }
+    switch ( spec->kind ) {
+      case ARG_INT:     rec_put_i64(va_arg(variable_args, int)); break;
+      case ARG_LONG:    rec_put_i64(va_arg(variable_args, long)); break;
+      case ARG_LLONG:   rec_put_i64(va_arg(variable_args, long long)); break;
+      case ARG_INTMAX:  rec_put_i64(va_arg(variable_args, intmax_t)); break;
+      case ARG_SIZE:    rec_put_u64(va_arg(variable_args, size_t)); break;
+      case ARG_PTRDIFF: rec_put_i64(va_arg(variable_args, ptrdiff_t)); break;
+      case ARG_DOUBLE:  rec_put_f64(va_arg(variable_args, double)); break;
+      case ARG_LDOUBLE: rec_put_ldouble(va_arg(variable_args, long double)); break;
+      case ARG_PTR:     rec_put_u64((uintptr_t)va_arg(variable_args, void *)); break;
+      case ARG_IGNORED_PTR: (void)va_arg(variable_args, void *); break;
+      case ARG_STR: {
+        const char *s = va_arg(variable_args, const char *);
+        if ( s == NULL ) {
+          s = "(null)";
+        }
+        size_t len = ( prec >= 0 ) ? strnlen(s, prec) : strlen(s);
+        rec_put_u32(len);
+        rec_put(s, len);
+        break;
+      }
+      default:
+        break;
+    }
+  }
+  uint32_t args_len = rec_len - args_len_pos - sizeof(uint32_t);
+  memcpy(&rec_buf[args_len_pos], &args_len, sizeof(uint32_t));
+}
+
+/**
+ * Record one trace message (see bs_trace_vprint())
+ */
+void bs_trace_binary_vrecord(int type, const char *caller_filename, unsigned int caller_line,
+                             int level, bool has_time, bs_time_t time,
+                             const char *format, va_list variable_args){
+  pthread_mutex_lock(&bin_lock);
+  if ( bin_f != NULL ) {
+    msg_assemble(type, caller_filename, caller_line, level, has_time, time,
+                 format, variable_args);
+    fwrite(rec_buf, 1, rec_len, bin_f);
+  }
+  pthread_mutex_unlock(&bin_lock);
+}
+
+/*
+ * Flight recorder: the same records kept in a circular buffer in memory,
+ * each preceded by its length (uint32_t). When full, the oldest are dropped.
+ * Formats and file names are referred to by their id as usual, and only put
+ * into the stream (from the known strings) when dumping.
+ */
+static uint8_t *fr_buf;
+static size_t fr_size;
+static uint64_t fr_head, fr_tail; //Total bytes ever written / dropped
+
+static void fr_copy_in(uint64_t pos, const void *src, size_t n){
+  size_t off = pos % fr_size;
+  size_t first = BS_MIN(n, fr_size - off);
+  memcpy(&fr_buf[off], src, first);
+  memcpy(fr_buf, (const uint8_t *)src + first, n - first);
+}
+
+static void fr_copy_out(uint64_t pos, void *dst, size_t n){
+  size_t off = pos % fr_size;
+  size_t first = BS_MIN(n, fr_size - off);
+  memcpy(dst, &fr_buf[off], first);
+  memcpy((uint8_t *)dst + first, fr_buf, n - first);
+}
+
+/**
+ * Start keeping the last <size> bytes of binary trace records in memory
+ * (bs_trace_binary_recorder_record()), to dump them on demand
+ * (bs_trace_binary_recorder_dump())
+ */
+void bs_trace_binary_recorder_start(size_t size){
+  pthread_mutex_lock(&bin_lock);
+  free(fr_buf);
+  fr_size = BS_MAX(size, 4096);
+  fr_buf = bs_malloc(fr_size);
+  fr_head = 0;
+  fr_tail = 0;
+  pthread_mutex_unlock(&bin_lock);
+}
+
+bool bs_trace_binary_recorder_is_on(void){
+  return fr_buf != NULL;
+}
+
+/**
+ * Record one trace message in the flight recorder (see bs_trace_binary_vrecord())
+ */
+void bs_trace_binary_recorder_record(int type, const char *caller_filename, unsigned int caller_line,
+                                     int level, bool has_time, bs_time_t time,
+                                     const char *format, va_list variable_args){
+  pthread_mutex_lock(&bin_lock);
+  if ( fr_buf == NULL ) {
+    pthread_mutex_unlock(&bin_lock);
+    return;
+  }
+  msg_assemble(type, caller_filename, caller_line, level, has_time, time,
+               format, variable_args);
+  uint32_t len = rec_len;
+  if ( len + sizeof(len) <= fr_size ) {
+    while ( fr_size - ( fr_head - fr_tail ) < len + sizeof(len) ) {
+      uint32_t old_len;
+      fr_copy_out(fr_tail, &old_len, sizeof(old_len));
+      __atomic_store_n(&fr_tail, fr_tail + sizeof(old_len) + old_len, __ATOMIC_RELEASE);
+    }
+    fr_copy_in(fr_head, &len, sizeof(len));
+    fr_copy_in(fr_head + sizeof(len), rec_buf, len);
+    __atomic_store_n(&fr_head, fr_head + sizeof(len) + len, __ATOMIC_RELEASE); //Only now the crash handler may read it
+  }
+  pthread_mutex_unlock(&bin_lock);
+}
+
+static int write_all(int fd, const void *ptr, size_t n){
+  const uint8_t *p = ptr;
+  while ( n > 0 ) {
+    ssize_t ret = write(fd, p, n);
+    if ( ret <= 0 ) {
+      return -1;
+    }
+    p += ret;
+    n -= ret;
+  }
+  return 0;
+}
+
+/*
+ * Write into <fd> a string definition record, without allocating
+ */
+static int string_write(int fd, uint8_t rec_type, const known_str_t *k, const char *str){
+  uint8_t head[1 + sizeof(uint64_t) + sizeof(uint32_t)];
+  uint32_t len = strlen(str);
+  size_t n = 0;
+  head[n++] = rec_type;
+  if ( k != NULL ) {
+    memcpy(&head[n], &k->id, sizeof(uint64_t));
+    n += sizeof(uint64_t);
+  }
+  memcpy(&head[n], &len, sizeof(len));
+  n += sizeof(len);
+  if ( ( write_all(fd, head, n) != 0 ) || ( write_all(fd, str, len) != 0 ) ) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Write the flight recorder content into <fd>, as a binary trace stream
+ * (which bs_trace_binary_decode() or the bs_trace_decoder tool can decode)
+ *
+ * Only async-signal-safe calls are used (and no locks are taken), so this
+ * can be called from a crash signal handler
+ *
+ * Returns the number of written messages, or -1 on failure
+ */
+int bs_trace_binary_recorder_write(int fd){
+  uint32_t version = BS_TRACE_BIN_VERSION;
+  uint64_t head = __atomic_load_n(&fr_head, __ATOMIC_ACQUIRE);
+  uint64_t pos = __atomic_load_n(&fr_tail, __ATOMIC_ACQUIRE);
+  int n = 0;
+
+  if ( ( fr_buf == NULL )
+      || ( write_all(fd, BS_TRACE_BIN_MAGIC, BS_TRACE_BIN_MAGIC_LEN) != 0 )
+      || ( write_all(fd, &version, sizeof(version)) != 0 )
+      || ( string_write(fd, REC_PREFIX, NULL, last_prefix) != 0 ) ) {
+    return -1;
+  }
+  size_t tab_size = __atomic_load_n(&known_size, __ATOMIC_ACQUIRE);
+  known_str_t *tab = __atomic_load_n(&known, __ATOMIC_ACQUIRE);
+  for ( size_t i = 0; i < tab_size; i++ ) {
+    const char *str = __atomic_load_n(&tab[i].str, __ATOMIC_ACQUIRE);
+    if ( ( str != NULL ) && ( string_write(fd, REC_STRING, &tab[i], str) != 0 ) ) {
+      return -1;
+    }
+  }
+  while ( pos < head ) {
+    uint32_t len;
+    fr_copy_out(pos, &len, sizeof(len));
+    pos += sizeof(len);
+    if ( len > head - pos ) {
+      break; //Being written
+    }
+    size_t off = pos % fr_size;
+    size_t first = BS_MIN(len, fr_size - off);
+    if ( ( write_all(fd, &fr_buf[off], first) != 0 )
+        || ( write_all(fd, fr_buf, len - first) != 0 ) ) {
+      return -1;
+    }
+    pos += len;
+    n++;
+  }
+  return n;
+}
+
+/**
+ * Decode the flight recorder content into <out> (and empty it)
+ *
+ * Returns the number of dumped messages, or -1 on failure
+ */
+int bs_trace_binary_recorder_dump(FILE *out){
+  FILE *stream;
+  pthread_mutex_lock(&bin_lock);
+  if ( ( fr_buf == NULL ) || ( ( stream = tmpfile() ) == NULL ) ) {
+    pthread_mutex_unlock(&bin_lock);
+    return -1;
+  }
+  int n = bs_trace_binary_recorder_write(fileno(stream));
+  __atomic_store_n(&fr_tail, fr_head, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&bin_lock);
+
+  rewind(stream);
+  int ret = ( n >= 0 ) ? bs_trace_binary_decode(stream, out) : -1;
+  fclose(stream);
+  return ( ret == 0 ) ? n : -1;
+}
+
+/*
+ * Decoding side
+ */
+
+typedef struct {
+  uint64_t id;
+  char *str;
+} dec_str_t;
+
+typedef struct {
+  dec_str_t *tab; //Open addressing hash table, keyed by id
+  size_t size;
+  size_t used;
+} dec_strs_t;
+
+static inline size_t dec_hash(const dec_strs_t *t, uint64_t id){
+  return (size_t)(( id * 0x9E3779B97F4A7C15ULL ) >> 32) & ( t->size - 1 );
+}
+
+static void dec_strs_add(dec_strs_t *t, uint64_t id, char *str){
+  if ( 2*( t->used + 1 ) > t->size ) {
+    dec_strs_t bigger = { NULL, t->size ? 2*t->size : 256, 0 };
+    bigger.tab = bs_calloc(bigger.size, sizeof(dec_str_t));
+    for ( size_t i = 0; i < t->size; i++ ) {
+      if ( t->tab[i].str != NULL ) {
+        dec_strs_add(&bigger, t->tab[i].id, t->tab[i].str);
+      }
+    }
+    free(t->tab);
+    *t = bigger;
+  }
+  size_t i = dec_hash(t, id);
+  while ( ( t->tab[i].str != NULL ) && ( t->tab[i].id != id ) ) {
+    i = ( i + 1 ) & ( t->size - 1 );
+  }
+  if ( t->tab[i].str != NULL ) { //Defined again (several recorder dumps in one file): keep the last
+    free(t->tab[i].str);
+  } else {
+    t->used++;
+  }
+  t->tab[i].id = id;
+  t->tab[i].str = str;
+}
+
+static const char *dec_strs_get(const dec_strs_t *t, uint64_t id){
+  if ( t->size == 0 ) {
+    return NULL;
+  }
+  size_t i = dec_hash(t, id);
+  while ( t->tab[i].str != NULL ) {
+    if ( t->tab[i].id == id ) {
+      return t->tab[i].str;
+    }
+    i = ( i + 1 ) & ( t->size - 1 );
+  }
+  return NULL;
+}
+
+static int read_n(FILE *in, void *dst, size_t n){
+  return ( fread(dst, 1, n, in) == n ) ? 0 : -1;
+}
+
+static char *read_string(FILE *in, uint32_t len){
+  char *str = bs_malloc(len + 1);
+  if ( read_n(in, str, len) != 0 ) {
+    free(str);
+    return NULL;
+  }
+  str[len] = 0;
+  return str;
+}
+
+/* Cursor over the recorded arguments of a message */
+typedef struct {
+  const uint8_t *ptr;
+  const uint8_t *end;
+} args_cursor_t;
+
+static int64_t arg_i64(args_cursor_t *a){
+  int64_t v = 0;
+  if ( a->ptr + sizeof(v) <= a->end ) {
+    memcpy(&v, a->ptr, sizeof(v));
+    a->ptr += sizeof(v);
+  }
+  return v;
+}
+
+static double arg_f64(args_cursor_t *a){
+  double v = 0;
+  if ( a->ptr + sizeof(v) <= a->end ) {
+    memcpy(&v, a->ptr, sizeof(v));
+    a->ptr += sizeof(v);
+  }
+  return v;
+}
+
+static long double arg_ldouble(args_cursor_t *a){
+  long double v = 0;
+  if ( a->ptr + BS_TRACE_BIN_LDOUBLE_LEN <= a->end ) {
+    memcpy(&v, a->ptr, BS_MIN(sizeof(v), BS_TRACE_BIN_LDOUBLE_LEN));
+    a->ptr += BS_TRACE_BIN_LDOUBLE_LEN;
+  }
+  return v;
+}
+
+/*
+ * Print the message <format> with the recorded arguments <args> into <out>
+ */
+static void decode_message(FILE *out, const char *format, args_cursor_t *args){
+  const char *p = format;
+  const char *next;
+  conv_spec_t spec;
+  char spec_s[BS_TRACE_BIN_MAX_SPEC];
+
+  while ( ( next = next_conv_spec(p, &spec) ) != NULL ) {
+    fwrite(p, 1, spec.start - p, out);
+    p = next;
+
+    int width = spec.star_width ? arg_i64(args) : 0;
+    int prec = spec.star_prec ? arg_i64(args) : 0;
+    if ( ( spec.kind == ARG_NONE ) || ( spec.len >= sizeof(spec_s) ) ) {
+      if ( ( spec.len == 2 ) && ( spec.start[1] == '%' ) ) {
+        fputc('%', out);
+      } else {
+        fwrite(spec.start, 1, spec.len, out);
+      }
+      continue;
+    }
+    memcpy(spec_s, spec.start, spec.len);
+    spec_s[spec.len] = 0;
+
+#define DECODE_PRINT(value) \
+    if ( spec.star_width && spec.star_prec ) { \
+      fprintf(out, spec_s, width, prec, value); \
+    } else if ( spec.star_width ) { \
+      fprintf(out, spec_s, width, value); \
+    } else if ( spec.star_prec ) { \
+      fprintf(out, spec_s, prec, value); \
+    } else { \
+      fprintf(out, spec_s, value); \
+    }
+
+    switch ( spec.kind ) {
+      case ARG_INT:     DECODE_PRINT((int)arg_i64(args)); break;
+      case ARG_LONG:    DECODE_PRINT((long)arg_i64(args)); break;
+      case ARG_LLONG:   DECODE_PRINT((long long)arg_i64(args)); break;
+      case ARG_INTMAX:  DECODE_PRINT((intmax_t)arg_i64(args)); break;
+      case ARG_SIZE:    DECODE_PRINT((size_t)arg_i64(args)); break;
+      case ARG_PTRDIFF: DECODE_PRINT((ptrdiff_t)arg_i64(args)); break;
+      case ARG_DOUBLE:  DECODE_PRINT(arg_f64(args)); break;
+      case ARG_LDOUBLE: DECODE_PRINT(arg_ldouble(args)); break;
+      case ARG_PTR:     DECODE_PRINT((void *)(uintptr_t)arg_i64(args)); break;
+      case ARG_IGNORED_PTR:
+        if ( spec_s[spec.len - 1] != 'n' ) {
+          fputs("(?)", out);
+        }
+        break;
+      case ARG_STR: {
+        uint32_t len = 0;
+        if ( args->ptr + sizeof(len) <= args->end ) {
+          memcpy(&len, args->ptr, sizeof(len));
+          args->ptr += sizeof(len);
+        }
+        len = BS_MIN(len, args->end - args->ptr);
+        char *s = bs_malloc(len + 1);
+        memcpy(s, args->ptr, len);
+        s[len] = 0;
+        args->ptr += len;
+        DECODE_PRINT(s);
+        free(s);
+        break;
+      }
+      default:
+        break;
+    }
+#undef DECODE_PRINT
+  }
+  fputs(p, out);
+}
+
+/**
+ * Decode the binary traces stream <in> into the equivalent text traces
+ * (as they would have been printed without color) into <out>
+ *
+ * Returns 0 on success, -1 if the stream is not a binary trace or is
+ * corrupted (a stream which ends in the middle of a record, e.g. because the
+ * program crashed, is decoded up to that point)
+ */
+int bs_trace_binary_decode(FILE *in, FILE *out){
+  //As printed by bs_trace_vprint():
+  static const char *type_prefixes[] = {"EXIT:", "ERROR:", "WARNING:", "INFO:", "DEBUG:", ""};
+  char magic[BS_TRACE_BIN_MAGIC_LEN];
+  uint32_t version;
+  dec_strs_t strs = { NULL, 0, 0 };
+  char *prefix = NULL;
+  uint8_t *args_buf = NULL;
+  size_t args_alloc = 0;
+  int ret = 0;
+
+  if ( ( read_n(in, magic, sizeof(magic)) != 0 )
+      || ( memcmp(magic, BS_TRACE_BIN_MAGIC, sizeof(magic)) != 0 )
+      || ( read_n(in, &version, sizeof(version)) != 0 )
+      || ( version != BS_TRACE_BIN_VERSION ) ) {
+    bs_trace_warning_line("Input is not a binary trace (version %u)\n", BS_TRACE_BIN_VERSION);
+    return -1;
+  }
+
+  while ( true ) {
+    uint8_t rec_type;
+    if ( read_n(in, &rec_type, 1) != 0 ) {
+      break; //End of the stream
+    }
+    if ( rec_type == REC_STRING ) {
+      uint64_t id;
+      uint32_t len;
+      char *str;
+      if ( ( read_n(in, &id, sizeof(id)) != 0 ) || ( read_n(in, &len, sizeof(len)) != 0 )
+          || ( ( str = read_string(in, len) ) == NULL ) ) {
+        break;
+      }
+      dec_strs_add(&strs, id, str);
+    } else if ( rec_type == REC_PREFIX ) {
+      uint32_t len;
+      char *str;
+      if ( ( read_n(in, &len, sizeof(len)) != 0 ) || ( ( str = read_string(in, len) ) == NULL ) ) {
+        break;
+      }
+      free(prefix);
+      prefix = str;
+    } else if ( rec_type == REC_MSG ) {
+      uint8_t type, level, has_time;
+      uint32_t line, args_len;
+      uint64_t time, format_id, file_id;
+      if ( ( read_n(in, &type, 1) != 0 ) || ( read_n(in, &level, 1) != 0 )
+          || ( read_n(in, &has_time, 1) != 0 ) || ( read_n(in, &line, sizeof(line)) != 0 )
+          || ( read_n(in, &time, sizeof(time)) != 0 )
+          || ( read_n(in, &format_id, sizeof(format_id)) != 0 )
+          || ( read_n(in, &file_id, sizeof(file_id)) != 0 )
+          || ( read_n(in, &args_len, sizeof(args_len)) != 0 ) ) {
+        break;
+      }
+      if ( args_len > args_alloc ) {
+        args_alloc = args_len;
+        args_buf = bs_realloc(args_buf, args_alloc);
+      }
+      if ( read_n(in, args_buf, args_len) != 0 ) {
+        break;
+      }
+      const char *format = dec_strs_get(&strs, format_id);
+      const char *file = file_id ? dec_strs_get(&strs, file_id) : NULL;
+      if ( ( format == NULL ) || ( type >= sizeof(type_prefixes)/sizeof(type_prefixes[0]) ) ) {
+        bs_trace_warning_line("Corrupted binary trace\n");
+        ret = -1;
+        break;
+      }
+
+      char time_s[20] = {0};
+      if ( has_time ) {
+        time_s[0] = ' ';
+        time_s[1] = '@';
+        bs_time_to_str(&time_s[2], time);
+      }
+      fprintf(out, "%s%s %s ", prefix ? prefix : "", time_s, type_prefixes[type]);
+      if ( file_id ) {
+        fprintf(out, "(%s:%u): ", file ? file : "?", line);
+      }
+      args_cursor_t args = { args_buf, args_buf + args_len };
+      decode_message(out, format, &args);
+    } else {
+      bs_trace_warning_line("Corrupted binary trace (unknown record %u)\n", rec_type);
+      ret = -1;
+      break;
+    }
+  }
+
+  for ( size_t i = 0; i < strs.size; i++ ) {
+    free(strs.tab[i].str);
+  }
+  free(strs.tab);
+  free(prefix);
+  free(args_buf);
+  return ret;
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright 2018 Oticon A/S
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * Binary (deferred formatting) traces
+ *
+ * Instead of formatting each trace message, only its raw ingredients are
+ * recorded in a compact binary stream: a reference to its format string,
+ * its type and level, the simulated time, the caller file and line, and the
+ * raw values of its arguments.
+ * Each format string (and caller file name) is written into the stream only
+ * the first time it is used, so the stream is self contained and can be
+ * decoded into the same text the normal traces would have produced, with
+ * bs_trace_binary_decode() (or the bs_trace_decoder tool).
+ *
+ * The same records can be kept instead in a circular buffer in memory (flight
+ * recorder), which is only decoded if needed (see bs_trace_binary_recorder_*())
+ *
+ * Normal users do not use this API directly, but enable binary traces with
+ * the `-trace-bin=<file>` command line option or bs_trace_set_binary_file(),
+ * and the flight recorder with `-trace-recorder=<level>` (see bs_tracing.h)
+ */
+
+#ifndef UTIL_BS_TRACE_BINARY_H
+#define UTIL_BS_TRACE_BINARY_H
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include "bs_types.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+int bs_trace_binary_open(const char *file_name);
+void bs_trace_binary_close(void);
+bool bs_trace_binary_is_open(void);
+void bs_trace_binary_set_prefix(const char *prefix);
+void bs_trace_binary_vrecord(int type, const char *caller_filename, unsigned int caller_line,
+                             int level, bool has_time, bs_time_t time,
+                             const char *format, va_list variable_args);
+int bs_trace_binary_decode(FILE *in, FILE *out);
+void bs_trace_binary_recorder_start(size_t size);
+bool bs_trace_binary_recorder_is_on(void);
+void bs_trace_binary_recorder_record(int type, const char *caller_filename, unsigned int caller_line,
+                                     int level, bool has_time, bs_time_t time,
+                                     const char *format, va_list variable_args);
+int bs_trace_binary_recorder_write(int fd);
+int bs_trace_binary_recorder_dump(FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* UTIL_BS_TRACE_BINARY_H */
@@ -0,0 +1,288 @@
+/*
+ * Copyright 2018 Oticon A/S
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * Trace collection, producer side: see bs_trace_collect.h
+ *
+ * The ring is a single producer, single consumer byte ring in an mmap'ed
+ * file. Complete records are copied in and only then published by advancing
+ * <head>, so the collector never sees half records.
+ * If the ring is full, the producer waits for the collector to make space.
+ * If the collector is gone (or never appears), collection is stopped and
+ * traces are printed normally again.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "bs_trace_collect.h"
+#include "bs_tracing.h"
+#include "bs_oswrap.h"
+#include "bs_utils.h"
+
+#define BS_TRACE_COLLECT_ATTACH_WAIT_MS 5000 //How long to wait for a collector to attach if the ring gets full before that
+
+static bs_trace_ring_hdr_t *ring;
+static size_t ring_map_size;
+static char *ring_path;
+static uint32_t ring_mask;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static bs_time_t last_time; //Time of the last record (used for traces without time)
+static bool collect_requested;
+
+/**
+ * Return the folder where the trace rings of the simulation <s_id> are
+ * placed (/tmp/bs_<user>/<s_id>/traces, next to the libPhyCom com folder),
+ * creating it if needed
+ * The caller shall free() the returned string
+ */
+char *bs_trace_collect_dir(const char *s_id) {
+  struct passwd *pw = getpwuid(geteuid());
+  char *user = ( pw != NULL ) ? pw->pw_name : getenv("LOGNAME");
+  char uid_s[16];
+  if ( user == NULL ) {
+    user = getenv("USER");
+  }
+  if ( user == NULL ) {
+    sprintf(uid_s, "%i", (int)geteuid());
+    user = uid_s;
+  }
+
+  char *path = bs_calloc(strlen(user) + strlen(s_id) + 24, sizeof(char));
+  sprintf(path, "/tmp/bs_%s/%s/traces/", user, s_id);
+  if ( bs_create_folders_in_path(path) != 0 ) {
+    bs_trace_error_line("Couldn't create trace collection folder %s\n", path);
+  }
+  path[strlen(path) - 1] = 0;
+  return path;
+}
+
+static void collect_atexit(void) {
+  bs_trace_collect_stop();
+}
+
+/**
+ * Start placing this process traces in a ring for the collector, for
+ * device number <dev_nbr> of the simulation <s_id>
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int bs_trace_collect_start(const char *s_id, unsigned int dev_nbr) {
+  static bool atexit_set;
+  uint32_t capacity = BS_TRACE_RING_DEF_CAPACITY;
+  size_t size = sizeof(bs_trace_ring_hdr_t) + capacity;
+
+  bs_trace_collect_stop();
+
+  char *dir = bs_trace_collect_dir(s_id);
+  char *path = bs_calloc(strlen(dir) + 32, sizeof(char));
+  char tmp_path[strlen(dir) + 64];
+  sprintf(path, "%s/d_%u%s", dir, dev_nbr, BS_TRACE_RING_EXT);
+  sprintf(tmp_path, "%s/d_%u.%li.tmp", dir, dev_nbr, (long)getpid());
+  free(dir);
+
+  int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+  if ( fd == -1 ) {
+    bs_trace_warning_line("Can not create %s (errno=%i)\n", tmp_path, errno);
+    free(path);
+    return -1;
+  }
+  void *ptr = MAP_FAILED;
+  if ( ftruncate(fd, size) == 0 ) {
+    ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd); /* The mapping stays valid */
+  if ( ptr == MAP_FAILED ) {
+    bs_trace_warning_line("Can not size/map %s (errno=%i)\n", tmp_path, errno);
+    remove(tmp_path);
+    free(path);
+    return -1;
+  }
+
+  bs_trace_ring_hdr_t *hdr = ptr;
+  hdr->capacity = capacity;
+  hdr->writer_pid = getpid();
+  __atomic_store_n(&hdr->magic, BS_TRACE_RING_MAGIC, __ATOMIC_RELEASE);
+
+  if ( rename(tmp_path, path) != 0 ) {
+    bs_trace_warning_line("Can not rename %s into %s (errno=%i)\n", tmp_path, path, errno);
+    munmap(ptr, size);
+    remove(tmp_path);
+    free(path);
+    return -1;
+  }
+
+  pthread_mutex_lock(&ring_lock);
+  ring = hdr;
+  ring_path = path;
+  ring_map_size = size;
+  ring_mask = capacity - 1;
+  pthread_mutex_unlock(&ring_lock);
+
+  if ( !atexit_set ) {
+    atexit_set = true;
+    atexit(collect_atexit);
+  }
+  return 0;
+}
+
+static void copy_out(uint64_t pos, void *dst, size_t n) {
+  size_t off = pos & ring_mask;
+  size_t first = ring->capacity - off;
+  if ( n <= first ) {
+    memcpy(dst, &ring->data[off], n);
+  } else {
+    memcpy(dst, &ring->data[off], first);
+    memcpy((uint8_t *)dst + first, ring->data, n - first);
+  }
+}
+
+/*
+ * Print the traces still in the ring, which no collector will read
+ * (ring_lock must be held)
+ */
+static void ring_print_pending(void) {
+  bs_trace_ring_rec_t rec;
+  char *line = NULL;
+  size_t line_size = 0;
+  for ( uint64_t tail = ring->tail; tail != ring->head; tail += sizeof(rec) + rec.len ) {
+    copy_out(tail, &rec, sizeof(rec));
+    if ( rec.len > line_size ) {
+      line_size = rec.len;
+      line = bs_realloc(line, line_size);
+    }
+    copy_out(tail + sizeof(rec), line, rec.len);
+    fwrite(line, 1, rec.len, stdout);
+  }
+  free(line);
+}
+
+/**
+ * Stop placing traces in the ring, marking it as closed
+ * (the collector removes it once it has read everything)
+ * If no collector attached to it, what is in it is printed and the ring is
+ * removed now, so no collector started later picks these old traces
+ */
+void bs_trace_collect_stop(void) {
+  pthread_mutex_lock(&ring_lock);
+  if ( ring != NULL ) {
+    int32_t no_reader = 0;
+    __atomic_store_n(&ring->writer_closed, 1, __ATOMIC_RELEASE);
+    //Claim it ourselves, so no collector attaches while we remove it
+    if ( __atomic_compare_exchange_n(&ring->reader_pid, &no_reader, getpid(), false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ) {
+      ring_print_pending();
+      remove(ring_path);
+    }
+    munmap(ring, ring_map_size);
+    free(ring_path);
+    ring = NULL;
+    ring_path = NULL;
+  }
+  pthread_mutex_unlock(&ring_lock);
+}
+
+bool bs_trace_collect_is_on(void) {
+  return ring != NULL;
+}
+
+static void copy_in(uint64_t pos, const void *src, size_t n) {
+  size_t off = pos & ring_mask;
+  size_t first = ring->capacity - off;
+  if ( n <= first ) {
+    memcpy(&ring->data[off], src, n);
+  } else {
+    memcpy(&ring->data[off], src, first);
+    memcpy(ring->data, (const uint8_t *)src + first, n - first);
+  }
+}
+
+/*
+ * Is the collector gone, or has it not attached after waiting for
+ * <waited_ms>
+ */
+static bool collector_lost(uint waited_ms) {
+  if ( __atomic_load_n(&ring->reader_closed, __ATOMIC_ACQUIRE) ) {
+    return true;
+  }
+  int32_t pid = __atomic_load_n(&ring->reader_pid, __ATOMIC_ACQUIRE);
+  if ( pid == 0 ) {
+    return waited_ms >= BS_TRACE_COLLECT_ATTACH_WAIT_MS;
+  }
+  return ( kill(pid, 0) != 0 ) && ( errno == ESRCH );
+}
+
+/**
+ * Place the trace line <line> (of <len> bytes) with simulated time <time>
+ * (TIME_NEVER if unknown) in the ring
+ *
+ * Returns 0 on success, -1 if it was not placed because collection is not on,
+ * or -2 if collection was just stopped because the collector is gone.
+ * If not placed, the caller should print it itself
+ */
+int bs_trace_collect_put(bs_time_t time, const char *line, size_t len) {
+  const struct timespec wait = {0, 100000};
+  uint waited_us = 0;
+
+  pthread_mutex_lock(&ring_lock);
+  if ( ring == NULL ) {
+    pthread_mutex_unlock(&ring_lock);
+    return -1;
+  }
+
+  if ( time == TIME_NEVER ) {
+    time = last_time;
+  }
+  last_time = time;
+
+  len = BS_MIN(len, ring->capacity - sizeof(bs_trace_ring_rec_t));
+  bs_trace_ring_rec_t rec = { len, 0, time };
+  size_t total = sizeof(rec) + len;
+  uint64_t head = ring->head;
+
+  while ( ring->capacity - ( head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) ) < total ) {
+    if ( collector_lost(waited_us/1000) ) {
+      pthread_mutex_unlock(&ring_lock);
+      bs_trace_collect_stop();
+      return -2;
+    }
+    nanosleep(&wait, NULL);
+    waited_us += wait.tv_nsec/1000;
+  }
+
+  copy_in(head, &rec, sizeof(rec));
+  copy_in(head + sizeof(rec), line, len);
+  __atomic_store_n(&ring->head, head + total, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&ring_lock);
+  return 0;
+}
+
+/*
+ * Command line switch callback to request trace collection
+ */
+void bs_trace_collect_found(char * argv, int offset) {
+  collect_requested = true;
+}
+
+/**
+ * Was trace collection requested in the command line?
+ * (collection is started by the program, once it knows its simulation id
+ * and device number, with bs_trace_collect_start())
+ */
+bool bs_trace_collect_requested(void) {
+  return collect_requested;
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright 2018 Oticon A/S
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * Trace collection
+ *
+ * Instead of printing its traces, each process can place them, stamped with
+ * their simulated time, in its own shared memory (mmap'ed file) ring, in the
+ * simulation trace folder (see bs_trace_collect_dir()).
+ * The bs_trace_collector tool reads all these rings and merges them, by
+ * simulated time, into one ordered output while the simulation runs.
+ *
+ * Normal users do not use this API directly, but enable it with the
+ * `-trace-collect` command line option.
+ */
+
+#ifndef UTIL_BS_TRACE_COLLECT_H
+#define UTIL_BS_TRACE_COLLECT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "bs_types.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+#define BS_TRACE_RING_MAGIC 0x52544342 /* "BCTR" */
+#define BS_TRACE_RING_DEF_CAPACITY (4*1024*1024)
+#define BS_TRACE_RING_CACHE_LINE 64
+#define BS_TRACE_RING_EXT ".trace_ring"
+
+/*
+ * Header placed at the start of each ring file.
+ * The producer (the process which traces) creates the ring, and only writes
+ * <head> & <writer_closed>, the collector only <tail>, <reader_pid> & <reader_closed>.
+ * Each lives in its own cache line.
+ */
+typedef struct {
+  uint32_t magic; /* Set (last) by the producer once the ring is initialized */
+  uint32_t capacity; /* Size of the data area, a power of 2 */
+  int32_t writer_pid; /* Process which created (and writes into) the ring */
+  uint8_t pad0[BS_TRACE_RING_CACHE_LINE - 3*sizeof(uint32_t)];
+
+  uint64_t head; /* Total number of bytes ever written */
+  uint32_t writer_closed;
+  uint8_t pad1[BS_TRACE_RING_CACHE_LINE - sizeof(uint64_t) - sizeof(uint32_t)];
+
+  uint64_t tail; /* Total number of bytes ever read */
+  int32_t reader_pid; /* Collector process which attached to the ring (0 if none yet).
+                       * The producer sets its own pid if it closes the ring before any attached */
+  uint32_t reader_closed; /* The collector stopped reading */
+  uint8_t pad2[BS_TRACE_RING_CACHE_LINE - sizeof(uint64_t) - 2*sizeof(uint32_t)];
+
+  uint8_t data[];
+} bs_trace_ring_hdr_t;
+
+/*
+ * Each trace in the ring: this header followed by <len> bytes of the
+ * (complete) trace line
+ */
+typedef struct {
+  uint32_t len;
+  uint32_t reserved;
+  bs_time_t time;
+} bs_trace_ring_rec_t;
+
+char *bs_trace_collect_dir(const char *s_id);
+int bs_trace_collect_start(const char *s_id, unsigned int dev_nbr);
+void bs_trace_collect_stop(void);
+bool bs_trace_collect_is_on(void);
+int bs_trace_collect_put(bs_time_t time, const char *line, size_t len);
+void bs_trace_collect_found(char * argv, int offset);
+bool bs_trace_collect_requested(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* UTIL_BS_TRACE_COLLECT_H */
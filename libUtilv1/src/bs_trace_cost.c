@@ -0,0 +1,221 @@
+/*
+ * Copyright 2018 Oticon A/S
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * Trace cost accounting: see bs_trace_cost.h
+ *
+ * Call sites are kept in an open addressing hash table keyed by the format
+ * string address (and caller line, as the same format may be used from
+ * several places). As the format may not outlive the call (e.g. a
+ * reused buffer), the start of its text is copied when the site is found.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "bs_trace_cost.h"
+#include "bs_tracing.h"
+#include "bs_oswrap.h"
+#include "bs_utils.h"
+
+#define BS_TRACE_COST_FORMAT_LEN 48 //How much of each format is shown in the report
+
+typedef struct {
+  const char *format; //Only used as key, not dereferenced
+  char text[BS_TRACE_COST_FORMAT_LEN + 1]; //Copy of the start of the format
+  bool truncated; //The format was longer than BS_TRACE_COST_FORMAT_LEN
+  const char *file;
+  unsigned int line;
+  uint64_t issued;
+  uint64_t printed;
+  uint64_t bytes;
+  uint64_t time_ns;
+} cost_site_t;
+
+static cost_site_t *sites;
+static size_t sites_size; //A power of 2
+static size_t sites_used;
+static pthread_mutex_t cost_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool cost_on;
+static char *report_file; //NULL: stderr
+
+static inline size_t site_hash(const char *format, unsigned int line){
+  uint64_t h = ( (uintptr_t)format + line ) * 0x9E3779B97F4A7C15ULL;
+  return (size_t)(h >> 32) & ( sites_size - 1 );
+}
+
+static void sites_grow(void){
+  cost_site_t *old = sites;
+  size_t old_size = sites_size;
+
+  sites_size = old_size ? 2*old_size : 256;
+  sites = bs_calloc(sites_size, sizeof(cost_site_t));
+  for ( size_t i = 0; i < old_size; i++ ) {
+    if ( old[i].format != NULL ) {
+      size_t j = site_hash(old[i].format, old[i].line);
+      while ( sites[j].format != NULL ) {
+        j = ( j + 1 ) & ( sites_size - 1 );
+      }
+      sites[j] = old[i];
+    }
+  }
+  free(old);
+}
+
+static void cost_atexit(void){
+  FILE *out = stderr;
+  if ( report_file != NULL ) {
+    out = fopen(report_file, "w");
+    if ( out == NULL ) {
+      bs_trace_warning_line("Could not open %s, printing the trace cost report to stderr\n", report_file);
+      out = stderr;
+    }
+  }
+  bs_trace_cost_report(out);
+  if ( out != stderr ) {
+    fclose(out);
+    fprintf(stderr, "Trace cost report written into %s\n", report_file);
+  }
+}
+
+/**
+ * Start accounting the cost of each trace call site
+ * (the report is printed at exit)
+ */
+void bs_trace_cost_start(void){
+  if ( !cost_on ) {
+    cost_on = true;
+    atexit(cost_atexit);
+  }
+}
+
+bool bs_trace_cost_is_on(void){
+  return cost_on;
+}
+
+/**
+ * Current time in ns (to measure how long printing takes)
+ */
+uint64_t bs_trace_cost_now(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Account one message issued from the call site <format>, <caller_filename>:<caller_line>
+ * which was <printed> (taking <bytes> and <time_ns>) or filtered out
+ */
+void bs_trace_cost_count(const char *format, const char *caller_filename, unsigned int caller_line,
+                         bool printed, size_t bytes, uint64_t time_ns){
+  pthread_mutex_lock(&cost_lock);
+  if ( 2*( sites_used + 1 ) > sites_size ) {
+    sites_grow();
+  }
+  size_t i = site_hash(format, caller_line);
+  while ( ( sites[i].format != NULL )
+         && ( ( sites[i].format != format ) || ( sites[i].line != caller_line ) ) ) {
+    i = ( i + 1 ) & ( sites_size - 1 );
+  }
+  cost_site_t *site = &sites[i];
+  if ( site->format == NULL ) {
+    sites_used++;
+    site->format = format;
+    size_t len = strnlen(format, BS_TRACE_COST_FORMAT_LEN + 1);
+    site->truncated = ( len > BS_TRACE_COST_FORMAT_LEN );
+    len = BS_MIN(len, BS_TRACE_COST_FORMAT_LEN);
+    memcpy(site->text, format, len);
+    site->text[len] = 0;
+    site->file = caller_filename;
+    site->line = caller_line;
+  }
+  site->issued++;
+  if ( printed ) {
+    site->printed++;
+    site->bytes += bytes;
+    site->time_ns += time_ns;
+  }
+  pthread_mutex_unlock(&cost_lock);
+}
+
+/**
+ * Set the file the report is written into at exit (by default stderr)
+ */
+void bs_trace_cost_set_report_file(const char *file_name){
+  free(report_file);
+  report_file = NULL;
+  if ( file_name != NULL ) {
+    report_file = bs_calloc(strlen(file_name) + 1, sizeof(char));
+    strcpy(report_file, file_name);
+  }
+}
+
+static int site_cmp(const void *a, const void *b){
+  const cost_site_t *sa = a, *sb = b;
+  if ( sa->bytes != sb->bytes ) {
+    return ( sa->bytes < sb->bytes ) ? 1 : -1;
+  }
+  if ( sa->time_ns != sb->time_ns ) {
+    return ( sa->time_ns < sb->time_ns ) ? 1 : -1;
+  }
+  return ( sa->issued < sb->issued ) - ( sa->issued > sb->issued );
+}
+
+/*
+ * Print the format copy of site <s> in one line, escaped
+ */
+static void print_format(FILE *out, const cost_site_t *s){
+  fputc('"', out);
+  for ( const char *p = s->text; *p != 0; p++ ) {
+    switch ( *p ) {
+      case '\n': fputs("\\n", out); break;
+      case '\t': fputs("\\t", out); break;
+      case '"': fputs("\\\"", out); break;
+      default: fputc(*p, out); break;
+    }
+  }
+  fputs(s->truncated ? "\"..." : "\"", out);
+}
+
+/**
+ * Print the report of the cost of each call site into <out>
+ */
+void bs_trace_cost_report(FILE *out){
+  pthread_mutex_lock(&cost_lock);
+  cost_site_t *sorted = bs_malloc(BS_MAX(sites_used, 1)*sizeof(cost_site_t));
+  size_t n = 0;
+  uint64_t total_bytes = 0, total_time = 0;
+  for ( size_t i = 0; i < sites_size; i++ ) {
+    if ( sites[i].format != NULL ) {
+      sorted[n++] = sites[i];
+      total_bytes += sites[i].bytes;
+      total_time += sites[i].time_ns;
+    }
+  }
+  pthread_mutex_unlock(&cost_lock);
+
+  qsort(sorted, n, sizeof(cost_site_t), site_cmp);
+  fprintf(out, "---- Trace cost per call site (%zu sites, %"PRIu64" bytes, %.3f ms) ----\n",
+          n, total_bytes, total_time/1e6);
+  fprintf(out, "%12s %12s %12s %14s %6s %12s  %s\n",
+          "issued", "printed", "filtered", "bytes", "%", "time(ms)", "call site");
+  for ( size_t i = 0; i < n; i++ ) {
+    cost_site_t *s = &sorted[i];
+    fprintf(out, "%12"PRIu64" %12"PRIu64" %12"PRIu64" %14"PRIu64" %6.2f %12.3f  ",
+            s->issued, s->printed, s->issued - s->printed, s->bytes,
+            total_bytes ? 100.0*s->bytes/total_bytes : 0.0, s->time_ns/1e6);
+    if ( s->file != NULL ) {
+      fprintf(out, "%s:%u ", s->file, s->line);
+    }
+    print_format(out, s);
+    fputc('\n', out);
+  }
+  free(sorted);
+}
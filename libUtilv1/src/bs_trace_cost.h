@@ -0,0 +1,43 @@
+/*
+ * Copyright 2018 Oticon A/S
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * Trace cost accounting
+ *
+ * When enabled, each trace call site (identified by its format string, and
+ * caller file and line if known) gets counters: messages issued, printed and
+ * filtered out, bytes printed and time spent printing them (formatting and
+ * output). A report, sorted by bytes and then by time, is printed at exit.
+ *
+ * Normal users do not use this API directly, but enable it with the
+ * `-trace-cost` command line option (see bs_tracing.h)
+ */
+
+#ifndef UTIL_BS_TRACE_COST_H
+#define UTIL_BS_TRACE_COST_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+void bs_trace_cost_start(void);
+bool bs_trace_cost_is_on(void);
+uint64_t bs_trace_cost_now(void);
+void bs_trace_cost_count(const char *format, const char *caller_filename, unsigned int caller_line,
+                         bool printed, size_t bytes, uint64_t time_ns);
+void bs_trace_cost_set_report_file(const char *file_name);
+void bs_trace_cost_report(FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* UTIL_BS_TRACE_COST_H */
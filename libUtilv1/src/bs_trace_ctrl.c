@@ -0,0 +1,187 @@
+/*
+ * Copyright 2018 Oticon A/S
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * Runtime trace level control, process side: see bs_trace_ctrl.h
+ *
+ * The new levels are applied directly in the signal handler: this only
+ * stores integers the trace macros read, and updates the published levels,
+ * neither of which allocates, locks or prints.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "bs_trace_ctrl.h"
+#include "bs_trace_collect.h"
+#include "bs_tracing.h"
+#include "bs_oswrap.h"
+#include "bs_utils.h"
+
+static bs_trace_ctrl_block_t *block;
+static char *block_path;
+static bool ctrl_requested;
+
+static void ctrl_signal_handler(int sig) {
+  int saved_errno = errno;
+  bs_trace_ctrl_block_t *b = block;
+
+  if ( b != NULL ) {
+    int32_t level = __atomic_exchange_n(&b->req_level, BS_TRACE_CTRL_KEEP, __ATOMIC_ACQ_REL);
+    if ( level != BS_TRACE_CTRL_KEEP ) {
+      bs_trace_set_level(level);
+    }
+    for ( int i = 0; i < bs_trace_category_count(); i++ ) {
+      level = __atomic_exchange_n(&b->req_cat_levels[i], BS_TRACE_CTRL_KEEP, __ATOMIC_ACQ_REL);
+      if ( level != BS_TRACE_CTRL_KEEP ) {
+        bs_trace_set_category_id_level(i, level);
+      }
+    }
+    bs_trace_ctrl_publish();
+  }
+  errno = saved_errno;
+}
+
+static void ctrl_atexit(void) {
+  bs_trace_ctrl_stop();
+}
+
+/**
+ * Publish this process trace levels in a control block for device number
+ * <dev_nbr> of the simulation <s_id>, and start accepting new levels from
+ * the bs_trace_ctrl tool
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int bs_trace_ctrl_start(const char *s_id, unsigned int dev_nbr) {
+  static bool atexit_set;
+  struct sigaction act, old;
+
+  bs_trace_ctrl_stop();
+
+  if ( ( sigaction(BS_TRACE_CTRL_SIGNAL, NULL, &old) != 0 ) || ( old.sa_handler != SIG_DFL ) ) {
+    bs_trace_warning_line("The program already handles signal %i, runtime trace control is not available\n",
+                          BS_TRACE_CTRL_SIGNAL);
+    return -1;
+  }
+
+  char *dir = bs_trace_collect_dir(s_id);
+  char *path = bs_calloc(strlen(dir) + 32, sizeof(char));
+  char tmp_path[strlen(dir) + 64];
+  sprintf(path, "%s/d_%u%s", dir, dev_nbr, BS_TRACE_CTRL_EXT);
+  sprintf(tmp_path, "%s/d_%u.%li.ctrl_tmp", dir, dev_nbr, (long)getpid());
+  free(dir);
+
+  int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+  if ( fd == -1 ) {
+    bs_trace_warning_line("Can not create %s (errno=%i)\n", tmp_path, errno);
+    free(path);
+    return -1;
+  }
+  void *ptr = MAP_FAILED;
+  if ( ftruncate(fd, sizeof(bs_trace_ctrl_block_t)) == 0 ) {
+    ptr = mmap(NULL, sizeof(bs_trace_ctrl_block_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if ( ptr == MAP_FAILED ) {
+    bs_trace_warning_line("Can not size/map %s (errno=%i)\n", tmp_path, errno);
+    remove(tmp_path);
+    free(path);
+    return -1;
+  }
+
+  bs_trace_ctrl_block_t *b = ptr;
+  b->pid = getpid();
+  b->req_level = BS_TRACE_CTRL_KEEP;
+  for ( int i = 0; i < BS_TRACE_MAX_CATEGORIES; i++ ) {
+    b->req_cat_levels[i] = BS_TRACE_CTRL_KEEP;
+  }
+
+  if ( rename(tmp_path, path) != 0 ) {
+    bs_trace_warning_line("Can not rename %s into %s (errno=%i)\n", tmp_path, path, errno);
+    munmap(ptr, sizeof(bs_trace_ctrl_block_t));
+    remove(tmp_path);
+    free(path);
+    return -1;
+  }
+  block_path = path;
+  block = b;
+  bs_trace_ctrl_publish();
+  __atomic_store_n(&b->magic, BS_TRACE_CTRL_MAGIC, __ATOMIC_RELEASE);
+
+  memset(&act, 0, sizeof(act));
+  act.sa_handler = ctrl_signal_handler;
+  act.sa_flags = SA_RESTART;
+  sigemptyset(&act.sa_mask);
+  sigaction(BS_TRACE_CTRL_SIGNAL, &act, NULL);
+
+  if ( !atexit_set ) {
+    atexit_set = true;
+    atexit(ctrl_atexit);
+  }
+  return 0;
+}
+
+/**
+ * Stop accepting new levels, and remove the control block
+ */
+void bs_trace_ctrl_stop(void) {
+  bs_trace_ctrl_block_t *b = block;
+  if ( b == NULL ) {
+    return;
+  }
+  signal(BS_TRACE_CTRL_SIGNAL, SIG_IGN); //A late request is just ignored
+  block = NULL;
+  munmap(b, sizeof(bs_trace_ctrl_block_t));
+  remove(block_path);
+  free(block_path);
+  block_path = NULL;
+}
+
+/**
+ * Update the levels published in the control block (if any)
+ * (called by the tracing functions whenever a level changes or a category is added)
+ */
+void bs_trace_ctrl_publish(void) {
+  bs_trace_ctrl_block_t *b = block;
+  if ( b == NULL ) {
+    return;
+  }
+  int n = bs_trace_category_count();
+  for ( int i = 0; i < n; i++ ) {
+    const char *name = bs_trace_category_name(i);
+    size_t len = BS_MIN(strlen(name), BS_TRACE_CTRL_NAME_LEN - 1);
+    memcpy(b->cats[i].name, name, len);
+    b->cats[i].name[len] = 0;
+    b->cats[i].level = bs_trace_category_level(i);
+  }
+  b->n_cats = n;
+  b->level = bs_trace_get_level();
+  __atomic_add_fetch(&b->seq, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Command line switch callback to request runtime trace control
+ */
+void bs_trace_ctrl_found(char * argv, int offset) {
+  ctrl_requested = true;
+}
+
+/**
+ * Was runtime trace control requested in the command line?
+ * (it is started by the program, once it knows its simulation id
+ * and device number, with bs_trace_ctrl_start())
+ */
+bool bs_trace_ctrl_requested(void) {
+  return ctrl_requested;
+}
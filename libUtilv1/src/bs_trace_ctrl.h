@@ -0,0 +1,69 @@
+/*
+ * Copyright 2018 Oticon A/S
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * Runtime trace level control
+ *
+ * A process can publish its trace levels (global and of each trace category)
+ * in a small shared memory (mmap'ed file) control block in the simulation
+ * trace folder (see bs_trace_collect_dir()).
+ * The bs_trace_ctrl tool places new levels in the block and signals the
+ * process (SIGUSR1), which then applies them, so the verbosity can be changed
+ * while the simulation runs.
+ *
+ * Normal users do not use this API directly, but enable it with the
+ * `-trace-ctrl` command line option.
+ */
+
+#ifndef UTIL_BS_TRACE_CTRL_H
+#define UTIL_BS_TRACE_CTRL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <signal.h>
+#include "bs_tracing.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+#define BS_TRACE_CTRL_MAGIC 0x4C525443 /* "CTRL" */
+#define BS_TRACE_CTRL_EXT ".trace_ctrl"
+#define BS_TRACE_CTRL_SIGNAL SIGUSR1
+#define BS_TRACE_CTRL_NAME_LEN 32
+#define BS_TRACE_CTRL_KEEP -1 /* In the requests: do not change this level */
+
+/*
+ * Control block, placed in the control file.
+ * The process writes <magic>..<cats>, the tool only the requests, which the
+ * process resets to BS_TRACE_CTRL_KEEP once it has applied them.
+ */
+typedef struct {
+  uint32_t magic; /* Set (last) by the process once the block is initialized */
+  int32_t pid; /* Process which owns the block */
+  uint32_t seq; /* Incremented each time the process updates the published levels */
+  int32_t level; /* Current global level */
+  uint32_t n_cats;
+  struct {
+    char name[BS_TRACE_CTRL_NAME_LEN];
+    int32_t level;
+  } cats[BS_TRACE_MAX_CATEGORIES];
+
+  int32_t req_level;
+  int32_t req_cat_levels[BS_TRACE_MAX_CATEGORIES];
+} bs_trace_ctrl_block_t;
+
+int bs_trace_ctrl_start(const char *s_id, unsigned int dev_nbr);
+void bs_trace_ctrl_stop(void);
+void bs_trace_ctrl_publish(void);
+void bs_trace_ctrl_found(char * argv, int offset);
+bool bs_trace_ctrl_requested(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* UTIL_BS_TRACE_CTRL_H */
@@ -10,22 +10,31 @@
 #include <stdarg.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
 
 #include "bs_tracing.h"
 #include "bs_types.h"
 #include "bs_utils.h"
 #include "bs_oswrap.h"
 #include "bs_symbols.h"
+#include "bs_trace_binary.h"
+#include "bs_trace_collect.h"
+#include "bs_trace_ctrl.h"
+#include "bs_trace_cost.h"
 
 static int is_a_tty[2] = {-1,-1}; //-1 = we do not know yet ; Indexed 0:stdout, 1:stderr
 
-static int trace_level = 0;
+int bs_trace_level = 0; //Current tracing level (read directly by the bs_trace_ macros)
 static main_cleanup_f main_cleanup_fpr = NULL; //Function from the application which will be called on exit or error
 static time_f time_fpr = NULL; //Function from the application to get the current time
 
 #define MAX_PREFIX_LEN 40
 static char prefix_s[MAX_PREFIX_LEN]="?_??:"; //In case somebody throws messages before initializing the prefix we initialize it to this (will happen if verbosity is high, during command line parsing)
 static char prefix_s_color[MAX_PREFIX_LEN]="?_??:"; //like prefix_s, but with colors
+static bool line_heads_valid; //The cached start of the trace lines is up to date with the prefixes
 
 void bs_trace_disable_color(char * argv, int offset){
   is_a_tty[0] = 0;
@@ -51,12 +60,310 @@ int bs_trace_is_tty(int file_index){
   return is_a_tty[file_index];
 }
 
+/*
+ * Trace categories: each with its own name and level.
+ * Categories without an explicitly set level follow the global one.
+ */
+int bs_trace_cat_levels[BS_TRACE_MAX_CATEGORIES]; //Current level of each category (read directly by the bs_trace_cat_ macros)
+static char *cat_names[BS_TRACE_MAX_CATEGORIES];
+static bool cat_level_set[BS_TRACE_MAX_CATEGORIES]; //The level was set explicitly for this category
+static int cat_set_levels[BS_TRACE_MAX_CATEGORIES]; //The level explicitly set for this category
+static int n_cats;
+
+/*
+ * Simulated time window: inside [window_from, window_to] the level is raised
+ * to window_level. Until the window has passed, bs_trace_level is kept at the
+ * raised level (so the trace macros let those messages thru), and they are
+ * dropped here (without formatting them) while the window is not open.
+ * The window is opened and closed when a message reaches the library with
+ * the simulated time past window_switch.
+ */
+#define BS_TRACE_WINDOW_DEF_LEVEL 9 //Level inside the window if only its times are given
+#define BS_TRACE_RECORDER_DEF_SIZE (1024*1024)
+static int base_level; //Level set with -v/bs_trace_set_level()
+static int window_level = -1; //-1: no window
+static bs_time_t window_from = 0;
+static bs_time_t window_to = TIME_NEVER;
+static bool window_open; //Messages up to window_level are printed
+static bs_time_t window_switch = TIME_NEVER; //Time at which the window opens or closes next (TIME_NEVER once passed)
+
+/*
+ * Flight recorder: messages up to recorder_level are recorded unformatted
+ * in memory, whatever the printing level (see bs_trace_set_flight_recorder()).
+ * bs_trace_level is raised to it, and the messages over the printing level
+ * are then only recorded.
+ */
+static int recorder_level = -1; //-1: off
+static char *recorder_file; //Where to dump it (NULL: stderr)
+static size_t recorder_size = BS_TRACE_RECORDER_DEF_SIZE;
+static int crash_fd = -1; //Pre-opened file the recorder is dumped into (raw) on a crash
+static char *crash_file;
+static char *crash_msg; //Printed on a crash (after the prefix)
+
+/*
+ * Messages up to this level need to reach the library whatever the tracing
+ * level: for the flight recorder, or all of them to account their cost
+ * (see bs_trace_cost.h)
+ */
+static inline int lib_level(void) {
+  return bs_trace_cost_is_on() ? INT_MAX : recorder_level;
+}
+
+/*
+ * Note: This function (and bs_trace_set_category_id_level()) are also called
+ * from a signal handler (see bs_trace_ctrl.c), so they shall not allocate or print
+ */
 void bs_trace_set_level(int new_trace_level) {
-  trace_level = BS_MAX(new_trace_level,0);
+  int level = base_level = BS_MAX(new_trace_level,0);
+  if ( ( window_level >= 0 ) && ( window_open || ( window_switch != TIME_NEVER ) ) ) {
+    level = BS_MAX(level, window_level);
+  }
+  bs_trace_level = BS_MAX(level, lib_level());
+  for ( int i = 0; i < n_cats; i++ ) {
+    if ( cat_level_set[i] ) {
+      bs_trace_cat_levels[i] = BS_MAX(cat_set_levels[i], lib_level());
+    } else {
+      bs_trace_cat_levels[i] = bs_trace_level;
+    }
+  }
+  bs_trace_ctrl_publish();
+}
+
+/**
+ * Current tracing level (as set with -v/bs_trace_set_level(), not
+ * counting a time window or the flight recorder)
+ */
+int bs_trace_get_level(void) {
+  return base_level;
+}
+
+static int cat_find_or_add(const char *name) {
+  for ( int i = 0; i < n_cats; i++ ) {
+    if ( strcmp(cat_names[i], name) == 0 ) {
+      return i;
+    }
+  }
+  if ( n_cats >= BS_TRACE_MAX_CATEGORIES ) {
+    bs_trace_error_line("Too many trace categories (max %i), cannot add %s\n",
+                        BS_TRACE_MAX_CATEGORIES, name);
+  }
+  cat_names[n_cats] = bs_calloc(strlen(name) + 1, 1);
+  strcpy(cat_names[n_cats], name);
+  bs_trace_cat_levels[n_cats] = bs_trace_level;
+  n_cats++;
+  bs_trace_ctrl_publish();
+  return n_cats - 1;
+}
+
+/**
+ * Register a trace category called <name>, and return its identifier
+ * (to be used with the bs_trace_cat_ macros)
+ *
+ * Registering the same name again returns the same identifier.
+ * If a level was already set for this name (for ex. from the command line),
+ * it is kept.
+ */
+int bs_trace_register_category(const char *name) {
+  return cat_find_or_add(name);
+}
+
+/**
+ * Set the tracing level of the category called <name> (even if it is not
+ * registered yet)
+ */
+void bs_trace_set_category_level(const char *name, int level) {
+  bs_trace_set_category_id_level(cat_find_or_add(name), level);
+}
+
+/**
+ * Set the tracing level of the (registered) category <cat>
+ */
+void bs_trace_set_category_id_level(int cat, int level) {
+  if ( ( cat < 0 ) || ( cat >= n_cats ) ) {
+    return;
+  }
+  cat_set_levels[cat] = BS_MAX(level, 0);
+  cat_level_set[cat] = true;
+  bs_trace_cat_levels[cat] = BS_MAX(cat_set_levels[cat], lib_level());
+  bs_trace_ctrl_publish();
+}
+
+/**
+ * Current tracing level of the category <cat> (as set with -vmod, or
+ * following the global one). The global one for an unknown category
+ */
+int bs_trace_category_level(int cat) {
+  if ( ( cat < 0 ) || ( cat >= n_cats ) ) {
+    return base_level;
+  }
+  return cat_level_set[cat] ? cat_set_levels[cat] : base_level;
+}
+
+/**
+ * Number of registered trace categories (their identifiers go from 0 to this - 1)
+ */
+int bs_trace_category_count(void) {
+  return n_cats;
+}
+
+/**
+ * Name of the trace category <cat> (NULL if there is no such category)
+ */
+const char *bs_trace_category_name(int cat) {
+  if ( ( cat < 0 ) || ( cat >= n_cats ) ) {
+    return NULL;
+  }
+  return cat_names[cat];
+}
+
+/*
+ * Command line option callback to set the level of categories
+ * The option value is a comma separated list of <name>:<level>
+ */
+void bs_trace_vmod_found(char * argv, int offset) {
+  char *list = &argv[offset];
+
+  while ( *list != 0 ) {
+    size_t len = strcspn(list, ",");
+    char item[len + 1];
+    memcpy(item, list, len);
+    item[len] = 0;
+    list += len;
+    if ( *list == ',' ) {
+      list++;
+    }
+    if ( len == 0 ) {
+      continue;
+    }
+
+    char *colon = strrchr(item, ':');
+    char *end = NULL;
+    long level = 0;
+    if ( colon != NULL ) {
+      level = strtol(colon + 1, &end, 10);
+    }
+    if ( ( colon == NULL ) || ( colon == item ) || ( end == colon + 1 ) || ( *end != 0 ) ) {
+      bs_trace_error_line("Could not parse trace category level \"%s\" (expected <name>:<level>)\n", item);
+    }
+    *colon = 0;
+    bs_trace_set_category_level(item, level);
+  }
+}
+
+static bs_time_t get_time(){
+  if( time_fpr != NULL ){
+    return time_fpr();
+  } else {
+    return TIME_NEVER;
+  }
+}
+
+/*
+ * (Re)evaluate if the time window is open at the current simulated time,
+ * set the level accordingly, and find when the window opens or closes next
+ */
+static void window_update(void) {
+  bs_time_t now = get_time();
+  window_open = false;
+  window_switch = TIME_NEVER;
+  if ( window_level < 0 ) {
+    //No window
+  } else if ( now == TIME_NEVER ) { //No time function (yet): the window applies all the time
+    window_open = true;
+  } else if ( now > window_to ) {
+    //The window has passed, the level is lowered back for good
+  } else if ( now >= window_from ) {
+    window_open = true;
+    if ( window_to != TIME_NEVER ) {
+      window_switch = window_to + 1;
+    }
+  } else {
+    window_switch = window_from;
+  }
+  bs_trace_set_level(base_level);
+}
+
+/*
+ * Check if the time window opens or closes now. Until the window has passed,
+ * this costs a call to the time function.
+ */
+static inline void window_check(void) {
+  if ( ( window_switch != TIME_NEVER ) && ( get_time() >= window_switch ) ) {
+    window_update();
+  }
+}
+
+/**
+ * Raise the tracing level to <level> only while the simulated time is
+ * within [<from>, <to>] (a negative <level> removes the window)
+ *
+ * This requires a time function (bs_trace_register_time_function()),
+ * without it the raised level applies all the time.
+ */
+void bs_trace_set_time_window(bs_time_t from, bs_time_t to, int level) {
+  window_from = from;
+  window_to = to;
+  window_level = level;
+  window_update();
+}
+
+/*
+ * Is a message of level <level> (let thru by bs_trace_level) not to be printed?
+ * That is, is it over the base level, and not within the open time window
+ * (or over its level). Only to be called after window_check().
+ */
+static inline bool not_printed(int level) {
+  if ( level <= base_level ) {
+    return false;
+  }
+  return !window_open || ( level > window_level );
+}
+
+/*
+ * Parse the value <str> of the command line option <option> as an integer
+ * in [<min>, INT_MAX] (or fail)
+ */
+static int option_int_parse(const char *str, const char *option, int min) {
+  char *end;
+  long value = strtol(str, &end, 10);
+  if ( ( end == str ) || ( *end != 0 ) || ( value < min ) || ( value > INT_MAX ) ) {
+    bs_trace_error_line("Could not parse %s \"%s\" (expected an integer >= %i)\n", option, str, min);
+  }
+  return value;
+}
+
+static void window_time_found(bs_time_t *dest, char *argv, int offset, const char *option) {
+  char *end;
+  double value = strtod(&argv[offset], &end);
+  if ( ( end == &argv[offset] ) || ( *end != 0 ) || ( value < 0 ) ) {
+    bs_trace_error_line("Could not parse %s time \"%s\" (expected microseconds)\n", option, &argv[offset]);
+  }
+  *dest = value;
+  if ( window_level < 0 ) {
+    window_level = BS_TRACE_WINDOW_DEF_LEVEL;
+  }
+  window_update();
+}
+
+/*
+ * Command line option callbacks to set the time window
+ */
+void bs_trace_from_found(char * argv, int offset) {
+  window_time_found(&window_from, argv, offset, "-trace-from");
+}
+
+void bs_trace_to_found(char * argv, int offset) {
+  window_time_found(&window_to, argv, offset, "-trace-to");
+}
+
+void bs_trace_window_level_found(char * argv, int offset) {
+  window_level = option_int_parse(&argv[offset], "-trace-window-v", 0);
+  window_update();
 }
 
 int bs_trace_will_it_be_traced(int this_message_level) {
-  return ( this_message_level <= trace_level );
+  window_check();
+  return ( this_message_level <= bs_trace_level ) && !not_printed(this_message_level);
 }
 
 void bs_trace_register_cleanup_function(main_cleanup_f cleanup_f) {
@@ -65,6 +372,7 @@ void bs_trace_register_cleanup_function(main_cleanup_f cleanup_f) {
 
 void bs_trace_register_time_function(time_f t_function) {
   time_fpr = t_function;
+  window_update();
 }
 
 void bs_trace_set_prefix(const char* prefix) {
@@ -75,12 +383,16 @@ void bs_trace_set_prefix(const char* prefix) {
   strncpy(prefix_s_color, prefix, MAX_PREFIX_LEN-1);
   size = BS_MIN(strlen(prefix), MAX_PREFIX_LEN-1);
   prefix_s_color[size] = 0;
+  line_heads_valid = false;
+
+  bs_trace_binary_set_prefix(prefix_s);
 }
 
 void bs_trace_set_color_prefix(const char* prefix) {
   strncpy(prefix_s_color, prefix, MAX_PREFIX_LEN-1);
   int size = BS_MIN(strlen(prefix), MAX_PREFIX_LEN-1);
   prefix_s_color[size] = 0;
+  line_heads_valid = false;
 }
 
 void bs_trace_set_prefix_phy(const char *phy_id) {
@@ -109,13 +421,6 @@ void bs_trace_set_prefix_dev(int dev_nbr) {
   bs_trace_set_color_prefix(prefix);
 }
 
-static bs_time_t get_time(){
-  if( time_fpr != NULL ){
-    return time_fpr();
-  } else {
-    return TIME_NEVER;
-  }
-}
 
 void bs_trace_silent_exit(uint8_t code){
   #if (_CS_TSYMBOLS_TRACE )
@@ -143,6 +448,937 @@ static const char *trace_type_esc_start[] = {
 
 static const char trace_esc_end[] = "\x1b[0;39m"; //reset all styles
 
+/*
+ * Output file:
+ * Optionally all traces go to a file of this process (with a large buffer)
+ * instead of stdout and stderr. Errors (and optionally warnings) are then
+ * also printed to stderr.
+ */
+
+#define BS_TRACE_FILE_DEF_BUF_SIZE (1024*1024)
+
+static FILE *out_f; //If set, where all traces go
+static int out_fd = -1;
+static char *out_f_buf;
+static size_t out_f_buf_size = BS_TRACE_FILE_DEF_BUF_SIZE;
+static bool out_f_mirror_warnings;
+static bool out_f_requested; //An output file was requested in the command line
+
+/*
+ * Where traces for <file_index> (0: stdout, 1: stderr) are printed
+ */
+static inline FILE *out_fptr(uint file_index){
+  if ( out_f != NULL ) {
+    return out_f;
+  }
+  return file_index ? stderr : stdout;
+}
+
+/**
+ * Send all traces to the file <file_name> instead of stdout/stderr
+ * (NULL to go back to stdout/stderr)
+ */
+void bs_trace_set_output_file(const char *file_name){
+  bs_trace_flush();
+  if ( out_f != NULL ) {
+    FILE *f = out_f;
+    out_f = NULL;
+    out_fd = -1;
+    fclose(f);
+    free(out_f_buf);
+    out_f_buf = NULL;
+  }
+  if ( file_name == NULL ) {
+    return;
+  }
+  FILE *f = bs_fopen(file_name, "w");
+  out_f_buf = bs_malloc(out_f_buf_size);
+  setvbuf(f, out_f_buf, _IOFBF, out_f_buf_size);
+  out_fd = fileno(f);
+  out_f = f;
+}
+
+/**
+ * Set the size of the output file buffer (for files set after this call)
+ */
+void bs_trace_set_output_file_buffer(size_t size){
+  out_f_buf_size = BS_MAX(size, BUFSIZ);
+}
+
+/**
+ * When tracing into an output file, also print warnings to stderr
+ */
+void bs_trace_set_mirror_warnings(bool mirror){
+  out_f_mirror_warnings = mirror;
+}
+
+/*
+ * Command line switch callbacks for the output file options
+ */
+void bs_trace_file_found(char * argv, int offset){
+  out_f_requested = true;
+}
+
+void bs_trace_file_buf_found(char * argv, int offset){
+  bs_trace_set_output_file_buffer(strtoul(&argv[offset], NULL, 0)*1024);
+}
+
+void bs_trace_file_mirror_found(char * argv, int offset){
+  bs_trace_set_mirror_warnings(true);
+}
+
+/**
+ * Was an output file requested in the command line?
+ * (the file itself is opened by the program, once it knows where, with
+ * bs_trace_set_output_file())
+ */
+bool bs_trace_output_file_requested(void){
+  return out_f_requested;
+}
+
+/*
+ * Trace line assembly:
+ * Each line is composed in a per thread buffer, and then output in one go
+ * (so lines from different threads do not get mixed, and stdio is locked
+ * only once per line)
+ */
+
+#define BS_TRACE_LINE_BUF_INIT 512 //Initial size of each thread line buffer (it grows as needed)
+#define MAX_LINE_HEAD_LEN (MAX_PREFIX_LEN + 16)
+
+static __thread char *line_buf;
+static __thread size_t line_buf_size;
+
+/* Start of each line: prefix (+ type color), per [color][type] */
+static char line_heads[2][BS_TRACE_RAW + 1][MAX_LINE_HEAD_LEN];
+static size_t line_heads_len[2][BS_TRACE_RAW + 1];
+
+static void line_heads_update(void){
+  for ( int type = 0; type <= BS_TRACE_RAW; type++ ) {
+    line_heads_len[0][type] = snprintf(line_heads[0][type], MAX_LINE_HEAD_LEN, "%s", prefix_s);
+    line_heads_len[1][type] = snprintf(line_heads[1][type], MAX_LINE_HEAD_LEN, "%s%s",
+                                       prefix_s_color, trace_type_esc_start[type]);
+    line_heads_len[0][type] = BS_MIN(line_heads_len[0][type], MAX_LINE_HEAD_LEN - 1);
+    line_heads_len[1][type] = BS_MIN(line_heads_len[1][type], MAX_LINE_HEAD_LEN - 1);
+  }
+  line_heads_valid = true;
+}
+
+/*
+ * Append <n> bytes from <str> to the line being assembled (which is <len> long so far)
+ * Like snprintf(), if the line does not fit it is truncated, but its length still accounted
+ */
+static inline size_t line_put(size_t len, const char *str, size_t n){
+  if ( len < line_buf_size ) {
+    memcpy(&line_buf[len], str, BS_MIN(n, line_buf_size - len));
+  }
+  return len + n;
+}
+
+/*
+ * JSON lines output:
+ * Instead of text, each trace is one JSON object in its own line, like:
+ * {"time":1200,"prefix":"d_00:","type":"info","level":3,"file":"main.c","line":12,"msg":"Hello"}
+ * ("time" is null for messages without time, "file" and "line" are only present for
+ * the "_line" traces, and the message trailing new line is removed)
+ */
+
+static bool json_on;
+static const char *json_type_names[] = {"exit", "error", "warning", "info", "debug", "raw"};
+static __thread char *msg_buf; //The message of the JSON line being assembled
+static __thread size_t msg_buf_size;
+
+/**
+ * Enable or disable printing the traces as JSON lines
+ */
+void bs_trace_set_json(bool json){
+  json_on = json;
+}
+
+/*
+ * Command line switch callback to enable JSON lines traces
+ */
+void bs_trace_enable_json(char * argv, int offset){
+  bs_trace_set_json(true);
+}
+
+/*
+ * Like line_put() but escaping <str> as the content of a JSON string
+ */
+static size_t line_put_json_str(size_t len, const char *str, size_t n){
+  size_t start = 0;
+  for ( size_t i = 0; i < n; i++ ) {
+    unsigned char c = str[i];
+    if ( ( c >= 0x20 ) && ( c != '"' ) && ( c != '\\' ) ) {
+      continue;
+    }
+    len = line_put(len, &str[start], i - start);
+    start = i + 1;
+    char esc[8];
+    if ( c == '\n' ) {
+      len = line_put(len, "\\n", 2);
+    } else if ( c == '\t' ) {
+      len = line_put(len, "\\t", 2);
+    } else if ( c == '\r' ) {
+      len = line_put(len, "\\r", 2);
+    } else if ( c < 0x20 ) {
+      len = line_put(len, esc, snprintf(esc, sizeof(esc), "\\u%04x", c));
+    } else {
+      esc[0] = '\\';
+      esc[1] = c;
+      len = line_put(len, esc, 2);
+    }
+  }
+  return line_put(len, &str[start], n - start);
+}
+
+static size_t json_assemble(base_trace_type_t type,
+                            const char *caller_filename, unsigned int caller_line,
+                            int level, bool has_time, bs_time_t time,
+                            const char *format, va_list variable_args){
+  size_t msg_len;
+  char num[24];
+
+  if ( msg_buf == NULL ) {
+    msg_buf_size = BS_TRACE_LINE_BUF_INIT;
+    msg_buf = bs_malloc(msg_buf_size);
+  }
+  while ( true ) {
+    va_list args;
+    va_copy(args, variable_args);
+    msg_len = vsnprintf(msg_buf, msg_buf_size, format, args);
+    va_end(args);
+    if ( msg_len < msg_buf_size ) {
+      break;
+    }
+    msg_buf_size = msg_len + 1;
+    msg_buf = bs_realloc(msg_buf, msg_buf_size);
+  }
+  if ( ( msg_len > 0 ) && ( msg_buf[msg_len - 1] == '\n' ) ) {
+    msg_len--;
+  }
+
+  while ( true ) {
+    size_t len = 0;
+    len = line_put(len, "{\"time\":", 8);
+    if ( has_time && ( time != TIME_NEVER ) ) {
+      len = line_put(len, num, snprintf(num, sizeof(num), "%"PRItime, time));
+    } else {
+      len = line_put(len, "null", 4);
+    }
+    len = line_put(len, ",\"prefix\":\"", 11);
+    len = line_put_json_str(len, prefix_s, strlen(prefix_s));
+    len = line_put(len, "\",\"type\":\"", 10);
+    len = line_put(len, json_type_names[type], strlen(json_type_names[type]));
+    len = line_put(len, "\",\"level\":", 10);
+    len = line_put(len, num, snprintf(num, sizeof(num), "%i", level));
+    if ( caller_filename != NULL ) {
+      len = line_put(len, ",\"file\":\"", 9);
+      len = line_put_json_str(len, caller_filename, strlen(caller_filename));
+      len = line_put(len, "\",\"line\":", 9);
+      len = line_put(len, num, snprintf(num, sizeof(num), "%u", caller_line));
+    }
+    len = line_put(len, ",\"msg\":\"", 8);
+    len = line_put_json_str(len, msg_buf, msg_len);
+    len = line_put(len, "\"}\n", 3);
+
+    if ( len < line_buf_size ) {
+      return len;
+    }
+    line_buf_size = len + 1;
+    line_buf = bs_realloc(line_buf, line_buf_size);
+  }
+}
+
+/*
+ * Assemble a complete trace line into this thread line buffer
+ * Returns its length
+ */
+static size_t line_assemble(base_trace_type_t type, int color,
+                            const char *caller_filename, unsigned int caller_line,
+                            int level, bool has_time, bs_time_t time,
+                            const char *time_s, const char *format, va_list variable_args){
+
+  if ( line_buf == NULL ) {
+    line_buf_size = BS_TRACE_LINE_BUF_INIT;
+    line_buf = bs_malloc(line_buf_size);
+  }
+  if ( json_on ) {
+    return json_assemble(type, caller_filename, caller_line, level, has_time, time,
+                         format, variable_args);
+  }
+  if ( !line_heads_valid ) {
+    line_heads_update();
+  }
+
+  while ( true ) {
+    va_list args;
+    size_t len = 0;
+    len = line_put(len, line_heads[color][type], line_heads_len[color][type]);
+    len = line_put(len, time_s, strlen(time_s));
+    len = line_put(len, " ", 1);
+    len = line_put(len, base_trace_type_prefixes[type], strlen(base_trace_type_prefixes[type]));
+    len = line_put(len, " ", 1);
+    if ( caller_filename != NULL ) {
+      len += snprintf(line_buf + BS_MIN(len, line_buf_size), line_buf_size - BS_MIN(len, line_buf_size),
+                      "(%s:%u): ", caller_filename, caller_line);
+    }
+    va_copy(args, variable_args);
+    len += vsnprintf(line_buf + BS_MIN(len, line_buf_size), line_buf_size - BS_MIN(len, line_buf_size),
+                     format, args);
+    va_end(args);
+    if ( color ) {
+      len = line_put(len, trace_esc_end, sizeof(trace_esc_end) - 1);
+    }
+
+    if ( len < line_buf_size ) {
+      return len;
+    }
+    line_buf_size = len + 1;
+    line_buf = bs_realloc(line_buf, line_buf_size);
+  }
+}
+
+/*
+ * Flight recorder (see bs_trace_set_flight_recorder())
+ */
+
+static void flight_record(base_trace_type_t type,
+                          const char *caller_filename, unsigned int caller_line,
+                          int this_message_trace_level,
+                          base_trace_timed_type_t time_type, bs_time_t time,
+                          const char *format, va_list variable_args){
+  if ( time_type == BS_TRACE_AUTOTIME ) {
+    time = get_time();
+  }
+  va_list args;
+  va_copy(args, variable_args);
+  bs_trace_binary_recorder_record(type, caller_filename, caller_line, this_message_trace_level,
+                                  time_type > BS_TRACE_NOTIME, time, format, args);
+  va_end(args);
+}
+
+/*
+ * Dump the flight recorder content (if it is on) into its file (or stderr)
+ */
+static void recorder_dump(void){
+  static int n_dumps;
+  if ( ( recorder_level < 0 ) || !bs_trace_binary_recorder_is_on() ) {
+    return;
+  }
+  FILE *f = stderr;
+  if ( recorder_file != NULL ) {
+    f = fopen(recorder_file, n_dumps ? "a" : "w");
+    if ( f == NULL ) {
+      return;
+    }
+  }
+  n_dumps++;
+  fprintf(f, "---- Flight recorder: last traces up to level %i ----\n", recorder_level);
+  int n = bs_trace_binary_recorder_dump(f);
+  fprintf(f, "---- Flight recorder: end (%i traces) ----\n", n);
+  if ( f != stderr ) {
+    fclose(f);
+    fprintf(stderr, "%s Flight recorder dumped into %s\n", prefix_s, recorder_file);
+  }
+}
+
+/*
+ * On a crash, nothing which is not async-signal-safe can be used, so the
+ * recorder content is written as is (a binary trace) into a file opened in
+ * advance, to be decoded later with bs_trace_decoder
+ */
+static void crash_file_close(bool remove_it){
+  if ( crash_fd != -1 ) {
+    close(crash_fd);
+    crash_fd = -1;
+    if ( remove_it ) {
+      remove(crash_file);
+    }
+  }
+  free(crash_file);
+  crash_file = NULL;
+  free(crash_msg);
+  crash_msg = NULL;
+}
+
+static void crash_file_atexit(void){
+  crash_file_close(true); //We did not crash: it was not needed
+}
+
+/*
+ * (Re)open the file the recorder would be dumped into on a crash:
+ * next to the recorder file, with a .bin extension, or if there is none
+ * bs_flight_recorder.<pid>.bin in the current directory
+ */
+static void crash_file_open(void){
+  static bool atexit_set;
+  crash_file_close(true);
+
+  if ( recorder_file != NULL ) {
+    size_t len = strlen(recorder_file);
+    crash_file = bs_calloc(len + 5, sizeof(char));
+    strcpy(crash_file, recorder_file);
+    if ( ( len > 4 ) && ( strcmp(&crash_file[len - 4], ".log") == 0 ) ) {
+      crash_file[len - 4] = 0;
+    }
+    strcat(crash_file, ".bin");
+  } else {
+    crash_file = bs_calloc(64, sizeof(char));
+    sprintf(crash_file, "bs_flight_recorder.%li.bin", (long)getpid());
+  }
+  crash_fd = open(crash_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP);
+  if ( crash_fd == -1 ) {
+    bs_trace_warning_line("Could not open %s, the flight recorder will not be dumped on a crash\n", crash_file);
+    free(crash_file);
+    crash_file = NULL;
+    return;
+  }
+  const char *fmt = " Crash: flight recorder dumped into %s (decode it with bs_trace_decoder)\n";
+  crash_msg = bs_calloc(strlen(fmt) + strlen(crash_file) + 1, sizeof(char));
+  sprintf(crash_msg, fmt, crash_file);
+
+  if ( !atexit_set ) {
+    atexit_set = true;
+    atexit(crash_file_atexit);
+  }
+}
+
+static void crash_recorder_dump(void){
+  if ( ( crash_fd != -1 ) && ( bs_trace_binary_recorder_write(crash_fd) >= 0 ) ) {
+    ssize_t ret = write(STDERR_FILENO, prefix_s, strlen(prefix_s));
+    ret = write(STDERR_FILENO, crash_msg, strlen(crash_msg));
+    (void)ret;
+  }
+}
+
+/*
+ * Asynchronous tracing:
+ *
+ * Each thread formats its trace lines into its own ring (single producer,
+ * single consumer, lock free), and a background writer thread moves them
+ * from all rings into stdout/stderr in large writes.
+ * If a ring is full, its producer waits for the writer to make space (nothing
+ * is dropped).
+ * Everything pending is flushed synchronously before an error or exit
+ * message is printed, when the program exits, and on crash signals.
+ */
+
+#define BS_TRACE_ASYNC_RING_SIZE (1024*1024) //Per thread, a power of 2
+#define BS_TRACE_ASYNC_OUT_BUF_SIZE (64*1024) //Writes to the output are done in chunks of up to this size
+#define BS_TRACE_ASYNC_PERIOD_MS 10 //The writer wakes up at least this often
+#define BS_TRACE_ASYNC_STDERR_FLAG 0x80000000 //In the record length: the record goes to stderr
+
+typedef struct async_ring_s {
+  uint8_t *buf;
+  uint64_t head; //Total bytes written (only the producer thread updates it)
+  uint64_t tail; //Total bytes consumed (only the writer, with async_lock held, updates it)
+  bool retired; //Its thread exited: it is freed once drained
+  struct async_ring_s *next;
+} async_ring_t;
+
+static bool async_on; //Async tracing enabled
+static bool async_running; //The writer thread is running (in this process)
+static bool async_stop; //Request the writer thread to stop
+static bool async_hooks_set; //atexit() & signal handlers installed
+static pthread_key_t async_ring_key; //To retire the threads rings when they exit
+static pthread_t async_thread;
+static pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER; //Held while draining the rings (and to modify the ring list)
+static pthread_cond_t async_cond = PTHREAD_COND_INITIALIZER;
+static async_ring_t *async_rings; //List of all threads rings
+static __thread async_ring_t *my_ring; //This thread ring
+
+static uint8_t async_out_buf[2][BS_TRACE_ASYNC_OUT_BUF_SIZE];
+static size_t async_out_len[2];
+
+static const int crash_signals[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+
+static void async_out_flush(uint file_index, bool from_signal){
+  if ( async_out_len[file_index] == 0 ) {
+    return;
+  }
+  if ( from_signal ) { //Only async-signal-safe calls
+    size_t done = 0;
+    while ( done < async_out_len[file_index] ) {
+      int fd = ( out_fd != -1 ) ? out_fd : ( file_index ? STDERR_FILENO : STDOUT_FILENO );
+      ssize_t ret = write(fd,
+                          &async_out_buf[file_index][done], async_out_len[file_index] - done);
+      if ( ret <= 0 ) {
+        break;
+      }
+      done += ret;
+    }
+  } else {
+    FILE *f = out_fptr(file_index);
+    fwrite(async_out_buf[file_index], 1, async_out_len[file_index], f);
+    fflush(f);
+  }
+  async_out_len[file_index] = 0;
+}
+
+static void async_out(uint file_index, const uint8_t *ptr, size_t len, bool from_signal){
+  while ( len > 0 ) {
+    size_t n = BS_MIN(len, BS_TRACE_ASYNC_OUT_BUF_SIZE - async_out_len[file_index]);
+    memcpy(&async_out_buf[file_index][async_out_len[file_index]], ptr, n);
+    async_out_len[file_index] += n;
+    ptr += n;
+    len -= n;
+    if ( async_out_len[file_index] == BS_TRACE_ASYNC_OUT_BUF_SIZE ) {
+      async_out_flush(file_index, from_signal);
+    }
+  }
+}
+
+static void ring_copy_out(async_ring_t *ring, uint64_t pos, void *dst, size_t n){
+  size_t off = pos & (BS_TRACE_ASYNC_RING_SIZE - 1);
+  size_t first = BS_MIN(n, BS_TRACE_ASYNC_RING_SIZE - off);
+  memcpy(dst, &ring->buf[off], first);
+  memcpy((uint8_t *)dst + first, ring->buf, n - first);
+}
+
+/*
+ * Move everything pending in all rings to the output, and free the rings of
+ * the threads which exited
+ * (async_lock must be held)
+ */
+static void async_drain(bool from_signal){
+  async_ring_t **link = &async_rings;
+  while ( *link != NULL ) {
+    async_ring_t *ring = *link;
+    bool retired = __atomic_load_n(&ring->retired, __ATOMIC_ACQUIRE);
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = ring->tail;
+    while ( tail < head ) {
+      uint32_t len32;
+      ring_copy_out(ring, tail, &len32, sizeof(len32));
+      uint file_index = ( len32 & BS_TRACE_ASYNC_STDERR_FLAG ) ? 1 : 0;
+      size_t len = len32 & ~BS_TRACE_ASYNC_STDERR_FLAG;
+      size_t off = ( tail + sizeof(len32) ) & (BS_TRACE_ASYNC_RING_SIZE - 1);
+      size_t first = BS_MIN(len, BS_TRACE_ASYNC_RING_SIZE - off);
+      async_out(file_index, &ring->buf[off], first, from_signal);
+      async_out(file_index, ring->buf, len - first, from_signal);
+      tail += sizeof(len32) + len;
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    if ( retired && !from_signal ) {
+      *link = ring->next;
+      free(ring->buf);
+      free(ring);
+    } else {
+      link = &ring->next;
+    }
+  }
+  async_out_flush(0, from_signal);
+  async_out_flush(1, from_signal);
+}
+
+static void *async_writer(void *arg){
+  pthread_mutex_lock(&async_lock);
+  while ( !async_stop ) {
+    async_drain(false);
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += BS_TRACE_ASYNC_PERIOD_MS*1000000;
+    if ( ts.tv_nsec >= 1000000000 ) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&async_cond, &async_lock, &ts);
+  }
+  async_drain(false);
+  pthread_mutex_unlock(&async_lock);
+  return NULL;
+}
+
+/**
+ * Synchronously write out all traces which are still pending in the
+ * asynchronous tracing rings.
+ * (When tracing synchronously there is nothing to do)
+ */
+void bs_trace_flush(void){
+  if ( async_rings == NULL ) {
+    return;
+  }
+  pthread_mutex_lock(&async_lock);
+  async_drain(false);
+  pthread_mutex_unlock(&async_lock);
+}
+
+static void async_stop_writer(void){
+  if ( async_running ) {
+    pthread_mutex_lock(&async_lock);
+    async_stop = true;
+    pthread_cond_signal(&async_cond);
+    pthread_mutex_unlock(&async_lock);
+    pthread_join(async_thread, NULL);
+    __atomic_store_n(&async_running, false, __ATOMIC_RELEASE);
+  }
+  bs_trace_flush();
+}
+
+static void crash_handler(int sig){
+  //Best effort: if the writer is in the middle of draining we cannot touch the rings
+  if ( pthread_mutex_trylock(&async_lock) == 0 ) {
+    async_drain(true);
+    pthread_mutex_unlock(&async_lock);
+  }
+  crash_recorder_dump();
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+static void crash_handlers_install(void){
+  static bool installed;
+  if ( installed ) {
+    return;
+  }
+  installed = true;
+  for ( int i = 0; i < sizeof(crash_signals)/sizeof(crash_signals[0]); i++ ) {
+    struct sigaction act, old;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = crash_handler;
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = SA_RESETHAND;
+    //Respect the handlers the program may have already installed
+    if ( ( sigaction(crash_signals[i], NULL, &old) == 0 ) && ( old.sa_handler == SIG_DFL ) ) {
+      sigaction(crash_signals[i], &act, NULL);
+    }
+  }
+}
+
+static void async_atfork_prepare(void){
+  pthread_mutex_lock(&async_lock);
+}
+
+static void async_atfork_parent(void){
+  pthread_mutex_unlock(&async_lock);
+}
+
+/*
+ * The child does not have the writer thread, and what is pending in the
+ * rings is the parent's to print
+ */
+static void async_atfork_child(void){
+  pthread_mutex_init(&async_lock, NULL);
+  pthread_cond_init(&async_cond, NULL);
+  for ( async_ring_t *ring = async_rings; ring != NULL; ring = ring->next ) {
+    ring->tail = ring->head;
+  }
+  async_running = false;
+}
+
+/*
+ * A thread which traced asynchronously exits: its ring is freed by the
+ * writer once it has been drained
+ */
+static void async_ring_retire(void *ring){
+  __atomic_store_n(&((async_ring_t *)ring)->retired, true, __ATOMIC_RELEASE);
+  pthread_cond_signal(&async_cond);
+}
+
+/*
+ * Start the writer thread (if another thread did not just start it)
+ */
+static void async_start_writer(void){
+  pthread_mutex_lock(&async_lock);
+  if ( !async_running && async_on ) {
+    if ( !async_hooks_set ) {
+      async_hooks_set = true;
+      atexit(async_stop_writer);
+      pthread_atfork(async_atfork_prepare, async_atfork_parent, async_atfork_child);
+      pthread_key_create(&async_ring_key, async_ring_retire);
+      crash_handlers_install();
+    }
+    async_stop = false;
+    if ( pthread_create(&async_thread, NULL, async_writer, NULL) != 0 ) {
+      async_on = false; //We just continue synchronously
+    } else {
+      __atomic_store_n(&async_running, true, __ATOMIC_RELEASE);
+    }
+  }
+  pthread_mutex_unlock(&async_lock);
+}
+
+/**
+ * Enable or disable asynchronous tracing
+ *
+ * When enabled, trace lines are formatted by the caller into a per thread
+ * ring, and printed by a background thread, so slow outputs do not stall the
+ * program. Error and exit messages are still printed synchronously (after
+ * everything pending).
+ */
+void bs_trace_set_async(bool async){
+  if ( !async && async_on ) {
+    async_stop_writer();
+  }
+  async_on = async;
+}
+
+/*
+ * Command line switch callback to enable asynchronous tracing
+ */
+void bs_trace_enable_async(char * argv, int offset){
+  bs_trace_set_async(true);
+}
+
+/*
+ * Queue an already formatted trace line of <len> bytes in this thread ring
+ */
+static void async_put(uint file_index, const char *line, size_t len){
+  if ( !__atomic_load_n(&async_running, __ATOMIC_ACQUIRE) ) {
+    async_start_writer();
+    if ( !async_on ) {
+      fwrite(line, 1, len, out_fptr(file_index));
+      return;
+    }
+  }
+  if ( my_ring == NULL ) {
+    my_ring = bs_calloc(1, sizeof(async_ring_t));
+    my_ring->buf = bs_malloc(BS_TRACE_ASYNC_RING_SIZE);
+    pthread_mutex_lock(&async_lock);
+    my_ring->next = async_rings;
+    async_rings = my_ring;
+    pthread_mutex_unlock(&async_lock);
+    pthread_setspecific(async_ring_key, my_ring);
+  }
+
+  uint32_t len32 = BS_MIN(len, BS_TRACE_ASYNC_RING_SIZE - sizeof(uint32_t));
+  size_t total = sizeof(uint32_t) + len32;
+  uint64_t head = my_ring->head;
+  uint64_t used = head - __atomic_load_n(&my_ring->tail, __ATOMIC_ACQUIRE);
+
+  while ( used + total > BS_TRACE_ASYNC_RING_SIZE ) { //Full, wait for the writer
+    const struct timespec wait = {0, 50000};
+    pthread_cond_signal(&async_cond);
+    nanosleep(&wait, NULL);
+    used = head - __atomic_load_n(&my_ring->tail, __ATOMIC_ACQUIRE);
+  }
+
+  uint32_t hdr = len32 | ( file_index ? BS_TRACE_ASYNC_STDERR_FLAG : 0 );
+  const uint8_t *src[2] = {(const uint8_t *)&hdr, (const uint8_t *)line};
+  size_t n[2] = {sizeof(uint32_t), len32};
+  uint64_t pos = head;
+  for ( int i = 0; i < 2; i++ ) {
+    size_t off = pos & (BS_TRACE_ASYNC_RING_SIZE - 1);
+    size_t first = BS_MIN(n[i], BS_TRACE_ASYNC_RING_SIZE - off);
+    memcpy(&my_ring->buf[off], src[i], first);
+    memcpy(my_ring->buf, src[i] + first, n[i] - first);
+    pos += n[i];
+  }
+  __atomic_store_n(&my_ring->head, pos, __ATOMIC_RELEASE);
+
+  if ( ( used < BS_TRACE_ASYNC_RING_SIZE/2 ) && ( used + total >= BS_TRACE_ASYNC_RING_SIZE/2 ) ) {
+    pthread_cond_signal(&async_cond); //Getting full, do not wait for the next period
+  }
+}
+
+/**
+ * Record the traces into the binary (deferred formatting) file <file_name>
+ * instead of printing them (see bs_trace_binary.h)
+ * Warnings, errors and exit messages are both recorded and printed.
+ * If <file_name> is NULL, binary traces are stopped.
+ */
+void bs_trace_set_binary_file(const char *file_name){
+  if ( file_name == NULL ) {
+    bs_trace_binary_close();
+    return;
+  }
+  if ( bs_trace_binary_open(file_name) != 0 ) {
+    bs_trace_error_line("Could not open binary trace file %s\n", file_name);
+  }
+  bs_trace_binary_set_prefix(prefix_s);
+}
+
+/*
+ * Command line option callback to record the traces in binary form
+ */
+void bs_trace_binary_file_found(char * argv, int offset){
+  bs_trace_set_binary_file(&argv[offset]);
+}
+
+/**
+ * Account the cost of each trace call site (messages issued, printed and
+ * filtered, bytes and time spent printing), and print a report at exit
+ * into <report_file> (NULL for stderr). See bs_trace_cost.h
+ *
+ * While on, all messages reach the library (whatever their level), so
+ * filtered ones can be counted
+ */
+void bs_trace_set_cost_accounting(const char *report_file){
+  bs_trace_cost_set_report_file(report_file);
+  bs_trace_cost_start();
+  bs_trace_set_level(base_level);
+}
+
+/*
+ * Command line option callback to request the cost accounting
+ */
+void bs_trace_cost_found(char * argv, int offset){
+  bs_trace_set_cost_accounting(NULL);
+}
+
+/**
+ * Enable the flight recorder: all messages up to <level> (whatever the
+ * tracing level) are recorded, unformatted, in a circular buffer in memory of
+ * <size> bytes, keeping the most recent ones.
+ * Its content is decoded and dumped into its file (see
+ * bs_trace_set_flight_recorder_file()) on error messages, or on demand with
+ * bs_trace_flight_recorder_dump().
+ * On crash signals it is instead written undecoded (a binary trace) into a
+ * file next to it with a .bin extension, to be decoded with bs_trace_decoder.
+ * A negative <level> disables it.
+ *
+ * As messages are not formatted when recorded, their format strings and
+ * pointed to strings are copied.
+ */
+void bs_trace_set_flight_recorder(int level, size_t size){
+  recorder_level = level;
+  recorder_size = size;
+  if ( level >= 0 ) {
+    bs_trace_binary_recorder_start(size);
+    bs_trace_binary_set_prefix(prefix_s);
+    if ( crash_fd == -1 ) {
+      crash_file_open();
+    }
+    crash_handlers_install();
+  } else {
+    crash_file_close(true);
+  }
+  bs_trace_set_level(base_level);
+}
+
+/**
+ * Set the file the flight recorder is dumped into (by default stderr)
+ * The first dump overwrites it, later ones are appended to it
+ */
+void bs_trace_set_flight_recorder_file(const char *file_name){
+  free(recorder_file);
+  recorder_file = NULL;
+  if ( file_name != NULL ) {
+    recorder_file = bs_calloc(strlen(file_name) + 1, sizeof(char));
+    strcpy(recorder_file, file_name);
+  }
+  if ( recorder_level >= 0 ) {
+    crash_file_open();
+  }
+}
+
+/**
+ * Dump (and empty) the flight recorder now
+ */
+void bs_trace_flight_recorder_dump(void){
+  recorder_dump();
+}
+
+bool bs_trace_flight_recorder_is_on(void){
+  return recorder_level >= 0;
+}
+
+/*
+ * Command line option callbacks for the flight recorder
+ */
+void bs_trace_recorder_found(char * argv, int offset){
+  bs_trace_set_flight_recorder(option_int_parse(&argv[offset], "-trace-recorder", 0), recorder_size);
+}
+
+void bs_trace_recorder_size_found(char * argv, int offset){
+  recorder_size = (size_t)option_int_parse(&argv[offset], "-trace-recorder-size", 1)*1024;
+  if ( recorder_level >= 0 ) {
+    bs_trace_set_flight_recorder(recorder_level, recorder_size);
+  }
+}
+
+/*
+ * Print (or record) a trace line which already passed the level filter
+ * Returns the number of bytes printed
+ */
+static size_t trace_vprint_line(base_trace_type_t type, uint file_index,
+                              const char *caller_filename, unsigned int caller_line,
+                              int this_message_trace_level,
+                              base_trace_timed_type_t time_type, bs_time_t time,
+                              const char *format, va_list variable_args){
+  char time_s[20] = {0};
+  if ( time_type > BS_TRACE_NOTIME ) {
+    time_s[0] = ' ';
+    time_s[1] = '@';
+    if ( time_type == BS_TRACE_AUTOTIME ){
+      time = get_time();
+    }
+    bs_time_to_str(&time_s[2], time);
+  }
+
+  if ( bs_trace_binary_is_open() ) {
+    va_list args;
+    va_copy(args, variable_args);
+    bs_trace_binary_vrecord(type, caller_filename, caller_line, this_message_trace_level,
+                            time_type > BS_TRACE_NOTIME, time, format, args);
+    va_end(args);
+    if ( ( type != BS_TRACE_ERROR ) && ( type != BS_TRACE_WARNING ) && ( type != BS_TRACE_EXIT ) ) {
+      return 0;
+    }
+  }
+
+  bool collect = bs_trace_collect_is_on();
+  int color = ( out_f == NULL ) && !collect && bs_trace_is_tty(file_index);
+  size_t len = line_assemble(type, color, caller_filename, caller_line,
+                             this_message_trace_level, time_type > BS_TRACE_NOTIME, time,
+                             time_s, format, variable_args);
+  bool mirror = ( ( out_f != NULL ) || collect ) && ( ( type == BS_TRACE_ERROR ) || ( type == BS_TRACE_EXIT )
+                || ( ( type == BS_TRACE_WARNING ) && out_f_mirror_warnings ) );
+  int collect_ret = 0;
+  if ( collect ) {
+    if ( time_type == BS_TRACE_NOTIME ) {
+      time = get_time(); //So the collector can place it in order
+    }
+    collect_ret = bs_trace_collect_put(time, line_buf, len);
+    if ( collect_ret == 0 ) {
+      if ( mirror ) {
+        fwrite(line_buf, 1, len, stderr);
+      }
+      return len;
+    }
+    mirror = false;
+  }
+  if ( async_on ) {
+    if ( ( type != BS_TRACE_ERROR ) && ( type != BS_TRACE_EXIT ) ) {
+      async_put(file_index, line_buf, len);
+      if ( mirror ) {
+        fwrite(line_buf, 1, len, stderr);
+      }
+      return len;
+    }
+    bs_trace_flush(); //Whatever is pending goes first
+  }
+  fwrite(line_buf, 1, len, out_fptr(file_index));
+  if ( mirror ) {
+    fwrite(line_buf, 1, len, stderr);
+  }
+  if ( collect_ret == -2 ) { //(Only now, as this reuses the line buffer)
+    bs_trace_warning("The trace collector is not reading this process traces, printing them instead\n");
+  }
+  return len;
+}
+
+/*
+ * trace_vprint_line() (if <print>), accounting its cost
+ */
+static void cost_vprint_line(bool print, base_trace_type_t type, uint file_index,
+                             const char *caller_filename, unsigned int caller_line,
+                             int this_message_trace_level,
+                             base_trace_timed_type_t time_type, bs_time_t time,
+                             const char *format, va_list variable_args){
+  size_t len = 0;
+  uint64_t start = 0, end = 0;
+  if ( print ) {
+    start = bs_trace_cost_now();
+    len = trace_vprint_line(type, file_index, caller_filename, caller_line,
+                            this_message_trace_level, time_type, time,
+                            format, variable_args);
+    end = bs_trace_cost_now();
+  }
+  bs_trace_cost_count(format, caller_filename, caller_line, print, len, end - start);
+}
+
 void bs_trace_vprint(base_trace_type_t type,
                      const char *caller_filename, unsigned int caller_line,
                      int this_message_trace_level,
@@ -154,41 +1390,28 @@ void bs_trace_vprint(base_trace_type_t type,
     this_message_trace_level = 0; //we promote the message, so it is always printed
     file_index = 1; //errors and warnings thru stderr
   }
-  if ( this_message_trace_level <= trace_level ) {
-    FILE* fptrs[2] = {stdout, stderr};
-
-    char time_s[20] = {0};
-    if ( time_type > BS_TRACE_NOTIME ) {
-      time_s[0] = ' ';
-      time_s[1] = '@';
-      if ( time_type == BS_TRACE_AUTOTIME ){
-        time = get_time();
-      }
-      bs_time_to_str(&time_s[2], time);
-    }
-
-    if ( is_a_tty[file_index] == -1 ){
-      is_a_tty[file_index] = isatty(fileno(fptrs[file_index]));
-    }
-    if ( is_a_tty[file_index] ){
-      fprintf(fptrs[file_index],"%s%s",prefix_s_color, trace_type_esc_start[type]);
-    } else {
-      fprintf(fptrs[file_index],"%s",prefix_s);
+  window_check();
+  if ( this_message_trace_level <= bs_trace_level ) {
+    if ( this_message_trace_level <= recorder_level ) {
+      flight_record(type, caller_filename, caller_line, this_message_trace_level,
+                    time_type, time, format, variable_args);
     }
-    fprintf(fptrs[file_index], "%s %s ", time_s, base_trace_type_prefixes[type]);
-    if ( caller_filename != NULL ) {
-      fprintf(fptrs[file_index], "(%s:%u): ", caller_filename, caller_line);
-    }
-    vfprintf(fptrs[file_index], format, variable_args);
-
-    if ( is_a_tty[file_index] ) {
-      fprintf(fptrs[file_index],"%s", trace_esc_end);
+    bool print = !not_printed(this_message_trace_level);
+    if ( bs_trace_cost_is_on() ) {
+      cost_vprint_line(print, type, file_index, caller_filename, caller_line,
+                       this_message_trace_level, time_type, time,
+                       format, variable_args);
+    } else if ( print ) {
+      trace_vprint_line(type, file_index, caller_filename, caller_line,
+                        this_message_trace_level, time_type, time,
+                        format, variable_args);
     }
   }
 
   if ( type == BS_TRACE_EXIT ) {
     bs_trace_silent_exit(0);
   } else if ( type == BS_TRACE_ERROR ) {
+    recorder_dump();
     bs_trace_silent_exit(255);
   }
 }
@@ -201,7 +1424,7 @@ void bs_trace_print(base_trace_type_t type,
   if ((type == BS_TRACE_ERROR) || (type == BS_TRACE_WARNING)) {
     this_message_trace_level = 0; //we promote the message, so it is always printed
   }
-  if ((this_message_trace_level <= trace_level) || (type == BS_TRACE_EXIT)) {
+  if ((this_message_trace_level <= bs_trace_level) || (type == BS_TRACE_EXIT)) {
     va_list variable_args;
     va_start(variable_args, format);
     bs_trace_vprint(type,
@@ -212,3 +1435,35 @@ void bs_trace_print(base_trace_type_t type,
     va_end(variable_args);
   }
 }
+
+/*
+ * Underlying function for the bs_trace_cat_ macros (info, debug and raw
+ * messages of a trace category)
+ */
+void bs_trace_cat_print(int category, base_trace_type_t type,
+                        const char *caller_filename, unsigned int caller_line,
+                        int this_message_trace_level,
+                        base_trace_timed_type_t time_type, bs_time_t time,
+                        const char *format, ...){
+  window_check();
+  if ( this_message_trace_level <= bs_trace_cat_levels[category] ) {
+    va_list variable_args;
+    va_start(variable_args, format);
+    if ( this_message_trace_level <= recorder_level ) {
+      flight_record(type, caller_filename, caller_line, this_message_trace_level,
+                    time_type, time, format, variable_args);
+    }
+    bool print = cat_level_set[category] ? ( this_message_trace_level <= cat_set_levels[category] )
+                                         : !not_printed(this_message_trace_level);
+    if ( bs_trace_cost_is_on() ) {
+      cost_vprint_line(print, type, 0, caller_filename, caller_line,
+                       this_message_trace_level, time_type, time,
+                       format, variable_args);
+    } else if ( print ) {
+      trace_vprint_line(type, 0, caller_filename, caller_line,
+                        this_message_trace_level, time_type, time,
+                        format, variable_args);
+    }
+    va_end(variable_args);
+  }
+}
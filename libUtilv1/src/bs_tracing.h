@@ -42,6 +42,64 @@
  * them in general.
  *
  * All these macros have printf() like semantics (after the verbosity level).
+ * For info, debug and raw messages, the verbosity level is checked inline before calling into the
+ * library, so a filtered message costs only that check (its arguments are not evaluated).
+ * Messages with a verbosity level over BS_TRACE_MAX_LEVEL (if defined at compile time, for ex.
+ * with -DBS_TRACE_MAX_LEVEL=3) are removed entirely from the build.
+ *
+ * Subsystems can register their own trace category (`bs_trace_register_category()`), and trace
+ * with the bs_trace_cat_{info|debug|raw}[_line][_time] macros (which take the category before the
+ * verbosity level). Each category has its own verbosity level, which by default follows the global
+ * one, but can be set independently with the command line option `-vmod=<name>:<level>[,...]`
+ * (e.g. `-v=2 -vmod=ll_conn:9`).
+ * With the command line option `-trace-ctrl`, both the global and the category levels can also
+ * be changed while the program runs, with the bs_trace_ctrl tool (see bs_trace_ctrl.h).
+ *
+ * The level can also be raised only within a window of simulated time, with the command line
+ * options `-trace-from=<t>`, `-trace-to=<t>` (in microseconds) and `-trace-window-v=<level>`
+ * (9 by default), e.g. `-v=2 -trace-from=60e6 -trace-to=61e6`. Until the window has passed,
+ * messages over the normal level but within the window level cost a call and a check of the
+ * simulated time (using the registered time function) against the next window switch time,
+ * but are not formatted before the window opens. After it, the level goes back to normal for
+ * good, so they cost again only the inline check.
+ *
+ * With the command line option `-trace-recorder=<level>` (flight recorder), all messages up to that
+ * level are also recorded, unformatted (see bs_trace_binary.h), in a circular buffer in memory
+ * (`-trace-recorder-size=<kB>`, 1024 by default). Only if the program fails with an error message,
+ * or on demand (`bs_trace_flight_recorder_dump()`), the most recent ones are formatted and dumped
+ * into results/<s_id>/d_<global_device_nbr>.flight.log (or stderr). On a crash signal they are
+ * instead written as they are into results/<s_id>/d_<global_device_nbr>.flight.bin, which can be
+ * decoded with the bs_trace_decoder tool.
+ *
+ * To find which trace statements are most costly, `-trace-cost` counts, for each call site (format
+ * string, and caller file & line if known), the messages issued, printed and filtered out, the bytes
+ * printed and the time spent printing them. A report sorted by bytes is written at exit into
+ * results/<s_id>/d_<global_device_nbr>.trace_cost.txt (or stderr). Note that while it is on, all
+ * messages reach the library (so the filtered ones can be counted), which slows the program.
+ *
+ * Optionally (command line option `-trace-async` or `bs_trace_set_async()`), traces can be
+ * printed asynchronously: each thread formats its messages into its own ring, from which a
+ * background thread writes them out in large chunks. So a slow stdout (for ex. a pipe) does not
+ * stall the program. Error and exit messages are still printed synchronously after flushing
+ * everything pending, and pending messages are also flushed on exit and on crash signals.
+ *
+ * Traces can also be recorded in binary form (command line option `-trace-bin=<file>` or
+ * `bs_trace_set_binary_file()`), deferring their formatting: only the format, arguments and
+ * metadata are stored, and the bs_trace_decoder tool converts the file into the text which would
+ * have been printed. Warnings, errors and exit messages are still printed as text too.
+ *
+ * Instead of stdout/stderr, a process traces can be sent to their own file (with a large buffer),
+ * with `bs_trace_set_output_file()`, or for devices with the command line option `-trace-file`
+ * (which writes to <results>/<s_id>/d_<global_device_nbr>.trace.log). Errors, and optionally
+ * warnings (`-trace-file-warn`), are then also printed to stderr.
+ *
+ * Traces of all processes can also be merged, online and in simulated time order, by the
+ * bs_trace_collector tool: with `-trace-collect` each process places its traces in a shared
+ * memory ring for the collector instead of printing them (see bs_trace_collect.h).
+ *
+ * For post-processing, traces can instead be printed as JSON lines (command line option
+ * `-trace-json` or `bs_trace_set_json()`): one object per trace, with the simulated time (in
+ * microseconds, or null), prefix, type, level, caller file and line (if any) and message.
  */
 
 #ifndef UTIL_BS_TRACING_H
@@ -55,9 +113,37 @@ extern "C"{
 #include <stdlib.h>
 #include <stdarg.h>
 #include <stddef.h>
+#include <limits.h>
 #include "bs_types.h"
 #include "bs_utils.h"
 
+#ifndef BS_TRACE_MAX_LEVEL
+#define BS_TRACE_MAX_LEVEL INT_MAX
+#endif
+
+/*
+ * Current tracing level. Do not modify directly, use bs_trace_set_level()
+ */
+extern int bs_trace_level;
+
+/*
+ * Would a message of verbosity level <l> be traced?
+ * (if <l> is a constant, messages over BS_TRACE_MAX_LEVEL are discarded at compile time)
+ */
+#define BS_TRACE_LEVEL_ON(l) ( ( (l) <= BS_TRACE_MAX_LEVEL ) && ( (l) <= bs_trace_level ) )
+
+#define BS_TRACE_MAX_CATEGORIES 64
+
+/*
+ * Current tracing level of each trace category. Do not modify directly
+ */
+extern int bs_trace_cat_levels[BS_TRACE_MAX_CATEGORIES];
+
+/*
+ * Would a message of verbosity level <l> of trace category <c> be traced?
+ */
+#define BS_TRACE_CAT_LEVEL_ON(c,l) ( ( (l) <= BS_TRACE_MAX_LEVEL ) && ( (l) <= bs_trace_cat_levels[c] ) )
+
 typedef uint8_t (*main_cleanup_f)(void);
 typedef bs_time_t (*time_f)(void);
 
@@ -98,6 +184,81 @@ void bs_trace_force_color(char * argv, int offset);
  */
 int bs_trace_is_tty(int file_number);
 
+/*
+ * Enable asynchronous tracing (command line switch callback)
+ *
+ * This is an API meant for the controlling program.
+ * Normal users of this functionality are not expected to call it.
+ */
+void bs_trace_enable_async(char * argv, int offset);
+
+/*
+ * Enable/disable asynchronous tracing
+ */
+void bs_trace_set_async(bool async);
+
+/*
+ * Synchronously print all traces pending in the asynchronous tracing buffers
+ */
+void bs_trace_flush(void);
+
+/*
+ * Command line option callbacks for the trace output file
+ *
+ * This is an API meant for the controlling program.
+ * Normal users of this functionality are not expected to call it.
+ */
+void bs_trace_file_found(char * argv, int offset);
+void bs_trace_file_buf_found(char * argv, int offset);
+void bs_trace_file_mirror_found(char * argv, int offset);
+
+/*
+ * Was a trace output file requested in the command line
+ * (in which case the program should call bs_trace_set_output_file())
+ */
+bool bs_trace_output_file_requested(void);
+
+/*
+ * Send all traces to <file_name> instead of stdout/stderr (NULL to go back)
+ */
+void bs_trace_set_output_file(const char *file_name);
+
+/*
+ * Set the size of the trace output file buffer
+ */
+void bs_trace_set_output_file_buffer(size_t size);
+
+/*
+ * When tracing to an output file, also print warnings to stderr
+ */
+void bs_trace_set_mirror_warnings(bool mirror);
+
+/*
+ * Print traces as JSON lines (command line switch callback)
+ *
+ * This is an API meant for the controlling program.
+ * Normal users of this functionality are not expected to call it.
+ */
+void bs_trace_enable_json(char * argv, int offset);
+
+/*
+ * Enable/disable printing traces as JSON lines
+ */
+void bs_trace_set_json(bool json);
+
+/*
+ * Record traces in binary form into a file (command line option callback)
+ *
+ * This is an API meant for the controlling program.
+ * Normal users of this functionality are not expected to call it.
+ */
+void bs_trace_binary_file_found(char * argv, int offset);
+
+/*
+ * Record traces in binary form into <file_name> (NULL to stop)
+ */
+void bs_trace_set_binary_file(const char *file_name);
+
 /*
  * Set the tracing level.
  *
@@ -106,6 +267,92 @@ int bs_trace_is_tty(int file_number);
  */
 void bs_trace_set_level(int new_trace_level);
 
+/*
+ * Register a trace category, returning its identifier for the bs_trace_cat_ macros
+ * (registering the same name again returns the same identifier)
+ */
+int bs_trace_register_category(const char *name);
+
+/*
+ * Set the tracing level of a trace category (registered or not yet)
+ */
+void bs_trace_set_category_level(const char *name, int level);
+
+/*
+ * Set the tracing level of a registered trace category by its identifier
+ */
+void bs_trace_set_category_id_level(int cat, int level);
+
+/*
+ * Number of registered trace categories, and name of each
+ * (category identifiers go from 0 to bs_trace_category_count() - 1)
+ */
+int bs_trace_category_count(void);
+const char *bs_trace_category_name(int cat);
+
+/*
+ * Current tracing level (as set with -v), and of a trace category
+ */
+int bs_trace_get_level(void);
+int bs_trace_category_level(int cat);
+
+/*
+ * Raise the tracing level to <level> only while the simulated time is
+ * within [<from>, <to>] (a negative <level> removes the window)
+ */
+void bs_trace_set_time_window(bs_time_t from, bs_time_t to, int level);
+
+/*
+ * Command line option callbacks to set the time window
+ *
+ * This is an API meant for the controlling program.
+ * Normal users of this functionality are not expected to call it.
+ */
+void bs_trace_from_found(char * argv, int offset);
+void bs_trace_to_found(char * argv, int offset);
+void bs_trace_window_level_found(char * argv, int offset);
+
+/*
+ * Flight recorder: record all messages up to <level> (whatever the tracing level) unformatted
+ * in a circular buffer of <size> bytes, which is decoded and dumped into its file on errors,
+ * crashes or with bs_trace_flight_recorder_dump() (a negative <level> disables it)
+ */
+void bs_trace_set_flight_recorder(int level, size_t size);
+void bs_trace_set_flight_recorder_file(const char *file_name);
+void bs_trace_flight_recorder_dump(void);
+bool bs_trace_flight_recorder_is_on(void);
+
+/*
+ * Account the cost of each trace call site, printing a report at exit into <report_file>
+ * (NULL for stderr)
+ */
+void bs_trace_set_cost_accounting(const char *report_file);
+
+/*
+ * Command line option callback to account the cost of each trace call site
+ *
+ * This is an API meant for the controlling program.
+ * Normal users of this functionality are not expected to call it.
+ */
+void bs_trace_cost_found(char * argv, int offset);
+
+/*
+ * Command line option callbacks for the flight recorder
+ *
+ * This is an API meant for the controlling program.
+ * Normal users of this functionality are not expected to call it.
+ */
+void bs_trace_recorder_found(char * argv, int offset);
+void bs_trace_recorder_size_found(char * argv, int offset);
+
+/*
+ * Set the level of trace categories (command line option callback)
+ *
+ * This is an API meant for the controlling program.
+ * Normal users of this functionality are not expected to call it.
+ */
+void bs_trace_vmod_found(char * argv, int offset);
+
 /*
  * Will a message with a given verbosity level be printed or discarded
  *
@@ -168,6 +415,11 @@ void bs_trace_vprint(base_trace_type_t type,
                      int this_message_trace_level,
                      base_trace_timed_type_t time_type, bs_time_t time,
                      const char *format, va_list variable_args);
+void bs_trace_cat_print(int category, base_trace_type_t type,
+                        const char *caller_filename, unsigned int caller_line,
+                        int this_message_trace_level,
+                        base_trace_timed_type_t time_type, bs_time_t time,
+                        const char *format, ...);
 
 #define bs_trace_exit(...)                  do { bs_trace_print(BS_TRACE_EXIT   ,NULL,    0,       5,BS_TRACE_NOTIME,       0,__VA_ARGS__); \
                                                BS_UNREACHABLE; } while(0)
@@ -201,24 +453,39 @@ void bs_trace_vprint(base_trace_type_t type,
 #define bs_trace_warning_manual_time(t,...) bs_trace_print(BS_TRACE_WARNING  ,NULL,    0,       0,BS_TRACE_TIME_PROVIDED,t,__VA_ARGS__)
 #define bs_trace_warning_manual_time_line(t,...) bs_trace_print(BS_TRACE_WARNING  ,__FILE__,__LINE__,       0,BS_TRACE_TIME_PROVIDED,t,__VA_ARGS__)
 
-#define bs_trace_info(l,...)                bs_trace_print(BS_TRACE_INFO   ,NULL,    0,       l,BS_TRACE_NOTIME,       0,__VA_ARGS__)
-#define bs_trace_info_line(l,...)           bs_trace_print(BS_TRACE_INFO   ,__FILE__,__LINE__,l,BS_TRACE_NOTIME,       0,__VA_ARGS__)
-#define bs_trace_info_line_time(l,...)      bs_trace_print(BS_TRACE_INFO   ,__FILE__,__LINE__,l,BS_TRACE_AUTOTIME,     0,__VA_ARGS__)
-#define bs_trace_info_time_line(l,...)      bs_trace_print(BS_TRACE_INFO   ,__FILE__,__LINE__,l,BS_TRACE_AUTOTIME,     0,__VA_ARGS__)
-#define bs_trace_info_time(l,...)           bs_trace_print(BS_TRACE_INFO   ,NULL,    0,       l,BS_TRACE_AUTOTIME,     0,__VA_ARGS__)
-
-#define bs_trace_debug(l,...)               bs_trace_print(BS_TRACE_DEBUG  ,NULL,    0,       l,BS_TRACE_NOTIME,       0,__VA_ARGS__)
-#define bs_trace_debug_line(l,...)          bs_trace_print(BS_TRACE_DEBUG  ,__FILE__,__LINE__,l,BS_TRACE_NOTIME,       0,__VA_ARGS__)
-#define bs_trace_debug_line_time(l,...)     bs_trace_print(BS_TRACE_DEBUG  ,__FILE__,__LINE__,l,BS_TRACE_AUTOTIME,     0,__VA_ARGS__)
-#define bs_trace_debug_time_line(l,...)     bs_trace_print(BS_TRACE_DEBUG  ,__FILE__,__LINE__,l,BS_TRACE_AUTOTIME,     0,__VA_ARGS__)
-#define bs_trace_debug_time(l,...)          bs_trace_print(BS_TRACE_DEBUG  ,NULL,    0,       l,BS_TRACE_AUTOTIME,     0,__VA_ARGS__)
-
-#define bs_trace_raw(l,...)                 bs_trace_print(BS_TRACE_RAW    ,NULL,    0,       l,BS_TRACE_NOTIME,       0,__VA_ARGS__)
-#define bs_trace_raw_line(l,...)            bs_trace_print(BS_TRACE_RAW    ,__FILE__,__LINE__,l,BS_TRACE_NOTIME,       0,__VA_ARGS__)
-#define bs_trace_raw_line_time(l,...)       bs_trace_print(BS_TRACE_RAW    ,__FILE__,__LINE__,l,BS_TRACE_AUTOTIME,     0,__VA_ARGS__)
-#define bs_trace_raw_time_line(l,...)       bs_trace_print(BS_TRACE_RAW    ,__FILE__,__LINE__,l,BS_TRACE_AUTOTIME,     0,__VA_ARGS__)
-#define bs_trace_raw_time(l,...)            bs_trace_print(BS_TRACE_RAW    ,NULL,    0,       l,BS_TRACE_AUTOTIME,     0,__VA_ARGS__)
-#define bs_trace_raw_manual_time(l,t,...)   bs_trace_print(BS_TRACE_RAW    ,NULL,    0,       l,BS_TRACE_TIME_PROVIDED,t,__VA_ARGS__)
+#define bs_trace_info(l,...)                ( BS_TRACE_LEVEL_ON(l) ? bs_trace_print(BS_TRACE_INFO   ,NULL,    0,       l,BS_TRACE_NOTIME,       0,__VA_ARGS__) : (void)0 )
+#define bs_trace_info_line(l,...)           ( BS_TRACE_LEVEL_ON(l) ? bs_trace_print(BS_TRACE_INFO   ,__FILE__,__LINE__,l,BS_TRACE_NOTIME,       0,__VA_ARGS__) : (void)0 )
+#define bs_trace_info_line_time(l,...)      ( BS_TRACE_LEVEL_ON(l) ? bs_trace_print(BS_TRACE_INFO   ,__FILE__,__LINE__,l,BS_TRACE_AUTOTIME,     0,__VA_ARGS__) : (void)0 )
+#define bs_trace_info_time_line(l,...)      ( BS_TRACE_LEVEL_ON(l) ? bs_trace_print(BS_TRACE_INFO   ,__FILE__,__LINE__,l,BS_TRACE_AUTOTIME,     0,__VA_ARGS__) : (void)0 )
+#define bs_trace_info_time(l,...)           ( BS_TRACE_LEVEL_ON(l) ? bs_trace_print(BS_TRACE_INFO   ,NULL,    0,       l,BS_TRACE_AUTOTIME,     0,__VA_ARGS__) : (void)0 )
+
+#define bs_trace_debug(l,...)               ( BS_TRACE_LEVEL_ON(l) ? bs_trace_print(BS_TRACE_DEBUG  ,NULL,    0,       l,BS_TRACE_NOTIME,       0,__VA_ARGS__) : (void)0 )
+#define bs_trace_debug_line(l,...)          ( BS_TRACE_LEVEL_ON(l) ? bs_trace_print(BS_TRACE_DEBUG  ,__FILE__,__LINE__,l,BS_TRACE_NOTIME,       0,__VA_ARGS__) : (void)0 )
+#define bs_trace_debug_line_time(l,...)     ( BS_TRACE_LEVEL_ON(l) ? bs_trace_print(BS_TRACE_DEBUG  ,__FILE__,__LINE__,l,BS_TRACE_AUTOTIME,     0,__VA_ARGS__) : (void)0 )
+#define bs_trace_debug_time_line(l,...)     ( BS_TRACE_LEVEL_ON(l) ? bs_trace_print(BS_TRACE_DEBUG  ,__FILE__,__LINE__,l,BS_TRACE_AUTOTIME,     0,__VA_ARGS__) : (void)0 )
+#define bs_trace_debug_time(l,...)          ( BS_TRACE_LEVEL_ON(l) ? bs_trace_print(BS_TRACE_DEBUG  ,NULL,    0,       l,BS_TRACE_AUTOTIME,     0,__VA_ARGS__) : (void)0 )
+
+#define bs_trace_raw(l,...)                 ( BS_TRACE_LEVEL_ON(l) ? bs_trace_print(BS_TRACE_RAW    ,NULL,    0,       l,BS_TRACE_NOTIME,       0,__VA_ARGS__) : (void)0 )
+#define bs_trace_raw_line(l,...)            ( BS_TRACE_LEVEL_ON(l) ? bs_trace_print(BS_TRACE_RAW    ,__FILE__,__LINE__,l,BS_TRACE_NOTIME,       0,__VA_ARGS__) : (void)0 )
+#define bs_trace_raw_line_time(l,...)       ( BS_TRACE_LEVEL_ON(l) ? bs_trace_print(BS_TRACE_RAW    ,__FILE__,__LINE__,l,BS_TRACE_AUTOTIME,     0,__VA_ARGS__) : (void)0 )
+#define bs_trace_raw_time_line(l,...)       ( BS_TRACE_LEVEL_ON(l) ? bs_trace_print(BS_TRACE_RAW    ,__FILE__,__LINE__,l,BS_TRACE_AUTOTIME,     0,__VA_ARGS__) : (void)0 )
+#define bs_trace_raw_time(l,...)            ( BS_TRACE_LEVEL_ON(l) ? bs_trace_print(BS_TRACE_RAW    ,NULL,    0,       l,BS_TRACE_AUTOTIME,     0,__VA_ARGS__) : (void)0 )
+#define bs_trace_raw_manual_time(l,t,...)   ( BS_TRACE_LEVEL_ON(l) ? bs_trace_print(BS_TRACE_RAW    ,NULL,    0,       l,BS_TRACE_TIME_PROVIDED,t,__VA_ARGS__) : (void)0 )
+
+#define bs_trace_cat_info(c,l,...)          ( BS_TRACE_CAT_LEVEL_ON(c,l) ? bs_trace_cat_print(c,BS_TRACE_INFO ,NULL,    0,       l,BS_TRACE_NOTIME,  0,__VA_ARGS__) : (void)0 )
+#define bs_trace_cat_info_line(c,l,...)     ( BS_TRACE_CAT_LEVEL_ON(c,l) ? bs_trace_cat_print(c,BS_TRACE_INFO ,__FILE__,__LINE__,l,BS_TRACE_NOTIME,  0,__VA_ARGS__) : (void)0 )
+#define bs_trace_cat_info_line_time(c,l,...) ( BS_TRACE_CAT_LEVEL_ON(c,l) ? bs_trace_cat_print(c,BS_TRACE_INFO ,__FILE__,__LINE__,l,BS_TRACE_AUTOTIME,0,__VA_ARGS__) : (void)0 )
+#define bs_trace_cat_info_time(c,l,...)     ( BS_TRACE_CAT_LEVEL_ON(c,l) ? bs_trace_cat_print(c,BS_TRACE_INFO ,NULL,    0,       l,BS_TRACE_AUTOTIME,0,__VA_ARGS__) : (void)0 )
+
+#define bs_trace_cat_debug(c,l,...)         ( BS_TRACE_CAT_LEVEL_ON(c,l) ? bs_trace_cat_print(c,BS_TRACE_DEBUG,NULL,    0,       l,BS_TRACE_NOTIME,  0,__VA_ARGS__) : (void)0 )
+#define bs_trace_cat_debug_line(c,l,...)    ( BS_TRACE_CAT_LEVEL_ON(c,l) ? bs_trace_cat_print(c,BS_TRACE_DEBUG,__FILE__,__LINE__,l,BS_TRACE_NOTIME,  0,__VA_ARGS__) : (void)0 )
+#define bs_trace_cat_debug_line_time(c,l,...) ( BS_TRACE_CAT_LEVEL_ON(c,l) ? bs_trace_cat_print(c,BS_TRACE_DEBUG,__FILE__,__LINE__,l,BS_TRACE_AUTOTIME,0,__VA_ARGS__) : (void)0 )
+#define bs_trace_cat_debug_time(c,l,...)    ( BS_TRACE_CAT_LEVEL_ON(c,l) ? bs_trace_cat_print(c,BS_TRACE_DEBUG,NULL,    0,       l,BS_TRACE_AUTOTIME,0,__VA_ARGS__) : (void)0 )
+
+#define bs_trace_cat_raw(c,l,...)           ( BS_TRACE_CAT_LEVEL_ON(c,l) ? bs_trace_cat_print(c,BS_TRACE_RAW  ,NULL,    0,       l,BS_TRACE_NOTIME,  0,__VA_ARGS__) : (void)0 )
+#define bs_trace_cat_raw_line(c,l,...)      ( BS_TRACE_CAT_LEVEL_ON(c,l) ? bs_trace_cat_print(c,BS_TRACE_RAW  ,__FILE__,__LINE__,l,BS_TRACE_NOTIME,  0,__VA_ARGS__) : (void)0 )
+#define bs_trace_cat_raw_line_time(c,l,...) ( BS_TRACE_CAT_LEVEL_ON(c,l) ? bs_trace_cat_print(c,BS_TRACE_RAW  ,__FILE__,__LINE__,l,BS_TRACE_AUTOTIME,0,__VA_ARGS__) : (void)0 )
+#define bs_trace_cat_raw_time(c,l,...)      ( BS_TRACE_CAT_LEVEL_ON(c,l) ? bs_trace_cat_print(c,BS_TRACE_RAW  ,NULL,    0,       l,BS_TRACE_AUTOTIME,0,__VA_ARGS__) : (void)0 )
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,63 @@
+/*
+ * Copyright 2018 Oticon A/S
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+/**
+ * Converter of binary dump files (see libUtilv1 bs_dump_files_bin.h) into
+ * the CSV files the program would have dumped
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "bs_tracing.h"
+#include "bs_oswrap.h"
+#include "bs_cmd_line.h"
+#include "bs_dump_files_bin.h"
+
+typedef struct {
+  char *in_file;
+  char *out_file;
+} converter_args_t;
+
+char executable_name[] = "bs_dump_converter";
+void component_print_post_help(){
+  fprintf(stdout,"\n"
+          "Convert a binary dump file (dumped with -dump_binary)\n"
+          "into the CSV file the program would have dumped\n\n");
+}
+
+int main(int argc, char *argv[]){
+  converter_args_t args;
+
+  bs_args_struct_t args_struct[] = {
+      { false, false, false, "file", "file", 's', (void*)&args.in_file, NULL, "Binary dump file to convert (by default stdin)"},
+      { false, false, false, "o", "file", 's', (void*)&args.out_file, NULL, "Write the CSV to this file (by default stdout)"},
+      ARG_TABLE_ENDMARKER
+  };
+
+  bs_trace_set_prefix("");
+  bs_args_set_defaults(args_struct);
+  args.in_file = NULL;
+  args.out_file = NULL;
+  bs_args_parse_cmd_line(argc, argv, args_struct);
+
+  FILE *in = stdin;
+  FILE *out = stdout;
+  if ( args.in_file != NULL ) {
+    in = bs_fopen(args.in_file, "rb");
+  }
+  if ( args.out_file != NULL ) {
+    out = bs_fopen(args.out_file, "w");
+  }
+
+  int ret = bs_df_bin_to_csv(in, out);
+
+  if ( in != stdin ) {
+    fclose(in);
+  }
+  if ( out != stdout ) {
+    fclose(out);
+  }
+  return ( ret == 0 ) ? 0 : 1;
+}
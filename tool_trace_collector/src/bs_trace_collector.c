@@ -0,0 +1,307 @@
+/*
+ * Copyright 2018 Oticon A/S
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+/**
+ * Trace collector: merges, by simulated time, the traces all processes of a
+ * simulation place in their trace rings (see libUtilv1 bs_trace_collect.h)
+ * into one output
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "bs_types.h"
+#include "bs_tracing.h"
+#include "bs_oswrap.h"
+#include "bs_utils.h"
+#include "bs_cmd_line.h"
+#include "bs_trace_collect.h"
+
+#define COLLECTOR_SCAN_PERIOD_MS 100 //How often we look for new rings
+#define COLLECTOR_LIVENESS_PERIOD_MS 100 //How often we check if the processes are alive
+#define COLLECTOR_OUT_BUF_SIZE (1024*1024)
+
+typedef struct {
+  char *s_id;
+  char *out_file;
+  uint n;
+  uint max_wait;
+} collector_args_t;
+
+typedef struct {
+  char *name;
+  bs_trace_ring_hdr_t *hdr;
+  size_t map_size;
+  uint32_t mask;
+  bool has_rec; //<rec> holds the header of the next record
+  bs_trace_ring_rec_t rec;
+  uint64_t last_activity_ms; //When we last saw a record from it
+  uint64_t last_liveness_ms; //When we last checked if the writer is alive
+  bool writer_gone;
+  bool done; //Writer gone and everything read
+} ring_t;
+
+static ring_t *rings;
+static uint n_rings;
+static uint n_done;
+static char *dir;
+static FILE *out;
+static char *line;
+static size_t line_size;
+static volatile sig_atomic_t stop;
+
+char executable_name[] = "bs_trace_collector";
+void component_print_post_help(){
+  fprintf(stdout,"\n"
+          "Merge the traces of all processes of a simulation (run with\n"
+          "-trace-collect) into one output ordered by simulated time\n\n");
+}
+
+static uint64_t now_ms(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+static bool is_known(const char *name){
+  for ( uint i = 0; i < n_rings; i++ ) {
+    if ( strcmp(rings[i].name, name) == 0 ) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Attach to the ring <name>
+ * Rings already taken by another collector, or not ready yet, are ignored.
+ * Rings left behind by a writer which was already closed or gone before any
+ * collector attached are old: they are removed instead
+ */
+static void attach(const char *name){
+  char path[strlen(dir) + strlen(name) + 2];
+  sprintf(path, "%s/%s", dir, name);
+
+  int fd = open(path, O_RDWR);
+  if ( fd == -1 ) {
+    return;
+  }
+  struct stat st;
+  void *ptr = MAP_FAILED;
+  if ( ( fstat(fd, &st) == 0 ) && ( st.st_size >= sizeof(bs_trace_ring_hdr_t) ) ) {
+    ptr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if ( ptr == MAP_FAILED ) {
+    return;
+  }
+  bs_trace_ring_hdr_t *hdr = ptr;
+  int32_t no_reader = 0;
+  //Claim the ring atomically, so 2 collectors never attach to the same one
+  if ( ( __atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != BS_TRACE_RING_MAGIC )
+      || ( hdr->capacity + sizeof(bs_trace_ring_hdr_t) != st.st_size )
+      || !__atomic_compare_exchange_n(&hdr->reader_pid, &no_reader, getpid(), false,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ) {
+    munmap(ptr, st.st_size);
+    return;
+  }
+  if ( __atomic_load_n(&hdr->writer_closed, __ATOMIC_ACQUIRE)
+      || ( ( kill(hdr->writer_pid, 0) != 0 ) && ( errno == ESRCH ) ) ) {
+    munmap(ptr, st.st_size);
+    remove(path);
+    return;
+  }
+
+  rings = bs_realloc(rings, ( n_rings + 1 )*sizeof(ring_t));
+  ring_t *r = &rings[n_rings++];
+  memset(r, 0, sizeof(ring_t));
+  r->name = bs_malloc(strlen(name) + 1);
+  strcpy(r->name, name);
+  r->hdr = hdr;
+  r->map_size = st.st_size;
+  r->mask = hdr->capacity - 1;
+  r->last_activity_ms = now_ms();
+  bs_trace_raw(3, "Collecting %s\n", name);
+}
+
+static void scan_rings(void){
+  DIR *d = opendir(dir);
+  if ( d == NULL ) {
+    return;
+  }
+  struct dirent *entry;
+  size_t ext_len = strlen(BS_TRACE_RING_EXT);
+  while ( ( entry = readdir(d) ) != NULL ) {
+    size_t len = strlen(entry->d_name);
+    if ( ( len > ext_len ) && ( strcmp(&entry->d_name[len - ext_len], BS_TRACE_RING_EXT) == 0 )
+        && !is_known(entry->d_name) ) {
+      attach(entry->d_name);
+    }
+  }
+  closedir(d);
+}
+
+static void copy_out(ring_t *r, uint64_t pos, void *dst, size_t n){
+  size_t off = pos & r->mask;
+  size_t first = r->hdr->capacity - off;
+  if ( n <= first ) {
+    memcpy(dst, &r->hdr->data[off], n);
+  } else {
+    memcpy(dst, &r->hdr->data[off], first);
+    memcpy((uint8_t *)dst + first, r->hdr->data, n - first);
+  }
+}
+
+/*
+ * Update what we know of ring <r>: peek its next record header, or check if
+ * it is done
+ */
+static void ring_update(ring_t *r, uint64_t now){
+  if ( r->done || r->has_rec ) {
+    return;
+  }
+  uint64_t head = __atomic_load_n(&r->hdr->head, __ATOMIC_ACQUIRE);
+  if ( head != r->hdr->tail ) {
+    copy_out(r, r->hdr->tail, &r->rec, sizeof(r->rec));
+    r->has_rec = true;
+    r->last_activity_ms = now;
+    return;
+  }
+  if ( !r->writer_gone ) {
+    if ( __atomic_load_n(&r->hdr->writer_closed, __ATOMIC_ACQUIRE) ) {
+      r->writer_gone = true;
+    } else if ( now - r->last_liveness_ms >= COLLECTOR_LIVENESS_PERIOD_MS ) {
+      r->last_liveness_ms = now;
+      r->writer_gone = ( kill(r->hdr->writer_pid, 0) != 0 ) && ( errno == ESRCH );
+    }
+    if ( r->writer_gone ) {
+      return; //Check once more for records it may have published before going
+    }
+  } else { //Gone, and everything read
+    char path[strlen(dir) + strlen(r->name) + 2];
+    sprintf(path, "%s/%s", dir, r->name);
+    munmap(r->hdr, r->map_size);
+    remove(path);
+    r->done = true;
+    n_done++;
+  }
+}
+
+/*
+ * Write out the next record of ring <r>
+ */
+static void ring_output(ring_t *r){
+  uint64_t tail = r->hdr->tail + sizeof(r->rec);
+  if ( r->rec.len > line_size ) {
+    line_size = r->rec.len;
+    line = bs_realloc(line, line_size);
+  }
+  copy_out(r, tail, line, r->rec.len);
+  __atomic_store_n(&r->hdr->tail, tail + r->rec.len, __ATOMIC_RELEASE);
+  r->has_rec = false;
+  fwrite(line, 1, r->rec.len, out);
+}
+
+/*
+ * Output the earliest pending record, if it can be known to be the earliest
+ * (all rings which are not idle for longer than <max_wait> ms, or done, have
+ * something pending). If <drain>, do not wait for anybody.
+ *
+ * Returns true if something was output
+ */
+static bool merge_step(uint64_t now, uint max_wait, bool drain){
+  ring_t *first = NULL;
+  for ( uint i = 0; i < n_rings; i++ ) {
+    ring_t *r = &rings[i];
+    ring_update(r, now);
+    if ( r->has_rec ) {
+      if ( ( first == NULL ) || ( r->rec.time < first->rec.time ) ) {
+        first = r;
+      }
+    } else if ( !r->done && !r->writer_gone && !drain
+               && ( now - r->last_activity_ms < max_wait ) ) {
+      return false; //It may still produce something earlier
+    }
+  }
+  if ( first == NULL ) {
+    return false;
+  }
+  ring_output(first);
+  return true;
+}
+
+static void signal_end_handler(int sig){
+  stop = 1;
+}
+
+int main(int argc, char *argv[]){
+  collector_args_t args;
+
+  bs_args_struct_t args_struct[] = {
+      { false, true , false, "s", "s_id", 's', (void*)&args.s_id, NULL, "Simulation id"},
+      { false, false, false, "n", "nbr_processes", 'u', (void*)&args.n, NULL, "Do not end before this many processes have been seen (by default, end when all seen processes end)"},
+      { false, false, false, "max_wait", "ms", 'u', (void*)&args.max_wait, NULL, "Do not wait for a process which has been silent for longer than this (500)"},
+      { false, false, false, "o", "file", 's', (void*)&args.out_file, NULL, "Write the merged traces to this file (by default stdout)"},
+      ARG_TABLE_ENDMARKER
+  };
+
+  bs_trace_set_prefix("trace_collector:");
+  bs_args_set_defaults(args_struct);
+  args.s_id = NULL;
+  args.out_file = NULL;
+  args.n = 0;
+  args.max_wait = 500;
+  bs_args_parse_cmd_line(argc, argv, args_struct);
+  if ( args.s_id == NULL ) {
+    bs_args_print_switches_help(args_struct);
+    bs_trace_error_line("The command line option <simulation ID> needs to be set\n");
+  }
+
+  bs_set_sig_term_handler(signal_end_handler, (int[]){SIGTERM, SIGINT}, 2);
+
+  out = ( args.out_file != NULL ) ? bs_fopen(args.out_file, "w") : stdout;
+  setvbuf(out, bs_malloc(COLLECTOR_OUT_BUF_SIZE), _IOFBF, COLLECTOR_OUT_BUF_SIZE);
+  dir = bs_trace_collect_dir(args.s_id);
+
+  const struct timespec idle_wait = {0, 1000000};
+  uint64_t last_scan = 0;
+  while ( !stop ) {
+    uint64_t now = now_ms();
+    if ( now - last_scan >= COLLECTOR_SCAN_PERIOD_MS ) {
+      last_scan = now;
+      scan_rings();
+    }
+    if ( merge_step(now, args.max_wait, false) ) {
+      continue;
+    }
+    if ( ( n_rings > 0 ) && ( n_done == n_rings ) && ( n_rings >= args.n ) ) {
+      break;
+    }
+    fflush(out);
+    nanosleep(&idle_wait, NULL);
+  }
+  while ( merge_step(now_ms(), args.max_wait, true) ); //Whatever is left
+
+  for ( uint i = 0; i < n_rings; i++ ) {
+    if ( !rings[i].done ) { //Let the process print its traces itself from now on
+      __atomic_store_n(&rings[i].hdr->reader_closed, 1, __ATOMIC_RELEASE);
+      munmap(rings[i].hdr, rings[i].map_size);
+    }
+  }
+  fflush(out);
+  if ( out != stdout ) {
+    fclose(out);
+  }
+  return 0;
+}
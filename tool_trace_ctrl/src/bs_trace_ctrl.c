@@ -0,0 +1,225 @@
+/*
+ * Copyright 2018 Oticon A/S
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+/**
+ * Trace control: show or change the trace levels of running processes (run
+ * with -trace-ctrl) of a simulation (see libUtilv1 bs_trace_ctrl.h)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "bs_types.h"
+#include "bs_tracing.h"
+#include "bs_utils.h"
+#include "bs_cmd_line.h"
+#include "bs_trace_collect.h"
+#include "bs_trace_ctrl.h"
+
+#define CTRL_ACK_WAIT_MS 1000 //How long to wait for a process to apply the new levels
+
+typedef struct {
+  char *s_id;
+  uint dev_nbr;
+  int level;
+  char *vmod;
+} ctrl_args_t;
+
+static ctrl_args_t args;
+
+char executable_name[] = "bs_trace_ctrl";
+void component_print_post_help(){
+  fprintf(stdout,"\n"
+          "Show or change the trace levels of the running processes (run with\n"
+          "-trace-ctrl) of a simulation.\n"
+          "Without -v or -vmod, their current levels are shown\n\n");
+}
+
+/*
+ * Request the levels given in the command line from the process owning <b>
+ * Returns 0 if there was something to request, -1 otherwise
+ */
+static int place_requests(bs_trace_ctrl_block_t *b, const char *name){
+  int n_req = 0;
+
+  if ( args.level != INT_MIN ) {
+    __atomic_store_n(&b->req_level, BS_MAX(args.level, 0), __ATOMIC_RELEASE);
+    n_req++;
+  }
+  if ( args.vmod == NULL ) {
+    return n_req ? 0 : -1;
+  }
+
+  char *list = args.vmod;
+  while ( *list != 0 ) {
+    size_t len = strcspn(list, ",");
+    char item[len + 1];
+    memcpy(item, list, len);
+    item[len] = 0;
+    list += len;
+    if ( *list == ',' ) {
+      list++;
+    }
+    if ( len == 0 ) {
+      continue;
+    }
+
+    char *colon = strrchr(item, ':');
+    char *end = NULL;
+    long level = 0;
+    if ( colon != NULL ) {
+      level = strtol(colon + 1, &end, 10);
+    }
+    if ( ( colon == NULL ) || ( colon == item ) || ( end == colon + 1 ) || ( *end != 0 ) ) {
+      bs_trace_error_line("Could not parse trace category level \"%s\" (expected <name>:<level>)\n", item);
+    }
+    *colon = 0;
+
+    uint n_cats = BS_MIN(b->n_cats, BS_TRACE_MAX_CATEGORIES);
+    uint i;
+    for ( i = 0; i < n_cats; i++ ) {
+      if ( strncmp(b->cats[i].name, item, BS_TRACE_CTRL_NAME_LEN) == 0 ) {
+        break;
+      }
+    }
+    if ( i == n_cats ) {
+      bs_trace_warning_line("%s: has no trace category %s\n", name, item);
+      continue;
+    }
+    __atomic_store_n(&b->req_cat_levels[i], (int32_t)BS_MAX(level, 0), __ATOMIC_RELEASE);
+    n_req++;
+  }
+  return n_req ? 0 : -1;
+}
+
+static void show_levels(bs_trace_ctrl_block_t *b, const char *name){
+  printf("%s (pid %i): level %i\n", name, b->pid, b->level);
+  uint n_cats = BS_MIN(b->n_cats, BS_TRACE_MAX_CATEGORIES);
+  for ( uint i = 0; i < n_cats; i++ ) {
+    printf("  %-*.*s %i\n", BS_TRACE_CTRL_NAME_LEN, BS_TRACE_CTRL_NAME_LEN, b->cats[i].name, b->cats[i].level);
+  }
+}
+
+/*
+ * Show or change the levels of the process owning the control file <name>
+ * Returns 0 if it was handled, -1 if it is stale or invalid
+ */
+static int handle(const char *dir, const char *name, bool change){
+  char path[strlen(dir) + strlen(name) + 2];
+  sprintf(path, "%s/%s", dir, name);
+
+  int fd = open(path, O_RDWR);
+  if ( fd == -1 ) {
+    return -1;
+  }
+  struct stat st;
+  void *ptr = MAP_FAILED;
+  if ( ( fstat(fd, &st) == 0 ) && ( st.st_size == sizeof(bs_trace_ctrl_block_t) ) ) {
+    ptr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if ( ptr == MAP_FAILED ) {
+    bs_trace_warning_line("%s is not a trace control file\n", path);
+    return -1;
+  }
+  bs_trace_ctrl_block_t *b = ptr;
+  int ret = -1;
+  char dev_name[strlen(name) + 1]; //Without the extension
+  strcpy(dev_name, name);
+  dev_name[strlen(name) - strlen(BS_TRACE_CTRL_EXT)] = 0;
+
+  if ( __atomic_load_n(&b->magic, __ATOMIC_ACQUIRE) != BS_TRACE_CTRL_MAGIC ) {
+    bs_trace_warning_line("%s is not a trace control file\n", path);
+  } else if ( ( kill(b->pid, 0) != 0 ) && ( errno == ESRCH ) ) {
+    bs_trace_raw(3, "Removing stale %s\n", path);
+    remove(path);
+  } else if ( !change ) {
+    show_levels(b, dev_name);
+    ret = 0;
+  } else {
+    uint32_t seq = __atomic_load_n(&b->seq, __ATOMIC_ACQUIRE);
+    ret = 0;
+    if ( place_requests(b, dev_name) == 0 ) {
+      const struct timespec wait = {0, 1000000};
+      uint waited_ms = 0;
+      if ( kill(b->pid, BS_TRACE_CTRL_SIGNAL) != 0 ) {
+        bs_trace_warning_line("Could not signal process %i (errno=%i)\n", b->pid, errno);
+      }
+      while ( ( __atomic_load_n(&b->seq, __ATOMIC_ACQUIRE) == seq ) && ( waited_ms++ < CTRL_ACK_WAIT_MS ) ) {
+        nanosleep(&wait, NULL);
+      }
+      if ( __atomic_load_n(&b->seq, __ATOMIC_ACQUIRE) == seq ) {
+        bs_trace_warning_line("%s: process %i did not apply the new levels (yet)\n", dev_name, b->pid);
+      }
+    }
+    show_levels(b, dev_name);
+  }
+  munmap(ptr, st.st_size);
+  return ret;
+}
+
+int main(int argc, char *argv[]){
+  bs_args_struct_t args_struct[] = {
+      { false, true , false, "s", "s_id", 's', (void*)&args.s_id, NULL, "Simulation id"},
+      { false, false, false, "d", "device_number", 'u', (void*)&args.dev_nbr, NULL, "Only this (global) device number (by default all)"},
+      { false, false, false, "v", "trace_level", 'i', (void*)&args.level, NULL, "Set the global trace level"},
+      { false, false, false, "vmod", "name:level[,..]", 's', (void*)&args.vmod, NULL, "Set the trace level of these trace categories"},
+      ARG_TABLE_ENDMARKER
+  };
+
+  bs_trace_set_prefix("trace_ctrl:");
+  bs_args_set_defaults(args_struct);
+  args.s_id = NULL;
+  args.dev_nbr = UINT_MAX;
+  args.level = INT_MIN;
+  args.vmod = NULL;
+  bs_args_parse_cmd_line(argc, argv, args_struct);
+  if ( args.s_id == NULL ) {
+    bs_args_print_switches_help(args_struct);
+    bs_trace_error_line("The command line option <simulation ID> needs to be set\n");
+  }
+  bool change = ( args.level != INT_MIN ) || ( args.vmod != NULL );
+
+  char *dir = bs_trace_collect_dir(args.s_id);
+  uint n_found = 0;
+
+  if ( args.dev_nbr != UINT_MAX ) {
+    char name[32];
+    sprintf(name, "d_%u%s", args.dev_nbr, BS_TRACE_CTRL_EXT);
+    if ( handle(dir, name, change) == 0 ) {
+      n_found++;
+    }
+  } else {
+    DIR *d = opendir(dir);
+    struct dirent *entry;
+    size_t ext_len = strlen(BS_TRACE_CTRL_EXT);
+    while ( ( d != NULL ) && ( ( entry = readdir(d) ) != NULL ) ) {
+      size_t len = strlen(entry->d_name);
+      if ( ( len > ext_len ) && ( strcmp(&entry->d_name[len - ext_len], BS_TRACE_CTRL_EXT) == 0 )
+          && ( handle(dir, entry->d_name, change) == 0 ) ) {
+        n_found++;
+      }
+    }
+    if ( d != NULL ) {
+      closedir(d);
+    }
+  }
+  free(dir);
+
+  if ( n_found == 0 ) {
+    bs_trace_error_line("No running process of simulation %s (run with -trace-ctrl) found\n", args.s_id);
+  }
+  return 0;
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright 2018 Oticon A/S
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+/**
+ * Decoder of binary trace files (see libUtilv1 bs_trace_binary.h) into the
+ * text traces the program would have printed
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "bs_tracing.h"
+#include "bs_oswrap.h"
+#include "bs_cmd_line.h"
+#include "bs_trace_binary.h"
+
+typedef struct {
+  char *in_file;
+  char *out_file;
+} decoder_args_t;
+
+char executable_name[] = "bs_trace_decoder";
+void component_print_post_help(){
+  fprintf(stdout,"\n"
+          "Convert a binary trace file (recorded with -trace-bin=<file>)\n"
+          "into the text traces the program would have printed\n\n");
+}
+
+int main(int argc, char *argv[]){
+  decoder_args_t args;
+
+  bs_args_struct_t args_struct[] = {
+      { false, false, false, "file", "file", 's', (void*)&args.in_file, NULL, "Binary trace file to decode (by default stdin)"},
+      { false, false, false, "o", "file", 's', (void*)&args.out_file, NULL, "Write the text traces to this file (by default stdout)"},
+      ARG_TABLE_ENDMARKER
+  };
+
+  bs_trace_set_prefix("");
+  bs_args_set_defaults(args_struct);
+  args.in_file = NULL;
+  args.out_file = NULL;
+  bs_args_parse_cmd_line(argc, argv, args_struct);
+
+  FILE *in = stdin;
+  FILE *out = stdout;
+  if ( args.in_file != NULL ) {
+    in = bs_fopen(args.in_file, "r");
+  }
+  if ( args.out_file != NULL ) {
+    out = bs_fopen(args.out_file, "w");
+  }
+
+  int ret = bs_trace_binary_decode(in, out);
+
+  if ( in != stdin ) {
+    fclose(in);
+  }
+  if ( out != stdout ) {
+    fclose(out);
+  }
+  return ( ret == 0 ) ? 0 : 1;
+}